@@ -3,48 +3,130 @@
  *
  * New_Alarm_Cond.c is an enhancement to the alarm_cond.c program,
  * which a condition variable to the alarm_mutex.c program. This
- * new version will have two periodic display threads in addition
- * to the main and alarm thread in the alarm_cond.c program.
+ * new version adds a pool of periodic display threads, one per
+ * processor, to the main and alarm thread in the alarm_cond.c
+ * program. The alarm thread schedules each alarm's displays and
+ * the pool prints them.
  */
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
-#include <semaphore.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "alarm_index.h"
+#include "slab.h"
+#include "rwlock.h"
+#include "parse.h"
+#include "intern.h"
+#include "sink.h"
+#include "arena.h"
+#include "order.h"
+
+#define ALARM_MESSAGE   128     /* Longest message, with its NUL */
 
 typedef struct alarm_tag {
     struct alarm_tag    *link;
+    struct alarm_tag    *prev;  /* Previous alarm, for unlinking */
     int                 seconds;
     int                 mssg_num; 
-    int                 cancel; 
-    int                 replacable;
-    time_t              time;   /* Seconds from EPOCH */
-    char                message[128]; /* Message */
+    int                 cancel;         /* Tombstone, set atomically */
+    int                 replacable;     /* 1 replaced, 2 announced */
+    int                 processed;
+    int                 heap_pos;       /* Index in alarm_heap */
+    time_t              time;   /* Next display, seconds from EPOCH */
+    const char          *message; /* In alarm_strings */
 } alarm_t;
 
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
 alarm_t *a_list = NULL;
-int curnt_alarm = 0;
+time_t curnt_alarm = 0;
 
 /*
- * In charge of printing the list of alarms. Since the function
- * needs to access the alarm list, we used a semaphore around
- * the code that prints the alarm list through the use of a
- * simple for loop.
+ * Every alarm on a_list is also entered in alarm_index under its
+ * message number. Whoever links or unlinks an alarm updates the
+ * index under the same lock, so lookups by number never need to
+ * walk the list.
+ */
+index_t alarm_index;
+
+/*
+ * The alarms on a_list are also kept in order of message number,
+ * and of message (then number), so that the alarms in a range of
+ * numbers, or with messages that start with a prefix, are found
+ * without walking the list (see order.h). Like alarm_index, these
+ * are updated wherever an alarm is linked or unlinked, and
+ * protected by list_lock.
+ */
+int alarm_compare_number(const void *a, const void *b) {
+    int x = ((const alarm_t*)a)->mssg_num, y = ((const alarm_t*)b)->mssg_num;
+
+    return x < y ? -1 : x > y;
+}
+
+int alarm_compare_message(const void *a, const void *b) {
+    int order = strcmp (((const alarm_t*)a)->message,
+        ((const alarm_t*)b)->message);
+
+    return order != 0 ? order : alarm_compare_number (a, b);
+}
+
+int alarm_before_number(const void *item, const void *key) {
+    return ((const alarm_t*)item)->mssg_num < *(const int*)key;
+}
+
+int alarm_before_message(const void *item, const void *key) {
+    return strcmp (((const alarm_t*)item)->message, (const char*)key) < 0;
+}
+
+order_t number_order = ORDER_INITIALIZER (alarm_compare_number);
+order_t message_order = ORDER_INITIALIZER (alarm_compare_message);
+
+/*
+ * Alarm requests are allocated from a slab rather than from
+ * malloc, since every command line allocates one.
+ */
+slab_t alarm_slab = SLAB_INITIALIZER (alarm_t);
+
+/*
+ * Messages are kept in a reference-counted string arena (arena.h),
+ * not in the alarms: alarms with the same text share one copy, and
+ * replacing an alarm's message, or handing it to a display thread,
+ * moves or takes a reference instead of copying the text.
+ */
+arena_t alarm_strings = ARENA_INITIALIZER;
+
+/*
+ * Free an alarm, and its reference to its message.
  */
-sem_t rw_mutex;
-sem_t mutex;
-int read_count = 0;
+void alarm_free(alarm_t *alarm) {
+    arena_release (&alarm_strings, alarm->message);
+    slab_free (&alarm_slab, alarm);
+}
+
+/*
+ * a_list and alarm_index are protected by list_lock, a
+ * reader-writer lock (see rwlock.h). Its policy is chosen at
+ * startup with "-l reader|writer|phase|pthread"; the default is
+ * phase-fair, so that neither readers nor writers can be starved.
+ */
+rwlock_t list_lock;
+int list_lock_kind = RWLOCK_PHASE_FAIR;
 
+/*
+ * In charge of printing the list of alarms. Since the function
+ * needs to access the alarm list, it holds the list lock for
+ * reading while it walks the list.
+ */
 void print_a_list() {
     alarm_t *next;
 
-    sem_wait(&mutex);
-    read_count++;
-    if(read_count == 1)
-        sem_wait(&rw_mutex);
-    sem_post(&mutex);
+    rwlock_read_lock(&list_lock);
 
     printf ("[list: ");
     for (next = a_list; next != NULL; next = next->link)
@@ -52,24 +134,15 @@ void print_a_list() {
             next->time - time (NULL), next->message);
     printf ("]\n");
 
-    sem_wait(&mutex);
-    read_count--;
-    if(read_count == 0)
-        sem_post(&rw_mutex);
-    sem_post(&mutex);
+    rwlock_read_unlock(&list_lock);
 }
 
-/* Fetches the alarm with the given alarm number to it. */
+/*
+ * Fetches the alarm with the given alarm number to it. The caller
+ * must hold list_lock, for reading or writing.
+ */
 alarm_t *get_alarm_at(int m_id) {
-    alarm_t *next;
-
-    if(a_list != NULL) {
-        for(next = a_list; next != NULL; next = next->link) {
-            if(next->mssg_num == m_id)
-                return next;
-        }
-    }
-    return 0;
+    return (alarm_t*) index_get(&alarm_index, m_id);
 }
 
 /*
@@ -77,7 +150,11 @@ alarm_t *get_alarm_at(int m_id) {
  * number of a newly received alarm request and return true or false.
  */
 int message_id_exists(int m_id) {
-    alarm_t *alarm = get_alarm_at(m_id);
+    alarm_t *alarm;
+
+    rwlock_read_lock(&list_lock);
+    alarm = get_alarm_at(m_id);
+    rwlock_read_unlock(&list_lock);
     
     if (alarm == NULL)
         return 0;
@@ -87,65 +164,223 @@ int message_id_exists(int m_id) {
 }
 
 /*
- * If an alarm request of Type A is received and there exists an
- * alarm of Type A in the alarm list with the same message number,
- * then the old alarm is replacable by this function.
+ * The alarm thread schedules every Type A alarm by its next
+ * display time, using a binary min-heap of the alarms on a_list.
+ * Each alarm remembers its position in the heap, so that a
+ * replaced alarm can be moved when its period changes. The heap is
+ * protected by alarm_mutex.
  */
-void find_and_replace(alarm_t *new_alarm) {
-    alarm_t *old_alarm;
-    int status;
+alarm_t **alarm_heap = NULL;
+int alarm_count = 0;
+int alarm_heap_size = 0;
 
-    sem_wait(&rw_mutex);
+/*
+ * Move the alarm at position "pos" down towards the leaves until
+ * it is no later than its children.
+ */
+void heap_sift_down (int pos)
+{
+    alarm_t *alarm = alarm_heap[pos];
+    int child;
 
-    old_alarm = get_alarm_at(new_alarm->mssg_num);
-    old_alarm->seconds = new_alarm->seconds;
-    old_alarm->time = time(NULL) + new_alarm->seconds;
-    old_alarm->replacable = 1;
-    strcpy(old_alarm->message , new_alarm->message);
+    while ((child = pos * 2 + 1) < alarm_count) {
+        if (child + 1 < alarm_count
+            && alarm_heap[child + 1]->time < alarm_heap[child]->time)
+            child++;
+        if (alarm->time <= alarm_heap[child]->time)
+            break;
+        alarm_heap[pos] = alarm_heap[child];
+        alarm_heap[pos]->heap_pos = pos;
+        pos = child;
+    }
+    alarm_heap[pos] = alarm;
+    alarm->heap_pos = pos;
+}
 
-    sem_post(&rw_mutex);
+/*
+ * Move the alarm at position "pos" up towards the root, or down
+ * towards the leaves, until the heap is ordered again.
+ */
+void heap_sift (int pos)
+{
+    alarm_t *alarm = alarm_heap[pos];
+    int parent, start = pos;
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (alarm_heap[parent]->time <= alarm->time)
+            break;
+        alarm_heap[pos] = alarm_heap[parent];
+        alarm_heap[pos]->heap_pos = pos;
+        pos = parent;
+    }
+    alarm_heap[pos] = alarm;
+    alarm->heap_pos = pos;
+    if (pos == start)
+        heap_sift_down (pos);
 }
 
 /*
- * Used to remove any nodes (alarm requests) from the alarm list.
+ * Order the first alarm_count alarms in the array into a heap,
+ * bottom up: each subtree is ordered before its root is sifted
+ * down into it, which takes O(n) moves in all, rather than the
+ * O(n log n) of pushing them one at a time.
  */
-void cancel_alarm (alarm_t *alarm) {
-    alarm_t *prev = a_list;
+void heap_build (void)
+{
+    int pos;
 
-    sem_wait(&rw_mutex);
+    for (pos = alarm_count / 2 - 1; pos >= 0; pos--)
+        heap_sift_down (pos);
+}
 
-    if(a_list != NULL) {
-        if(a_list != alarm) {
-            while(prev->link != NULL && prev->link != alarm)
-                prev = prev->link;
+void heap_push (alarm_t *alarm)
+{
+    alarm_t **new_heap;
 
-            if(prev->link != NULL)
-                prev->link = prev->link->link;
-        } 
-        else {
-            if(a_list->link != NULL)
-                a_list = a_list->link;
-            else
-                a_list = NULL;
-        }
+    if (alarm_count == alarm_heap_size) {
+        alarm_heap_size = alarm_heap_size ? alarm_heap_size * 2 : 64;
+        new_heap = (alarm_t**)realloc (
+            alarm_heap, alarm_heap_size * sizeof (alarm_t*));
+        if (new_heap == NULL)
+            errno_abort ("Grow alarm heap");
+        alarm_heap = new_heap;
+    }
+    alarm_heap[alarm_count] = alarm;
+    heap_sift (alarm_count++);
+}
+
+/*
+ * Take an alarm out of the heap, wherever it is, by moving the
+ * last alarm into its place.
+ */
+void heap_remove (alarm_t *alarm)
+{
+    int pos = alarm->heap_pos;
+
+    alarm_heap[pos] = alarm_heap[--alarm_count];
+    alarm_heap[pos]->heap_pos = pos;
+    if (pos < alarm_count)
+        heap_sift (pos);
+}
+
+/*
+ * Wake the alarm thread if it is not busy (curnt_alarm is 0), or
+ * if the alarm it is waiting for is no longer the earliest one.
+ */
+void alarm_wake(alarm_t *alarm) {
+    int status;
+
+    if (curnt_alarm == 0 || alarm->time < curnt_alarm) {
+        curnt_alarm = alarm->time;
+        status = pthread_cond_signal (&alarm_cond);
+        if (status != 0)
+            err_abort (status, "Signal cond");
+    }
+}
+
+/*
+ * Move an alarm's next display to "when", and let the alarm thread
+ * know if that is now the earliest. Replacing an alarm goes
+ * through here, so the alarm thread reacts to it at once rather
+ * than at the end of the old period.
+ *
+ * The caller must have locked the alarm_mutex.
+ */
+void alarm_reschedule(alarm_t *alarm, time_t when) {
+    heap_remove (alarm);
+    alarm->time = when;
+    heap_push (alarm);
+    alarm_wake (alarm);
+}
+
+/*
+ * Used to remove any nodes (alarm requests) from the alarm list,
+ * and its indexes. The list is doubly linked, so the node is
+ * unlinked in place without searching for its predecessor. An
+ * alarm that is no longer indexed -- a cancelled one whose number
+ * has been taken by a new alarm -- is left alone, so the call may
+ * be repeated. The caller must hold list_lock for writing.
+ */
+void alarm_unlink (alarm_t *alarm) {
+    if(get_alarm_at(alarm->mssg_num) == alarm) {
+        index_remove(&alarm_index, alarm->mssg_num);
+        if(alarm->prev != NULL)
+            alarm->prev->link = alarm->link;
+        else
+            a_list = alarm->link;
+        if(alarm->link != NULL)
+            alarm->link->prev = alarm->prev;
+        order_remove (&number_order, alarm);
+        order_remove (&message_order, alarm);
+    }
+}
+
+/*
+ * If an alarm request of Type A is received and there exists an
+ * alarm of Type A in the alarm list with the same message number,
+ * then the old alarm is replacable by this function. Its next
+ * display is rescheduled for the new period. The two alarms swap
+ * messages, so the old message is released when the new alarm is
+ * freed. Returns the old alarm.
+ *
+ * An alarm with a tombstone is already cancelled, and is not
+ * replaced: it is unlinked here, so that the new alarm can take its
+ * number, and is left in the heap for the alarm thread or the
+ * compactor to retire. Returns NULL if there is no live alarm with
+ * the number, and the caller inserts the new alarm instead. The
+ * lookup is made under the write lock, which a cancel's read lock
+ * excludes, so a cancel is seen either before or after the
+ * replacement, never half way.
+ *
+ * The caller must have locked the alarm_mutex.
+ */
+alarm_t *find_and_replace(alarm_t *new_alarm) {
+    alarm_t *old_alarm;
+    const char *message;
+
+    rwlock_write_lock(&list_lock);
+
+    old_alarm = get_alarm_at(new_alarm->mssg_num);
+    if (old_alarm != NULL
+        && __atomic_load_n (&old_alarm->cancel, __ATOMIC_SEQ_CST) > 0) {
+        alarm_unlink (old_alarm);
+        old_alarm = NULL;
     }
+    if (old_alarm == NULL) {
+        rwlock_write_unlock(&list_lock);
+        return NULL;
+    }
+    old_alarm->seconds = new_alarm->seconds;
+    old_alarm->replacable = 1;
+    order_remove (&message_order, old_alarm);
+    message = old_alarm->message;
+    old_alarm->message = new_alarm->message;
+    new_alarm->message = message;
+    order_put (&message_order, old_alarm);
+
+    rwlock_write_unlock(&list_lock);
 
-    sem_post(&rw_mutex);
+    alarm_reschedule (old_alarm, time(NULL) + new_alarm->seconds);
+    return old_alarm;
 }
 
 /*
- * Wakes the alarm thread if it is not busy, or if a new alarm
- * arrives before the one on which the alarm thread is waiting for.
- * CHANGED SOME WHILE LOOPS 
+ * Links a new alarm into a_list, sorted by message number, and
+ * schedules its first display.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the
+ * alarm_mutex!
  */
 void alarm_insert(alarm_t *alarm) {
-    int s;
     alarm_t **last;
-    alarm_t *next;
+    alarm_t *next, *prev = NULL;
+    bool flag = true;
+    rwlock_write_lock(&list_lock);
     last = &a_list;
     next = *last;
-    bool flag = true;
-    sem_wait(&rw_mutex);
     
     
     while (next) {
@@ -156,6 +391,7 @@ void alarm_insert(alarm_t *alarm) {
                 break;
             }
         }
+        prev = next;
         last = &next->link;
         next = next->link;
     }
@@ -164,231 +400,2253 @@ void alarm_insert(alarm_t *alarm) {
         *last = alarm;
         alarm->link = NULL;
     }
+    alarm->prev = prev;
+    if (alarm->link != NULL)
+        alarm->link->prev = alarm;
+    index_put(&alarm_index, alarm->mssg_num, alarm);
+    order_put (&number_order, alarm);
+    order_put (&message_order, alarm);
 
     
-    printf("First Alarm Request With Message Number (%d) Received at <%ld>: <%d %s>\n",
+    sink_printf("First Alarm Request With Message Number (%d) Received at <%ld>: <%d %s>\n",
         alarm->mssg_num, time(NULL), alarm->seconds, alarm->message);
 
-    
-    if (curnt_alarm == 0) {
-        int current = alarm->time;
-        curnt_alarm = current;
-        s = (pthread_cond_signal (&alarm_cond))- 1;
-        s = s+1; //test
-        if (s > 0 || s < 0)
-            err_abort (s, "Signal cond");
+    rwlock_write_unlock(&list_lock);
 
-    }
+    heap_push (alarm);
+    alarm_wake (alarm);
+}
 
-    else if( alarm->time < curnt_alarm){
-        int current = alarm->time;
-        curnt_alarm = current;
-        s = (pthread_cond_signal (&alarm_cond))- 1;
-        s = s+1; //test
-        if (s > 0 || s < 0)
-            err_abort (s, "Signal cond");
-    }
-    
+/*
+ * The periodic displays are printed by a fixed pool of display
+ * threads, one per processor, no matter how many alarms are
+ * loaded. When an alarm's display time comes round, the alarm
+ * thread copies what is to be printed into a display_job_t and
+ * queues it for the pool; the alarm itself is then rescheduled
+ * for its next period. Because a job carries a copy rather than
+ * a pointer to the alarm, a display thread never touches an alarm
+ * that may since have been replaced or cancelled and freed. The
+ * job holds a reference of its own to the message, which the
+ * display thread releases once it has printed it.
+ */
+#define DISPLAY_SHOW    0       /* Periodic display */
+#define DISPLAY_EXIT    1       /* Alarm was cancelled */
 
-    sem_post(&rw_mutex);
+typedef struct display_job_tag {
+    int                 kind;
+    int                 replaced;       /* alarm->replacable */
+    int                 mssg_num;
+    int                 seconds;
+    const char          *message;       /* In alarm_strings */
+} display_job_t;
+
+pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t display_cond = PTHREAD_COND_INITIALIZER;
+display_job_t *display_queue = NULL;    /* Circular, grows as needed */
+int display_first = 0;
+int display_count = 0;
+int display_size = 0;
+int display_threads = 0;
+
+/*
+ * Queue a job for the display pool, taking a copy of the alarm.
+ * Called by the alarm thread with the alarm_mutex locked, which
+ * keeps the alarm from being replaced while it is copied.
+ */
+void display_post(alarm_t *alarm, int kind) {
+    display_job_t *job, *new_queue;
+    int status, i;
+
+    status = pthread_mutex_lock (&display_mutex);
+    if (status != 0)
+        err_abort (status, "Lock display mutex");
+    if (display_count == display_size) {
+        new_queue = (display_job_t*)malloc (
+            (display_size ? display_size * 2 : 64) * sizeof (display_job_t));
+        if (new_queue == NULL)
+            errno_abort ("Grow display queue");
+        for (i = 0; i < display_count; i++)
+            new_queue[i] = display_queue[(display_first + i) % display_size];
+        free (display_queue);
+        display_queue = new_queue;
+        display_first = 0;
+        display_size = display_size ? display_size * 2 : 64;
+    }
+    job = &display_queue[(display_first + display_count++) % display_size];
+    job->kind = kind;
+    job->replaced = alarm->replacable;
+    job->mssg_num = alarm->mssg_num;
+    job->seconds = alarm->seconds;
+    job->message = arena_ref (&alarm_strings, alarm->message);
+    status = pthread_cond_signal (&display_cond);
+    if (status != 0)
+        err_abort (status, "Signal display cond");
+    status = pthread_mutex_unlock (&display_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock display mutex");
 }
 
 /*
- * Responsible for, as the name suggests, periodically going
- * through the alarm list looking for Type A alarms and printing
- * the appropriate message every Time seconds, where Time is the
- * time of the alarm request originally provided when the alarm
- * request was received.
+ * Responsible for, as the name suggests, printing the periodic
+ * display of Type A alarms. Each display thread of the pool waits
+ * for a job from the alarm thread and prints it: the regular
+ * display, the display of an alarm that has been replaced
+ * (announcing the replacement the first time), or the notice that
+ * a cancelled alarm's display has ended.
  */
-void *periodic_display_thread(void *alarm_in) {
-    int alarm_replacable = 0;
-    alarm_t *alarm = (alarm_t*) alarm_in;
-    alarm_t *next;
+void *periodic_display_thread(void *arg) {
+    display_job_t job;
     int status;
 
     while(1) {
-        if(a_list) {
-            next = a_list;
+        status = pthread_mutex_lock (&display_mutex);
+        if (status != 0)
+            err_abort (status, "Lock display mutex");
+        while (display_count == 0) {
+            status = pthread_cond_wait (&display_cond, &display_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on display cond");
+        }
+        job = display_queue[display_first];
+        display_first = (display_first + 1) % display_size;
+        display_count--;
+        status = pthread_mutex_unlock (&display_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock display mutex");
+
+        if (job.kind == DISPLAY_EXIT) {
+            sink_printf("Display thread exiting at <%ld>: <%d %s>\n",
+                time(NULL), job.seconds, job.message);
+        } else if (job.replaced) {
+            if (job.replaced == 1)
+                sink_printf("Alarm With Message Number (%d) replacable at <%ld>: <%d %s>\n",
+                    job.mssg_num, time(NULL), job.seconds, job.message);
+            sink_printf("Replacement Alarm With Message Number (%d) Displayed at <%ld>: <%d %s>\n",
+                job.mssg_num, time(NULL), job.seconds, job.message);
+        } else {
+            sink_printf("Alarm With Message Number (%d) Displayed at <%ld>: <%d %s>\n",
+                job.mssg_num, time(NULL), job.seconds, job.message);
+        }
+        arena_release (&alarm_strings, job.message);
+    }
+    return 0;
+}
 
-            sem_wait(&mutex);
-            read_count++;
-            if(read_count == 1)
-                sem_wait(&rw_mutex);
-            sem_post(&mutex);
+/*
+ * Start the display pool, with one display thread per processor.
+ */
+void display_start(void) {
+    pthread_t display_t;
+    long processors;
+    int status, i;
 
-            while(next->mssg_num != alarm->mssg_num)
-                next = next->link;
+    processors = sysconf (_SC_NPROCESSORS_ONLN);
+    display_threads = processors > 0 ? (int)processors : 1;
+    for (i = 0; i < display_threads; i++) {
+        status = pthread_create (
+            &display_t, NULL, periodic_display_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create periodic display thread");
+    }
+}
 
-            if(next == NULL || alarm->cancel > 0) {
-                printf("Display thread exiting at <%ld>: <%d %s>\n",
-                    time(NULL), alarm->seconds, alarm->message);
-                break;
-            } else if(next->replacable == 1) {
-                if(alarm_replacable == 0) {
-                     printf("Alarm With Message Number (%d) replacable at <%ld>: <%d %s>\n",
-                    alarm->mssg_num, time(NULL), alarm->seconds, alarm->message);
-                }
-
-                printf("Replacement Alarm With Message Number (%d) Displayed at <%ld>: <%d %s>\n",
-                    next->mssg_num, time(NULL), next->seconds, next->message);
-                alarm_replacable = 1;
-                sleep(next->seconds);
-            } else {
-                printf("Alarm With Message Number (%d) Displayed at <%ld>: <%d %s>\n",
-                    alarm->mssg_num, time(NULL), alarm->seconds, alarm->message);
-                sleep(alarm->seconds);
-            }
+/*
+ * Cancelling an alarm only marks it with a tombstone: a flag set
+ * with one atomic exchange, on an alarm found through alarm_index
+ * with list_lock held for reading, which keeps the alarm from
+ * being retired and freed meanwhile. A cancel takes neither the
+ * alarm_mutex nor list_lock for writing, so it never waits for
+ * the alarm thread, however busy it is.
+ *
+ * The tombstoned alarm stays in the heap. When it reaches the top
+ * of the heap, the alarm thread retires it at once, whenever it
+ * was due: it is unlinked, the display pool announces that its
+ * display has ended, and it is freed. Alarms with long periods
+ * could leave the heap full of tombstones meanwhile, so once more
+ * than one in COMPACT_RATIO of the alarms in the heap are
+ * tombstones (and there are at least COMPACT_MIN of them), the
+ * compactor thread rebuilds the heap from the live alarms and
+ * retires the rest all at once.
+ */
+#define COMPACT_RATIO   4
+#define COMPACT_MIN     1024
 
-            sem_wait(&mutex);
-            read_count--;
-            if(read_count == 0)
-                sem_post(&rw_mutex);
-            sem_post(&mutex);
+long tombstones = 0;            /* Tombstoned alarms in the heap */
+long compactions = 0;
+alarm_t *alarm_waiting = NULL;  /* heap[0], as the alarm thread saw it */
+int cancel_wake = 0;            /* ... and it has been cancelled */
+int compact_wanted = 0;
+pthread_mutex_t compact_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
 
-        }
+/*
+ * Mark "alarm" with a tombstone. Returns 0 if it had one already.
+ * If the alarm thread may be waiting for this alarm, cancel_wake is
+ * set, and the caller must call cancel_wake_up once it has let go
+ * of list_lock, so that the alarm is retired at once rather than
+ * when the wait ends.
+ *
+ * The caller must hold list_lock, for reading or writing.
+ */
+int cancel_alarm (alarm_t *alarm) {
+    long dead;
+    int status;
+
+    if (__atomic_exchange_n (&alarm->cancel, 1, __ATOMIC_SEQ_CST) != 0)
+        return 0;
+    if (alarm == __atomic_load_n (&alarm_waiting, __ATOMIC_SEQ_CST))
+        __atomic_store_n (&cancel_wake, 1, __ATOMIC_SEQ_CST);
+    dead = __atomic_add_fetch (&tombstones, 1, __ATOMIC_SEQ_CST);
+    if (dead >= COMPACT_MIN && dead * COMPACT_RATIO
+        > __atomic_load_n (&alarm_count, __ATOMIC_RELAXED)) {
+        status = pthread_mutex_lock (&compact_mutex);
+        if (status != 0)
+            err_abort (status, "Lock compact mutex");
+        compact_wanted = 1;
+        status = pthread_cond_signal (&compact_cond);
+        if (status != 0)
+            err_abort (status, "Signal compact cond");
+        status = pthread_mutex_unlock (&compact_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock compact mutex");
     }
-    return 0;
+    return 1;
 }
 
 /*
- * Tasked with actually processing each alarm request. As such,
- * it will go through the alarm list and use the get_alarm_at
- * function to fetch each alarm, and if it encounters an alarm
- * of Type A, it immediately creates a periodic display thread.
- * If it is an alarm of Type B, it uses the function cancel_alarm
- * to remove the appropriate nodes (alarm requests) from the alarm
- * list. Lastly, it will print a message to the user to let them know
- * the alarm has been processed and the time at which it was processed.
- *  CHANGED ********************
+ * Wake the alarm thread if cancel_alarm found it waiting for the
+ * alarm it cancelled. The alarm thread publishes alarm_waiting
+ * before it looks at the tombstone, and holds the alarm_mutex from
+ * there into its wait, so either it sees the tombstone or this
+ * broadcast reaches it. The caller must not hold list_lock, which
+ * the alarm thread takes with the alarm_mutex locked.
  */
-void *alarm_thread(void *arg) {
-    pthread_t display_t;
+void cancel_wake_up (void) {
+    int status;
+
+    if (!__atomic_exchange_n (&cancel_wake, 0, __ATOMIC_SEQ_CST))
+        return;
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    status = pthread_cond_broadcast (&alarm_cond);
+    if (status != 0)
+        err_abort (status, "Broadcast cond");
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Retire a tombstoned alarm that has been taken out of the heap.
+ * The caller must have locked the alarm_mutex, and hold list_lock
+ * for writing.
+ */
+void alarm_retire (alarm_t *alarm) {
+    alarm_unlink (alarm);
+    display_post (alarm, DISPLAY_EXIT);
+    alarm_free (alarm);
+    __atomic_sub_fetch (&tombstones, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Rebuild the heap from its live alarms, retiring the tombstoned
+ * ones, whenever cancel_alarm asks.
+ */
+void *compact_thread(void *arg) {
     alarm_t *alarm;
-    int status, expired;
-    int alarm_stat = 0;
-   bool flag = true;
-if(flag){
-    while(flag) {
-        if (a_list == NULL) {
-            break;
+    int status, i, live;
+
+    while (1) {
+        status = pthread_mutex_lock (&compact_mutex);
+        if (status != 0)
+            err_abort (status, "Lock compact mutex");
+        while (!compact_wanted) {
+            status = pthread_cond_wait (&compact_cond, &compact_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on compact cond");
         }
-        else{
-            alarm = get_alarm_at(curnt_alarm);
+        compact_wanted = 0;
+        status = pthread_mutex_unlock (&compact_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock compact mutex");
 
-            if(alarm->cancel == 0){
-                status = pthread_create(&display_t, NULL, periodic_display_thread, (void *)alarm);
-                if(status > 0 || status < 0)
-                    err_abort(status, "Create periodic display thread");
-            }
-            else if (alarm->cancel == 0){
-                alarm_stat ++;
-            } 
+        status = pthread_mutex_lock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        rwlock_write_lock(&list_lock);
+        for (i = live = 0; i < alarm_count; i++) {
+            alarm = alarm_heap[i];
+            if (__atomic_load_n (&alarm->cancel, __ATOMIC_SEQ_CST) > 0)
+                alarm_retire (alarm);
             else {
-                cancel_alarm(alarm);
+                alarm->heap_pos = live;
+                alarm_heap[live++] = alarm;
             }
-            printf("The Alarm with the message number (%d) was processed at <%ld>: <%d %s>\n",
-                alarm->mssg_num, time(NULL), alarm->seconds, alarm->message);
-            int stat = pthread_cond_wait (&alarm_cond, &alarm_mutex);
-            status = stat;
-            if(status > 0 || status < 0)
-                err_abort (status, "Cond should be waited on");
         }
+        alarm_count = live;
+        heap_build ();
+        compactions++;
+        rwlock_write_unlock(&list_lock);
+        status = pthread_mutex_unlock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
     }
+    return NULL;
+}
+
+/*
+ * Tasked with actually processing each alarm request. The alarm
+ * thread waits until the earliest display time in the heap, hands
+ * that alarm to the display pool, and puts it back in the heap
+ * for its next period. An alarm with a tombstone is retired as
+ * soon as it reaches the top of the heap, without waiting for its
+ * display time. The first time an alarm is handled, a message lets
+ * the user know the alarm has been processed and the time at which
+ * it was processed.
+ */
+void *alarm_thread(void *arg) {
+    alarm_t *alarm;
+    struct timespec cond_time;
+    time_t now;
+    int status;
 
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    while (1) {
+        curnt_alarm = 0;
+        while (alarm_count == 0) {
+            status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on cond");
+        }
+        alarm = alarm_heap[0];
+        now = time (NULL);
+        __atomic_store_n (&alarm_waiting, alarm, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&alarm->cancel, __ATOMIC_SEQ_CST) > 0) {
+            heap_remove (alarm);
+            rwlock_write_lock(&list_lock);
+            alarm_retire (alarm);
+            rwlock_write_unlock(&list_lock);
+            continue;
+        }
+        if (alarm->time > now) {
+            /*
+             * Whether the wait times out or an earlier alarm
+             * wakes it, go round again to look at the heap.
+             */
+            curnt_alarm = alarm->time;
+            cond_time.tv_sec = alarm->time;
+            cond_time.tv_nsec = 0;
+            status = pthread_cond_timedwait (
+                &alarm_cond, &alarm_mutex, &cond_time);
+            if (status != 0 && status != ETIMEDOUT)
+                err_abort (status, "Cond timedwait");
+            continue;
+        }
+        heap_remove (alarm);
+        if (!alarm->processed) {
+            sink_printf("The Alarm with the message number (%d) was processed at <%ld>: <%d %s>\n",
+                alarm->mssg_num, now, alarm->seconds, alarm->message);
+            alarm->processed = 1;
+        }
+        display_post (alarm, DISPLAY_SHOW);
+        if (alarm->replacable == 1)
+            alarm->replacable = 2;
+        alarm->time += alarm->seconds;
+        if (alarm->time <= now)
+            alarm->time = now + alarm->seconds;
+        heap_push (alarm);
+    }
 }
+
+/*
+ * Alarms brought back after a restart may have fallen due while
+ * the program was down. With OVERDUE_FIRE they are displayed at
+ * once; with OVERDUE_SKIP the missed displays are skipped, and the
+ * next is at the first period boundary after "now".
+ */
+#define OVERDUE_FIRE            0
+#define OVERDUE_SKIP            1
+
+void alarm_catch_up(alarm_t *alarm, time_t now, int policy) {
+    if (alarm->time >= now)
+        return;
+    if (policy == OVERDUE_SKIP)
+        alarm->time += ((now - alarm->time) / alarm->seconds + 1)
+            * alarm->seconds;
+    else
+        alarm->time = now;
 }
 
 /*
- * In charge of receiving each alarm request and taking appropriate
- * actions with regard to how they should be handled.
+ * The write-ahead log. With "-W file", every insert, replacement
+ * and cancel is appended to the log once it has been made, so that
+ * after a crash the alarms can be rebuilt by restoring the last
+ * snapshot and replaying the log over it. A record holds the
+ * alarm's whole state rather than the change made to it, so
+ * replaying a record, or a run of records, twice does no harm.
+ *
+ * Records are not written one at a time. wal_append copies each
+ * into wal_buffer, and the WAL thread writes out everything
+ * buffered with one write, and (unless the sync policy is
+ * WAL_SYNC_NONE) one fdatasync, as soon as WAL_BATCH records have
+ * collected or WAL_INTERVAL_MS after the first of them: a group
+ * commit. With WAL_SYNC_BATCH, the default, a command is durable
+ * within about WAL_INTERVAL_MS of being made; with
+ * WAL_SYNC_ALWAYS, the command waits in wal_wait until its record
+ * is on disk, once it has let go of alarm_mutex and list_lock, so
+ * that the alarm thread does not wait for the disk with it.
+ *
+ * A record is a wal_record_t followed by "length" bytes of
+ * message. Its checksum covers both, so a record torn by a crash
+ * is recognized, and the log is cut off there.
+ *
+ * Each snapshot is a checkpoint. Before the alarms are copied,
+ * the log is renamed to "file.old" and a new one started; once
+ * the snapshot is safely in place, "file.old" is removed. If the
+ * program dies in between, both logs are replayed over the older
+ * snapshot.
  */
-int main (int argc, char *argv[]) {
-    int status;
-    int cancel_message_id = 0;
-    char line[256];
-    alarm_t *alarm;
-    pthread_t thread;
+#define WAL_INSERT              1
+#define WAL_REPLACE             2
+#define WAL_CANCEL              3
 
-    //semaphore init
-    // sem_init(&mutex, 0, 1);
-    // sem_init(&rw_mutex, 0, 1);
+#define WAL_SYNC_NONE           0       /* Leave it to the system */
+#define WAL_SYNC_BATCH          1       /* fdatasync each group */
+#define WAL_SYNC_ALWAYS         2       /* ... and wait for it */
 
-    status = pthread_create (&thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort (status, "Create alarm thread");
+#define WAL_BATCH               1024    /* Records per group, at most */
+#define WAL_INTERVAL_MS         10
 
-        // Clear the terminal window.
-        printf("\e[1;1H\e[2J");
+typedef struct wal_record_tag {
+    uint32_t            checksum;
+    uint8_t             type;
+    uint8_t             length;         /* Of the message */
+    uint16_t            reserved;
+    int32_t             mssg_num;
+    int32_t             seconds;
+    int64_t             time;           /* Next display, from EPOCH */
+} wal_record_t;
 
-        // Input instructions for the user.
-        printf("Please enter an alarm request in the following format: # Message(*) ActualMessage\n");
-        printf("# - the number of seconds until the alarm iterates\n");
-        printf("* - the message number\n");
-        printf("ActualMessage - the message that will be displayed when the alarm iterates\n");
-        printf("Example: 2 Message(2) Hello!\n");
-        printf("You may add successive alarm requests in the same format at any time during execution\n");
-        printf("To cancel an alarm request, use the following format: Cancel: Message(*)\n");
-        printf("Disclaimer: Some alternate inputs will be dealt with accordingly,\n\n");
+static const char *wal_sync_names[] = {"none", "batch", "always"};
 
-    while (1) {
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
-        if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
+pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;     /* To write */
+pthread_cond_t wal_done_cond = PTHREAD_COND_INITIALIZER; /* Written */
+const char *wal_path = NULL;
+int wal_fd = -1;
+int wal_sync = WAL_SYNC_BATCH;
+int wal_started = 0;            /* The WAL thread is running */
+char *wal_buffer = NULL;        /* Records waiting to be written */
+int wal_used = 0;
+int wal_size = 0;
+int wal_pending = 0;            /* Records in wal_buffer */
+int wal_draining = 0;           /* Someone waits for all records */
+unsigned long wal_appended = 0; /* Records appended, ever */
+unsigned long wal_written = 0;  /* ... and written out */
 
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
+uint32_t wal_checksum(const wal_record_t *record, const char *message) {
+    const unsigned char *p = (const unsigned char*)record + sizeof (uint32_t);
+    const unsigned char *end = (const unsigned char*)(record + 1);
+    uint32_t h = 2166136261u;
+    int i;
 
-        int insert_command_parse = sscanf(line, "%d Message(%d) %128[^\n]",
-            &alarm->seconds, &alarm->mssg_num, alarm->message);
-        int cancel_command_parse = sscanf(line, "Cancel: Message(%d)", &cancel_message_id);
+    while (p < end)
+        h = (h ^ *p++) * 16777619u;
+    for (i = 0; i < record->length; i++)
+        h = (h ^ (unsigned char)message[i]) * 16777619u;
+    return h;
+}
 
-        if(insert_command_parse == 3 && alarm->seconds > 0 && alarm->mssg_num > 0) {
-            // Check if the mssg_num exits in the alarm list
-            if(message_id_exists(alarm->mssg_num) == 0) {
-                alarm->time = time (NULL) + alarm->seconds;
-                alarm->cancel = 0;
-                alarm->replacable = 0;
-                curnt_alarm = alarm->mssg_num;
+/*
+ * Log the state of "alarm" after an insert, replacement or cancel.
+ * Records reach the log in the order they are appended, which is
+ * the order of the commands, since main makes them all.
+ *
+ * For an insert or replacement, the caller must have locked the
+ * alarm_mutex, under which the alarm thread moves alarm->time. A
+ * cancel is logged under list_lock alone, without the time, which
+ * recovery does not need to drop the alarm.
+ *
+ * Returns the record's log sequence number, for wal_wait, or 0 if
+ * there is no log.
+ */
+unsigned long wal_append(int type, alarm_t *alarm) {
+    wal_record_t record;
+    unsigned long lsn;
+    int status, length;
 
-                status = pthread_mutex_lock (&alarm_mutex);
-                if (status != 0)
-                    err_abort (status, "Lock mutex");
+    if (wal_path == NULL)
+        return 0;
+    length = strlen (alarm->message);
+    memset (&record, 0, sizeof (record));
+    record.type = type;
+    record.length = length;
+    record.mssg_num = alarm->mssg_num;
+    record.seconds = alarm->seconds;
+    if (type != WAL_CANCEL)
+        record.time = alarm->time;
+    record.checksum = wal_checksum (&record, alarm->message);
 
-                /*
-                 * Insert the new alarm into the list of alarms,
-                 * sorted by mssg_num.
-                 */
-                alarm_insert (alarm);
-                pthread_cond_signal(&alarm_cond);
+    status = pthread_mutex_lock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Lock WAL mutex");
+    if (wal_used + sizeof (record) + length > wal_size) {
+        wal_size = (wal_used + sizeof (record) + length) * 2;
+        wal_buffer = (char*)realloc (wal_buffer, wal_size);
+        if (wal_buffer == NULL)
+            errno_abort ("Grow WAL buffer");
+    }
+    memcpy (wal_buffer + wal_used, &record, sizeof (record));
+    memcpy (wal_buffer + wal_used + sizeof (record), alarm->message, length);
+    wal_used += sizeof (record) + length;
+    lsn = ++wal_appended;
+    if (++wal_pending == 1 || wal_pending >= WAL_BATCH
+        || wal_sync == WAL_SYNC_ALWAYS) {
+        status = pthread_cond_signal (&wal_cond);
+        if (status != 0)
+            err_abort (status, "Signal WAL cond");
+    }
+    status = pthread_mutex_unlock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock WAL mutex");
+    return lsn;
+}
 
-                status = pthread_mutex_unlock (&alarm_mutex);
-                if (status != 0)
-                    err_abort (status, "Unlock mutex");
-            } else {
-                find_and_replace(alarm);
-                // A3.2.2 Print Statement
-                printf("Replacement Alarm Request With Message Number (%d) Received at <%ld>: <%d %s>\n",
-                    alarm->mssg_num, time(NULL), alarm->seconds, alarm->message);
-            }
+/*
+ * With WAL_SYNC_ALWAYS, wait until the record "lsn" (and so every
+ * record before it) is on disk. The caller must not hold the
+ * alarm_mutex or list_lock.
+ */
+void wal_wait(unsigned long lsn) {
+    int status;
 
-        } else if(cancel_command_parse == 1)  {
-            if(message_id_exists(cancel_message_id) == 0) {
-                printf("Error: No Alarm Request With Message Number (%d) to Cancel!\n", cancel_message_id);
-            } else{
-                alarm_t *at_alarm = get_alarm_at(cancel_message_id);
-                if (at_alarm->cancel > 0)
-                    printf("Error: More Than One Request to Cancel Alarm Request With Message Number (%d)!\n", cancel_message_id);
-                else {
-                    at_alarm->cancel = at_alarm->cancel + 1;
-                    curnt_alarm = at_alarm->mssg_num;
-                    pthread_cond_signal(&alarm_cond);
-                    printf("Cancel Alarm Request With Message Number (%d) Received at <%ld>: <%d %s>\n",
-                        at_alarm->mssg_num, time(NULL), at_alarm->seconds, at_alarm->message);
-                }
-            }
+    if (lsn == 0 || wal_sync != WAL_SYNC_ALWAYS)
+        return;
+    status = pthread_mutex_lock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Lock WAL mutex");
+    while (wal_written < lsn) {
+        status = pthread_cond_wait (&wal_done_cond, &wal_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on WAL cond");
+    }
+    status = pthread_mutex_unlock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock WAL mutex");
+}
+
+/*
+ * The WAL thread. It waits for a record, gives others up to
+ * WAL_INTERVAL_MS to join it, then takes the whole buffer -- the
+ * appenders carry on into the thread's previous buffer, so the two
+ * alternate -- and writes it out with wal_mutex unlocked.
+ */
+void *wal_thread(void *arg) {
+    struct timespec deadline;
+    char *buffer = NULL, *swap;
+    unsigned long lsn;
+    int status, size = 0, swap_size, used, done, fd;
+
+    status = pthread_mutex_lock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Lock WAL mutex");
+    while (1) {
+        while (wal_pending == 0) {
+            status = pthread_cond_wait (&wal_cond, &wal_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on WAL cond");
+        }
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAL_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (wal_pending < WAL_BATCH && wal_sync != WAL_SYNC_ALWAYS
+            && wal_draining == 0) {
+            status = pthread_cond_timedwait (&wal_cond, &wal_mutex, &deadline);
+            if (status == ETIMEDOUT)
+                break;
+            if (status != 0)
+                err_abort (status, "Timedwait on WAL cond");
+        }
+        swap = wal_buffer;
+        wal_buffer = buffer;
+        buffer = swap;
+        swap_size = wal_size;
+        wal_size = size;
+        size = swap_size;
+        used = wal_used;
+        wal_used = 0;
+        wal_pending = 0;
+        lsn = wal_appended;
+        fd = wal_fd;
+        status = pthread_mutex_unlock (&wal_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock WAL mutex");
+
+        for (done = 0; done < used; done += status)
+            if ((status = write (fd, buffer + done, used - done)) < 0)
+                errno_abort ("Write WAL");
+        if (wal_sync != WAL_SYNC_NONE && fdatasync (fd) != 0)
+            errno_abort ("Sync WAL");
+
+        status = pthread_mutex_lock (&wal_mutex);
+        if (status != 0)
+            err_abort (status, "Lock WAL mutex");
+        wal_written = lsn;
+        status = pthread_cond_broadcast (&wal_done_cond);
+        if (status != 0)
+            err_abort (status, "Broadcast WAL cond");
+    }
+    return NULL;
+}
+
+/*
+ * Wait until every record appended so far has been written.
+ *
+ * The caller must have locked wal_mutex.
+ */
+void wal_drain(void) {
+    int status;
+
+    wal_draining++;
+    status = pthread_cond_signal (&wal_cond);
+    if (status != 0)
+        err_abort (status, "Signal WAL cond");
+    while (wal_written < wal_appended) {
+        status = pthread_cond_wait (&wal_done_cond, &wal_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on WAL cond");
+    }
+    wal_draining--;
+}
+
+/*
+ * Start logging to "path", with the given sync policy.
+ */
+void wal_open(const char *path, int sync) {
+    pthread_t thread;
+    int status;
+
+    status = pthread_mutex_lock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Lock WAL mutex");
+    wal_drain ();
+    if (wal_fd >= 0)
+        close (wal_fd);
+    wal_fd = open (path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (wal_fd < 0)
+        errno_abort ("Open WAL");
+    wal_path = path;
+    wal_sync = sync;
+    if (!wal_started) {
+        status = pthread_create (&thread, NULL, wal_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create WAL thread");
+        wal_started = 1;
+    }
+    status = pthread_mutex_unlock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock WAL mutex");
+}
+
+/*
+ * Write out everything logged so far, before the program exits.
+ */
+void wal_flush(void) {
+    int status;
+
+    if (wal_path == NULL)
+        return;
+    status = pthread_mutex_lock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Lock WAL mutex");
+    wal_drain ();
+    status = pthread_mutex_unlock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock WAL mutex");
+}
+
+/*
+ * Start a new log for a checkpoint: write out the current one,
+ * rename it to "file.old" and open a fresh "file". If the last
+ * checkpoint failed, "file.old" is still there, and still needed,
+ * so the current log is kept as it is; the next snapshot covers
+ * both, and replaying the current log over it does no harm.
+ */
+void wal_rotate(void) {
+    char old[PATH_MAX];
+    int status;
+
+    if (wal_path == NULL)
+        return;
+    snprintf (old, sizeof (old), "%s.old", wal_path);
+    status = pthread_mutex_lock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Lock WAL mutex");
+    wal_drain ();
+    if (access (old, F_OK) == 0) {
+        status = pthread_mutex_unlock (&wal_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock WAL mutex");
+        return;
+    }
+    if (rename (wal_path, old) != 0)
+        errno_abort ("Rename WAL");
+    close (wal_fd);
+    wal_fd = open (wal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (wal_fd < 0)
+        errno_abort ("Open WAL");
+    status = pthread_mutex_unlock (&wal_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock WAL mutex");
+}
+
+/*
+ * Finish a checkpoint, once its snapshot is in place, by removing
+ * the log it replaces.
+ */
+void wal_retire(void) {
+    char old[PATH_MAX];
+
+    if (wal_path == NULL)
+        return;
+    snprintf (old, sizeof (old), "%s.old", wal_path);
+    if (unlink (old) != 0 && errno != ENOENT)
+        errno_abort ("Remove old WAL");
+}
+
+/*
+ * Apply one logged record to alarm_index. Recovery works on the
+ * index alone, and rebuilds a_list and the heap from it at the
+ * end.
+ */
+void wal_apply(const wal_record_t *record, const char *message) {
+    alarm_t *alarm;
+
+    alarm = get_alarm_at(record->mssg_num);
+    if (record->type == WAL_CANCEL) {
+        if (alarm != NULL) {
+            index_remove(&alarm_index, record->mssg_num);
+            alarm_free (alarm);
+        }
+        return;
+    }
+    if (alarm == NULL) {
+        alarm = (alarm_t*)slab_alloc (&alarm_slab);
+        alarm->message = NULL;
+        alarm->mssg_num = record->mssg_num;
+        alarm->cancel = 0;
+        alarm->replacable = 0;
+        alarm->processed = 0;
+        index_put(&alarm_index, alarm->mssg_num, alarm);
+    }
+    if (record->type == WAL_REPLACE)
+        alarm->replacable = 1;
+    alarm->seconds = record->seconds;
+    alarm->time = record->time;
+    arena_release (&alarm_strings, alarm->message);
+    alarm->message = arena_put (&alarm_strings, message);
+}
+
+/*
+ * Replay the log in "path", cutting off any torn record at its
+ * end. Returns the number of records replayed, or -1 if there is
+ * no log.
+ */
+int wal_replay(const char *path) {
+    wal_record_t record;
+    char message[256];
+    struct stat st;
+    const char *map;
+    off_t offset;
+    int fd, count = 0;
+
+    fd = open (path, O_RDWR);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return -1;
+        errno_abort ("Open WAL");
+    }
+    if (fstat (fd, &st) < 0)
+        errno_abort ("Stat WAL");
+    if (st.st_size == 0) {
+        close (fd);
+        return 0;
+    }
+    map = (const char*)mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        errno_abort ("Map WAL");
+    for (offset = 0; offset + sizeof (record) <= st.st_size;
+        offset += sizeof (record) + record.length) {
+        memcpy (&record, map + offset, sizeof (record));
+        if (offset + sizeof (record) + record.length > st.st_size
+            || record.length >= ALARM_MESSAGE)
+            break;
+        memcpy (message, map + offset + sizeof (record), record.length);
+        message[record.length] = '\0';
+        if (wal_checksum (&record, message) != record.checksum
+            || record.type < WAL_INSERT || record.type > WAL_CANCEL
+            || (record.type != WAL_CANCEL && record.seconds <= 0))
+            break;
+        wal_apply (&record, message);
+        count++;
+    }
+    munmap ((void*)map, st.st_size);
+    if (offset < st.st_size) {
+        fprintf (stderr, "Discarding %ld bytes torn from the end of %s\n",
+            (long)(st.st_size - offset), path);
+        if (ftruncate (fd, offset) != 0)
+            errno_abort ("Truncate WAL");
+    }
+    close (fd);
+    return count;
+}
+
+/*
+ * Fold "file" onto the end of "file.old", left behind by an
+ * unfinished checkpoint, and put the result in place of "file".
+ * Until the rename both logs are still there, and replaying the
+ * tail of the log twice gives the same alarms as replaying it
+ * once.
+ */
+void wal_merge(const char *old, const char *path) {
+    char buffer[65536];
+    int from, to, length;
+
+    to = open (old, O_WRONLY | O_APPEND);
+    if (to < 0)
+        errno_abort ("Open old WAL");
+    from = open (path, O_RDONLY);
+    if (from >= 0) {
+        while ((length = read (from, buffer, sizeof (buffer))) > 0)
+            if (write (to, buffer, length) != length)
+                errno_abort ("Merge WAL");
+        if (length < 0)
+            errno_abort ("Read WAL");
+        close (from);
+    } else if (errno != ENOENT)
+        errno_abort ("Open WAL");
+    if (fdatasync (to) != 0)
+        errno_abort ("Sync WAL");
+    close (to);
+    if (rename (old, path) != 0)
+        errno_abort ("Rename WAL");
+}
+
+int alarm_compare(const void *a, const void *b) {
+    return (*(alarm_t**)a)->mssg_num - (*(alarm_t**)b)->mssg_num;
+}
+
+/*
+ * Relink a_list, sorted by message number, and rebuild the heap
+ * and the ordered indexes, from the alarms in alarm_index.
+ */
+void alarm_rebuild(int policy) {
+    alarm_t **alarms;
+    time_t now = time (NULL);
+    int i, count = 0;
+
+    alarms = (alarm_t**)malloc ((alarm_index.count + 1) * sizeof (alarm_t*));
+    if (alarms == NULL)
+        errno_abort ("Allocate rebuild");
+    for (i = 0; i < alarm_index.size; i++)
+        if (alarm_index.entries[i].value != NULL)
+            alarms[count++] = (alarm_t*)alarm_index.entries[i].value;
+    qsort (alarms, count, sizeof (alarm_t*), alarm_compare);
+    a_list = count > 0 ? alarms[0] : NULL;
+    alarm_count = 0;
+    order_clear (&number_order);
+    order_clear (&message_order);
+    for (i = 0; i < count; i++) {
+        alarms[i]->prev = i > 0 ? alarms[i - 1] : NULL;
+        alarms[i]->link = i + 1 < count ? alarms[i + 1] : NULL;
+        alarm_catch_up (alarms[i], now, policy);
+        heap_push (alarms[i]);
+        order_put (&number_order, alarms[i]);
+        order_put (&message_order, alarms[i]);
+    }
+    free (alarms);
+}
+
+/*
+ * Replay the logs in "file.old", if a checkpoint was left
+ * unfinished, and "file" over the alarms restored from the last
+ * snapshot, and schedule the result. Overdue alarms are handled
+ * according to "policy". Returns the number of records replayed,
+ * or -1 if there is no log.
+ */
+int wal_recover(const char *path, int policy) {
+    char old[PATH_MAX];
+    int status, count, more;
+
+    snprintf (old, sizeof (old), "%s.old", path);
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    rwlock_write_lock(&list_lock);
+    count = wal_replay (old);
+    more = wal_replay (path);
+    if (count >= 0)
+        wal_merge (old, path);
+    if (count >= 0 || more >= 0)
+        alarm_rebuild (policy);
+    rwlock_write_unlock(&list_lock);
+    if (alarm_count > 0)
+        alarm_wake (alarm_heap[0]);
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    if (count < 0 && more < 0)
+        return -1;
+    return (count > 0 ? count : 0) + (more > 0 ? more : 0);
+}
+
+/*
+ * Snapshots. The pending alarms can be saved to a file, and
+ * restored from it at startup, so that they survive a restart.
+ * The file is binary, in the host's byte order:
+ *
+ *      snapshot_header_t
+ *      snapshot_record_t       one per alarm, in a_list order
+ *      messages                each a length byte followed by
+ *                              that many characters, numbered
+ *                              from 0 in the order written
+ *
+ * Alarms with the same message text share one copy of it
+ * (intern.h), so a large set of alarms with few distinct messages
+ * costs little more than its 24 byte records.
+ */
+#define SNAPSHOT_MAGIC          "ALRMSNAP"
+#define SNAPSHOT_VERSION        1
+
+#define SNAPSHOT_REPLACED       0x1     /* alarm->replacable is 1 */
+#define SNAPSHOT_ANNOUNCED      0x2     /* alarm->replacable is 2 */
+#define SNAPSHOT_PROCESSED      0x4
+#define SNAPSHOT_CANCELLED      0x8
+
+typedef struct snapshot_header_tag {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            count;          /* Records */
+    uint32_t            messages;
+    uint32_t            reserved;
+    int64_t             taken;          /* When written, from EPOCH */
+} snapshot_header_t;
+
+typedef struct snapshot_record_tag {
+    int64_t             time;           /* Next display, from EPOCH */
+    int32_t             mssg_num;
+    int32_t             seconds;        /* Display period */
+    uint32_t            message;        /* Number of its message */
+    uint32_t            flags;
+} snapshot_record_t;
+
+/*
+ * The records and messages of the snapshot being written. They
+ * are kept from one snapshot to the next, so that a snapshot
+ * doesn't allocate once the alarm list stops growing.
+ */
+snapshot_record_t *snapshot_records = NULL;
+int snapshot_size = 0;
+intern_t snapshot_messages = INTERN_INITIALIZER;
+
+/*
+ * Report that writing snapshot "path" failed at "what", and take
+ * away the temporary file "temp", if there is one. Returns -1.
+ */
+int snapshot_fail(const char *path, const char *temp, const char *what) {
+    fprintf (stderr, "Snapshot %s: %s: %s\n", path, what, strerror (errno));
+    if (temp != NULL)
+        unlink (temp);
+    return -1;
+}
+
+/*
+ * Sync the directory holding "path", so that a file just renamed
+ * into it is there after a crash. Returns -1 on failure.
+ */
+int snapshot_sync_dir(const char *path) {
+    char dir[PATH_MAX];
+    char *slash;
+    int fd;
+
+    snprintf (dir, sizeof (dir), "%s", path);
+    slash = strrchr (dir, '/');
+    if (slash == NULL)
+        strcpy (dir, ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+    fd = open (dir, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fsync (fd) != 0) {
+        close (fd);
+        return -1;
+    }
+    close (fd);
+    return 0;
+}
+
+/*
+ * Write every alarm on a_list to "path". The list is copied into
+ * snapshot_records with the alarm_mutex locked, since the alarm
+ * thread moves each alarm's time and flags under it, and list_lock
+ * held for reading, which holds off commands that insert or
+ * cancel. The copy takes little time beside the writing, and the
+ * file is written with both released, to a temporary file that is
+ * synced to disk and only then renamed over "path", and the
+ * rename is synced in turn, so a crash at any point leaves either
+ * the previous snapshot or the whole new one. Returns the number
+ * of alarms written, or -1 if the snapshot could not be written
+ * (a full disk, say), which is reported and leaves the previous
+ * snapshot and the log as they were, to try again next time.
+ *
+ * With a write-ahead log, each snapshot is also a checkpoint of
+ * the log (see wal_rotate).
+ *
+ * Only one thread may write snapshots.
+ */
+int snapshot_write(const char *path) {
+    snapshot_header_t header;
+    snapshot_record_t *record;
+    alarm_t *alarm;
+    char temp[PATH_MAX];
+    unsigned char length;
+    const char *message;
+    FILE *file;
+    int count = 0, i, status;
+
+    wal_rotate ();
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    rwlock_read_lock(&list_lock);
+    if (alarm_index.count > snapshot_size) {
+        snapshot_size = alarm_index.count * 2;
+        free (snapshot_records);
+        snapshot_records = (snapshot_record_t*)malloc (
+            snapshot_size * sizeof (snapshot_record_t));
+        if (snapshot_records == NULL)
+            errno_abort ("Allocate snapshot");
+    }
+    intern_clear (&snapshot_messages);
+    for (alarm = a_list; alarm != NULL; alarm = alarm->link) {
+        record = &snapshot_records[count++];
+        record->time = alarm->time;
+        record->mssg_num = alarm->mssg_num;
+        record->seconds = alarm->seconds;
+        record->message = intern_put (&snapshot_messages, alarm->message);
+        record->flags = (alarm->replacable == 1 ? SNAPSHOT_REPLACED : 0)
+            | (alarm->replacable == 2 ? SNAPSHOT_ANNOUNCED : 0)
+            | (alarm->processed ? SNAPSHOT_PROCESSED : 0)
+            | (__atomic_load_n (&alarm->cancel, __ATOMIC_SEQ_CST) > 0
+                ? SNAPSHOT_CANCELLED : 0);
+    }
+    rwlock_read_unlock(&list_lock);
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, SNAPSHOT_MAGIC, sizeof (header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.count = count;
+    header.messages = snapshot_messages.count;
+    header.taken = time (NULL);
+
+    snprintf (temp, sizeof (temp), "%s.tmp", path);
+    file = fopen (temp, "w");
+    if (file == NULL)
+        return snapshot_fail (path, temp, "create");
+    fwrite (&header, sizeof (header), 1, file);
+    fwrite (snapshot_records, sizeof (snapshot_record_t), count, file);
+    for (i = 0; i < snapshot_messages.count; i++) {
+        message = intern_get (&snapshot_messages, i);
+        length = strlen (message);
+        fputc (length, file);
+        fwrite (message, 1, length, file);
+    }
+    if (fflush (file) != 0 || ferror (file) || fsync (fileno (file)) != 0) {
+        snapshot_fail (path, temp, "write");
+        fclose (file);
+        return -1;
+    }
+    if (fclose (file) != 0)
+        return snapshot_fail (path, temp, "close");
+    if (rename (temp, path) != 0)
+        return snapshot_fail (path, temp, "rename");
+    if (snapshot_sync_dir (path) != 0)
+        return snapshot_fail (path, NULL, "sync directory");
+    wal_retire ();
+    return count;
+}
+
+/*
+ * Load the alarms saved in "path" onto the empty a_list, and
+ * schedule them. An alarm that was being cancelled when the
+ * snapshot was taken is dropped, and overdue alarms are handled
+ * according to "policy". The records are in a_list order, so each
+ * is simply linked at the tail. Returns the number of alarms restored, or -1 if there is
+ * no snapshot.
+ */
+int snapshot_restore(const char *path, int policy) {
+    snapshot_header_t *header;
+    snapshot_record_t *record;
+    alarm_t *alarm, *tail = NULL;
+    struct stat st;
+    const unsigned char *map, *p, *end;
+    uint32_t *messages;
+    char message[256];
+    time_t now;
+    int fd, status, count = 0, i, last = 0;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return -1;
+        errno_abort ("Open snapshot");
+    }
+    if (fstat (fd, &st) < 0)
+        errno_abort ("Stat snapshot");
+    if (st.st_size < sizeof (snapshot_header_t)) {
+        fprintf (stderr, "Snapshot %s is truncated\n", path);
+        exit (1);
+    }
+    map = (const unsigned char*)mmap (
+        NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        errno_abort ("Map snapshot");
+    close (fd);
+    end = map + st.st_size;
+
+    header = (snapshot_header_t*)map;
+    if (memcmp (header->magic, SNAPSHOT_MAGIC, sizeof (header->magic)) != 0
+        || header->version != SNAPSHOT_VERSION
+        || (st.st_size - sizeof (snapshot_header_t))
+            / sizeof (snapshot_record_t) < header->count) {
+        fprintf (stderr, "%s is not a valid snapshot\n", path);
+        exit (1);
+    }
+    record = (snapshot_record_t*)(header + 1);
+    messages = (uint32_t*)malloc ((header->messages + 1) * sizeof (uint32_t));
+    if (messages == NULL)
+        errno_abort ("Allocate snapshot messages");
+    p = (const unsigned char*)(record + header->count);
+    for (i = 0; i < header->messages; i++) {
+        if (p >= end || p + 1 + *p > end) {
+            fprintf (stderr, "Snapshot %s is truncated\n", path);
+            exit (1);
+        }
+        messages[i] = p - map;
+        p += 1 + *p;
+    }
+
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    rwlock_write_lock(&list_lock);
+    now = time (NULL);
+    for (i = 0; i < header->count; i++, record++) {
+        if (record->flags & SNAPSHOT_CANCELLED)
+            continue;
+        if (record->mssg_num <= last || record->seconds <= 0
+            || record->message >= header->messages) {
+            fprintf (stderr, "Bad snapshot record for Message(%d)\n",
+                record->mssg_num);
+            continue;
+        }
+        last = record->mssg_num;
+        alarm = (alarm_t*)slab_alloc (&alarm_slab);
+        alarm->mssg_num = record->mssg_num;
+        alarm->seconds = record->seconds;
+        alarm->time = record->time;
+        alarm->cancel = 0;
+        alarm->replacable = (record->flags & SNAPSHOT_REPLACED) ? 1
+            : (record->flags & SNAPSHOT_ANNOUNCED) ? 2 : 0;
+        alarm->processed = (record->flags & SNAPSHOT_PROCESSED) != 0;
+        p = map + messages[record->message];
+        memcpy (message, p + 1, *p);
+        message[*p] = '\0';
+        alarm->message = arena_put (&alarm_strings, message);
+        alarm_catch_up (alarm, now, policy);
+
+        alarm->prev = tail;
+        alarm->link = NULL;
+        if (tail != NULL)
+            tail->link = alarm;
+        else
+            a_list = alarm;
+        tail = alarm;
+        index_put(&alarm_index, alarm->mssg_num, alarm);
+        order_put (&number_order, alarm);
+        order_put (&message_order, alarm);
+        heap_push (alarm);
+        count++;
+    }
+    rwlock_write_unlock(&list_lock);
+    if (count > 0)
+        alarm_wake (alarm_heap[0]);
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+
+    free (messages);
+    munmap ((void*)map, st.st_size);
+    return count;
+}
+
+/*
+ * Cancel every alarm with a message number from "low" to "high",
+ * or, if "prefix" is not NULL, every alarm whose message starts
+ * with "prefix", and return how many were cancelled. Each is
+ * cancelled as "Cancel: Message(N)" cancels one, with a tombstone,
+ * but they are found through the ordered indexes, at a cost in
+ * proportion to their number, and with the list lock taken once
+ * for all of them. Alarms already being cancelled are left alone.
+ * Their records are all appended under the lock, and waited for
+ * once, after it is released (see wal_wait).
+ */
+int cancel_matching(int low, int high, const char *prefix) {
+    order_node_t *node;
+    alarm_t *alarm;
+    unsigned long lsn = 0;
+    int count = 0, length;
+
+    rwlock_read_lock(&list_lock);
+    if (prefix != NULL) {
+        length = strlen (prefix);
+        node = order_first (&message_order, alarm_before_message, prefix);
+    } else
+        node = order_first (&number_order, alarm_before_number, &low);
+    for (; node != NULL; node = node->next[0]) {
+        alarm = (alarm_t*)node->item;
+        if (prefix != NULL ? strncmp (alarm->message, prefix, length) != 0
+            : alarm->mssg_num > high)
+            break;
+        if (cancel_alarm (alarm)) {
+            lsn = wal_append (WAL_CANCEL, alarm);
+            count++;
+        }
+    }
+    rwlock_read_unlock(&list_lock);
+    cancel_wake_up ();
+    wal_wait (lsn);
+    return count;
+}
+
+#ifdef BENCH
+/*
+ * Benchmark driver. Compiling with -DBENCH replaces the
+ * interactive main with this one, which exercises the alarm list
+ * directly, without the alarm or display threads:
+ *
+ *      cc New_alarm_cond.c -DBENCH -D_POSIX_PTHREAD_SEMANTICS -lpthread
+ *      a.out [name] [count ...]
+ *
+ * "name" selects one benchmark (all of them run if it is
+ * omitted), and the counts override its default sizes.
+ */
+#define BENCH_CANCELS   1000
+
+double bench_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Build a_list (and its index) from "count" alarms numbered 1 to
+ * count. They are linked directly in order, since going through
+ * alarm_insert would cost a walk per alarm.
+ */
+alarm_t *bench_list (int count)
+{
+    alarm_t *alarms;
+    int i;
+
+    alarms = (alarm_t*) calloc (count, sizeof (alarm_t));
+    if (alarms == NULL)
+        errno_abort ("Allocate benchmark alarms");
+    free (alarm_index.entries);
+    memset (&alarm_index, 0, sizeof (alarm_index));
+    for (i = 0; i < count; i++) {
+        alarms[i].mssg_num = i + 1;
+        alarms[i].seconds = 1;
+        alarms[i].time = time (NULL) + 1;
+        alarms[i].prev = i > 0 ? &alarms[i - 1] : NULL;
+        alarms[i].link = i + 1 < count ? &alarms[i + 1] : NULL;
+        index_put (&alarm_index, alarms[i].mssg_num, &alarms[i]);
+    }
+    a_list = alarms;
+    return alarms;
+}
+
+/*
+ * Unlink BENCH_CANCELS random alarms from a list of "count",
+ * finding each through alarm_index, as the alarm thread does when
+ * it retires a cancelled alarm, and report the average latency.
+ * The old linear walk for the same numbers is measured for
+ * comparison.
+ */
+void bench_cancel (int count)
+{
+    alarm_t *alarms, *alarm, *prev;
+    int ids[BENCH_CANCELS];
+    double start, walk, indexed;
+    int i;
+
+    srand (1);
+    for (i = 0; i < BENCH_CANCELS; i++)
+        ids[i] = rand () % count + 1;
+
+    alarms = bench_list (count);
+    start = bench_now ();
+    for (i = 0; i < BENCH_CANCELS; i++) {
+        for (alarm = a_list; alarm != NULL; alarm = alarm->link)
+            if (alarm->mssg_num == ids[i])
+                break;
+        if (alarm == NULL)
+            continue;
+        if (alarm == a_list)
+            a_list = alarm->link;
+        else {
+            for (prev = a_list; prev->link != alarm; prev = prev->link)
+                ;
+            prev->link = alarm->link;
+        }
+    }
+    walk = bench_now () - start;
+    free (alarms);
+
+    alarms = bench_list (count);
+    start = bench_now ();
+    for (i = 0; i < BENCH_CANCELS; i++) {
+        alarm = get_alarm_at (ids[i]);
+        if (alarm != NULL) {
+            rwlock_write_lock(&list_lock);
+            alarm_unlink (alarm);
+            rwlock_write_unlock(&list_lock);
+        }
+    }
+    indexed = bench_now () - start;
+    free (alarms);
+
+    printf ("cancel %8d: list walk %12.1f ns, index %8.1f ns\n",
+        count, walk * 1e9 / BENCH_CANCELS, indexed * 1e9 / BENCH_CANCELS);
+}
+
+/*
+ * Cancel a 64th of a list of "count" alarms at once, first by a
+ * range of message numbers and then by a message prefix, and report
+ * the time per alarm cancelled, which should not grow with the list.
+ * For comparison, the same number are then cancelled one at a time,
+ * as "Cancel: Message(N)" does.
+ */
+void bench_bulk (int count)
+{
+    alarm_t *alarms, *alarm;
+    char message[64];
+    unsigned long lsn;
+    double start;
+    int i, k, cancelled;
+
+    alarms = bench_list (count);
+    for (i = 0; i < count; i++) {
+        sprintf (message, "tenant%d: message %d", i % 64, i % 16);
+        alarms[i].message = arena_put (&alarm_strings, message);
+        order_put (&number_order, &alarms[i]);
+        order_put (&message_order, &alarms[i]);
+        heap_push (&alarms[i]);
+    }
+    k = count / 64;
+
+    start = bench_now ();
+    cancelled = cancel_matching (1, k, NULL);
+    printf ("bulk %8d: range  %7d alarms, %8.1f ns/alarm\n", count,
+        cancelled, (bench_now () - start) * 1e9 / cancelled);
+    start = bench_now ();
+    cancelled = cancel_matching (0, 0, "tenant7:");
+    printf ("bulk %8d: prefix %7d alarms, %8.1f ns/alarm\n", count,
+        cancelled, (bench_now () - start) * 1e9 / cancelled);
+    start = bench_now ();
+    for (cancelled = 0, i = 2 * k + 1; i <= 3 * k; i++) {
+        rwlock_read_lock(&list_lock);
+        alarm = get_alarm_at (i);
+        lsn = 0;
+        if (cancel_alarm (alarm)) {
+            lsn = wal_append (WAL_CANCEL, alarm);
+            cancelled++;
+        }
+        rwlock_read_unlock(&list_lock);
+        cancel_wake_up ();
+        wal_wait (lsn);
+    }
+    printf ("bulk %8d: single %7d alarms, %8.1f ns/alarm\n", count,
+        cancelled, (bench_now () - start) * 1e9 / cancelled);
+
+    for (i = 0; i < count; i++)
+        arena_release (&alarm_strings, alarms[i].message);
+    order_clear (&number_order);
+    order_clear (&message_order);
+    alarm_count = 0;
+    tombstones = 0;
+    a_list = NULL;
+    free (alarms);
+}
+
+/*
+ * Count the threads in this process, from /proc/self/status.
+ */
+int bench_threads_running (void)
+{
+    char line[128];
+    FILE *status_file;
+    int threads = -1;
+
+    status_file = fopen ("/proc/self/status", "r");
+    if (status_file == NULL)
+        return -1;
+    while (fgets (line, sizeof (line), status_file) != NULL)
+        if (sscanf (line, "Threads: %d", &threads) == 1)
+            break;
+    fclose (status_file);
+    return threads;
+}
+
+int bench_loaded = 0;
+int bench_saved_stdout = -1;
+
+/*
+ * Send stdout to /dev/null while the threads are displaying, and
+ * bring it back to report the results.
+ */
+void bench_quiet (int quiet)
+{
+    int null_fd;
+
+    fflush (stdout);
+    if (quiet) {
+        bench_saved_stdout = dup (1);
+        null_fd = open ("/dev/null", O_WRONLY);
+        if (bench_saved_stdout < 0 || null_fd < 0)
+            errno_abort ("Redirect stdout");
+        dup2 (null_fd, 1);
+        close (null_fd);
+    } else {
+        dup2 (bench_saved_stdout, 1);
+        close (bench_saved_stdout);
+    }
+}
+
+/*
+ * Start the alarm thread and display pool (the first time), and
+ * load more periodic alarms until "count" are running, with
+ * periods of "seconds" up to "seconds + spread - 1".
+ */
+void bench_load (int count, int seconds, int spread)
+{
+    static int started = 0;
+    pthread_t thread;
+    alarm_t *alarm;
+    int status;
+
+    if (!started) {
+        display_start ();
+        status = pthread_create (&thread, NULL, alarm_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create alarm thread");
+        status = pthread_create (&thread, NULL, compact_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create compact thread");
+        started = 1;
+    }
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (; bench_loaded < count; bench_loaded++) {
+        alarm = (alarm_t*) slab_alloc (&alarm_slab);
+        memset (alarm, 0, sizeof (alarm_t));
+        alarm->mssg_num = bench_loaded + 1;
+        alarm->seconds = seconds + bench_loaded % spread;
+        alarm->time = time (NULL);
+        alarm->message = arena_put (&alarm_strings, "periodic");
+        alarm_insert (alarm);
+    }
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Load "count" periodic alarms with long periods, let their first
+ * displays drain, then measure how much CPU the process uses while
+ * it has nothing to do but wait for the next ones.
+ */
+#define BENCH_IDLE      5
+
+void bench_cpu (int count)
+{
+    struct rusage before, after;
+    double cpu;
+
+    bench_quiet (1);
+    bench_load (count, 60, 60);
+    sleep (1);
+    getrusage (RUSAGE_SELF, &before);
+    sleep (BENCH_IDLE);
+    getrusage (RUSAGE_SELF, &after);
+    bench_quiet (0);
+    cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec)
+        + (after.ru_stime.tv_sec - before.ru_stime.tv_sec)
+        + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6
+        + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+    printf ("cpu %8d periodic alarms: %.3f%% of a core while idle\n",
+        bench_loaded, cpu * 100 / BENCH_IDLE);
+}
+
+/*
+ * Load periodic alarms until "count" are running, let the display
+ * pool run them for a few seconds, and report how many threads
+ * the process has. The displays themselves go to /dev/null. The
+ * alarm thread and display pool are started by the first run and
+ * keep running, so successive runs (and benchmarks) add to the
+ * same load.
+ */
+#define BENCH_SETTLE    3
+
+void bench_threads (int count)
+{
+    bench_quiet (1);
+    bench_load (count, 1, 5);
+    sleep (BENCH_SETTLE);
+    bench_quiet (0);
+    printf ("threads %8d periodic alarms: %d threads (%d display)\n",
+        bench_loaded, bench_threads_running (), display_threads);
+}
+
+/*
+ * Contend for a lock of each kind: "count" reader threads take it
+ * for reading over and over for BENCH_RW_SECONDS, each time
+ * holding it briefly, while one writer keeps asking for it and
+ * records how long it waited. Report the writer's wait-time
+ * percentiles.
+ */
+#define BENCH_RW_SECONDS 2
+#define BENCH_RW_SAMPLES 100000
+
+rwlock_t bench_lock;
+volatile int bench_readers_done;
+
+void bench_hold (int loops)
+{
+    volatile int i;
+
+    for (i = 0; i < loops; i++)
+        ;
+}
+
+void *bench_reader (void *arg)
+{
+    double stop = bench_now () + BENCH_RW_SECONDS;
+
+    while (bench_now () < stop) {
+        rwlock_read_lock (&bench_lock);
+        bench_hold (2000);
+        rwlock_read_unlock (&bench_lock);
+    }
+    return NULL;
+}
+
+int bench_compare (const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+void bench_rwlock (int count)
+{
+    pthread_t *readers;
+    double *waits, start;
+    int kind, samples, status, i;
+
+    readers = (pthread_t*) malloc (count * sizeof (pthread_t));
+    waits = (double*) malloc (BENCH_RW_SAMPLES * sizeof (double));
+    if (readers == NULL || waits == NULL)
+        errno_abort ("Allocate benchmark");
+    for (kind = RWLOCK_READER_PREF; kind <= RWLOCK_PTHREAD; kind++) {
+        rwlock_init (&bench_lock, kind);
+        for (i = 0; i < count; i++) {
+            status = pthread_create (&readers[i], NULL, bench_reader, NULL);
+            if (status != 0)
+                err_abort (status, "Create reader");
+        }
+        start = bench_now ();
+        samples = 0;
+        while (bench_now () - start < BENCH_RW_SECONDS
+            && samples < BENCH_RW_SAMPLES) {
+            waits[samples] = bench_now ();
+            rwlock_write_lock (&bench_lock);
+            waits[samples] = bench_now () - waits[samples];
+            samples++;
+            bench_hold (1000);
+            rwlock_write_unlock (&bench_lock);
+            usleep (100);
+        }
+        for (i = 0; i < count; i++)
+            pthread_join (readers[i], NULL);
+        qsort (waits, samples, sizeof (double), bench_compare);
+        printf ("rwlock %-7s %2d readers: %6d writes, wait p50 %9.1f us,"
+            " p99 %9.1f us, p99.9 %9.1f us, max %9.1f us\n",
+            rwlock_names[kind], count, samples,
+            waits[samples / 2] * 1e6, waits[samples * 99 / 100] * 1e6,
+            waits[samples * 999 / 1000] * 1e6, waits[samples - 1] * 1e6);
+    }
+    free (readers);
+    free (waits);
+}
+
+/*
+ * Write a snapshot of "count" alarms, with 64 distinct messages
+ * among them, then restore it into an empty list, and report the
+ * time each takes and the size of the file.
+ */
+void bench_snapshot (int count)
+{
+    const char *path = "/tmp/New_alarm_cond.snapshot";
+    alarm_t *alarms, *alarm, *next;
+    double start, written, restored;
+    char message[ALARM_MESSAGE];
+    struct stat st;
+    int i, loaded;
+
+    alarms = bench_list (count);
+    for (i = 0; i < count; i++) {
+        sprintf (message, "Periodic alarm message %d", i % 64);
+        alarms[i].message = arena_put (&alarm_strings, message);
+    }
+    start = bench_now ();
+    snapshot_write (path);
+    written = bench_now () - start;
+    if (stat (path, &st) < 0)
+        errno_abort ("Stat snapshot");
+    for (i = 0; i < count; i++)
+        arena_release (&alarm_strings, alarms[i].message);
+    free (alarms);
+
+    a_list = NULL;
+    free (alarm_index.entries);
+    memset (&alarm_index, 0, sizeof (alarm_index));
+    alarm_count = 0;
+    start = bench_now ();
+    loaded = snapshot_restore (path, OVERDUE_FIRE);
+    restored = bench_now () - start;
+    if (loaded != count)
+        fprintf (stderr, "Restored %d of %d alarms\n", loaded, count);
+    for (alarm = a_list; alarm != NULL; alarm = next) {
+        next = alarm->link;
+        alarm_free (alarm);
+    }
+    a_list = NULL;
+    alarm_count = 0;
+    order_clear (&number_order);
+    order_clear (&message_order);
+    unlink (path);
+
+    printf ("snapshot %8d: %10ld bytes, write %8.1f ms, restore %8.1f ms\n",
+        count, (long)st.st_size, written * 1e3, restored * 1e3);
+}
+
+/*
+ * Measure the latency of cancels while the alarm thread expires
+ * alarms as fast as it can: periodic alarms are loaded until
+ * "count" are running, each due every second, and BENCH_CANCELS
+ * of the new ones are cancelled a millisecond apart. Half are
+ * cancelled with a tombstone, as the "Cancel: Message(N)" command
+ * does, and half eagerly, as a cancel must without tombstones: the
+ * alarm is taken out of the heap under the alarm_mutex, then
+ * unlinked under the write lock and freed at once. Each eager
+ * cancel waits while the alarm thread holds the mutex to work
+ * through the alarms that are due, and for the readers of the
+ * list to finish. The displays go to /dev/null.
+ */
+int bench_compare_double (const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void bench_tombstone (int count)
+{
+    static double latency[2][BENCH_CANCELS / 2];
+    alarm_t *alarm;
+    double start;
+    int first, eager, number, n[2] = {0, 0}, i, status;
+
+    first = bench_loaded;
+    bench_quiet (1);
+    bench_load (count, 1, 1);
+    sleep (2);
+    for (i = 0; i < BENCH_CANCELS && first + i < bench_loaded; i++) {
+        eager = i % 2;
+        number = first + 1 + (int)((long)i * (bench_loaded - first)
+            / BENCH_CANCELS);
+        start = bench_now ();
+        if (eager) {
+            status = pthread_mutex_lock (&alarm_mutex);
+            if (status != 0)
+                err_abort (status, "Lock mutex");
+            rwlock_write_lock(&list_lock);
+            alarm = get_alarm_at (number);
+            if (alarm != NULL && alarm->cancel == 0) {
+                heap_remove (alarm);
+                alarm_unlink (alarm);
+                display_post (alarm, DISPLAY_EXIT);
+                alarm_free (alarm);
+            }
+            rwlock_write_unlock(&list_lock);
+            status = pthread_mutex_unlock (&alarm_mutex);
+            if (status != 0)
+                err_abort (status, "Unlock mutex");
+        } else {
+            rwlock_read_lock(&list_lock);
+            alarm = get_alarm_at (number);
+            if (alarm != NULL)
+                cancel_alarm (alarm);
+            rwlock_read_unlock(&list_lock);
+            cancel_wake_up ();
+        }
+        latency[eager][n[eager]++] = bench_now () - start;
+        usleep (1000);
+    }
+    bench_quiet (0);
+    for (eager = 0; eager < 2; eager++) {
+        qsort (latency[eager], n[eager], sizeof (double),
+            bench_compare_double);
+        printf ("tombstone %8d: %-9s median %8.1f us, 99%% %8.1f us,"
+            " max %8.1f us\n", bench_loaded, eager ? "eager" : "tombstone",
+            latency[eager][n[eager] / 2] * 1e6,
+            latency[eager][n[eager] * 99 / 100] * 1e6,
+            latency[eager][n[eager] - 1] * 1e6);
+    }
+}
+
+/*
+ * Cancel BENCH_CANCELS of "count" running alarms and insert a new
+ * alarm with each number at once, as "Cancel: Message(N)" followed
+ * by an insert of Message(N) does, then have the compactor retire
+ * the cancelled ones. Each new alarm must be the live one indexed
+ * under its number, the list must hold exactly the alarms in the
+ * heap, and the rebuilt heap must be in order.
+ */
+void bench_reinsert (int count)
+{
+    static alarm_t *fresh[BENCH_CANCELS];
+    alarm_t *alarm;
+    long done;
+    int n, i, live, listed, ordered, status;
+
+    bench_quiet (1);
+    bench_load (count, 10, 1);
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    done = compactions;
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    n = bench_loaded < BENCH_CANCELS ? bench_loaded : BENCH_CANCELS;
+    for (i = 0; i < n; i++) {
+        rwlock_read_lock(&list_lock);
+        alarm = get_alarm_at (i + 1);
+        if (alarm != NULL)
+            cancel_alarm (alarm);
+        rwlock_read_unlock(&list_lock);
+        cancel_wake_up ();
+
+        alarm = (alarm_t*) slab_alloc (&alarm_slab);
+        memset (alarm, 0, sizeof (alarm_t));
+        alarm->mssg_num = i + 1;
+        alarm->seconds = 10;
+        alarm->message = arena_put (&alarm_strings, "reinserted");
+        status = pthread_mutex_lock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        fresh[i] = find_and_replace (alarm);
+        if (fresh[i] == NULL) {
+            alarm->time = time (NULL);
+            alarm_insert (alarm);
+            fresh[i] = alarm;
+        } else
+            alarm_free (alarm);
+        done = compactions;
+        status = pthread_mutex_unlock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+    }
+
+    status = pthread_mutex_lock (&compact_mutex);
+    if (status != 0)
+        err_abort (status, "Lock compact mutex");
+    compact_wanted = 1;
+    status = pthread_cond_signal (&compact_cond);
+    if (status != 0)
+        err_abort (status, "Signal compact cond");
+    status = pthread_mutex_unlock (&compact_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock compact mutex");
+    while (1) {
+        status = pthread_mutex_lock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        if (compactions != done)
+            break;
+        status = pthread_mutex_unlock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+        usleep (1000);
+    }
+
+    rwlock_read_lock(&list_lock);
+    for (i = live = 0; i < n; i++)
+        if (get_alarm_at (i + 1) == fresh[i] && fresh[i]->cancel == 0
+            && strcmp (fresh[i]->message, "reinserted") == 0)
+            live++;
+    for (listed = 0, alarm = a_list; alarm != NULL; alarm = alarm->link)
+        listed++;
+    rwlock_read_unlock(&list_lock);
+    for (i = ordered = 0; i < alarm_count; i++)
+        if (alarm_heap[i]->heap_pos == i
+            && (i == 0 || alarm_heap[(i - 1) / 2]->time <= alarm_heap[i]->time))
+            ordered++;
+    bench_quiet (0);
+    printf ("reinsert %8d: %d of %d live, %d listed, %d in heap (%d in order), %ld tombstones, %s\n",
+        bench_loaded, live, n, listed, alarm_count, ordered, tombstones,
+        live == n && listed == alarm_count && ordered == alarm_count
+        && tombstones == 0 ? "ok" : "FAILED");
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Log "count" inserts under each sync policy (only a hundredth as
+ * many when every insert waits for its fdatasync), and report
+ * the rate at which they are written. Then replay the last log,
+ * of "count" inserts, into an empty list.
+ */
+void bench_wal (int count)
+{
+    const char *path = "/tmp/New_alarm_cond.wal";
+    alarm_t alarm, *next, *restored;
+    double start, elapsed;
+    int sync, records, i, replayed, status;
+
+    memset (&alarm, 0, sizeof (alarm));
+    alarm.message = arena_put (&alarm_strings, "Periodic alarm message");
+    alarm.seconds = 10;
+    for (sync = WAL_SYNC_ALWAYS; sync >= WAL_SYNC_NONE; sync--) {
+        unlink (path);
+        wal_open (path, sync);
+        records = sync == WAL_SYNC_ALWAYS ? (count + 99) / 100 : count;
+        start = bench_now ();
+        for (i = 0; i < records; i++) {
+            alarm.mssg_num = i + 1;
+            alarm.time = time (NULL) + alarm.seconds;
+            wal_wait (wal_append (WAL_INSERT, &alarm));
+        }
+        wal_flush ();
+        elapsed = bench_now () - start;
+        printf ("wal %8d: sync %-6s %12.0f mutations/s\n",
+            records, wal_sync_names[sync], records / elapsed);
+    }
+
+    free (alarm_index.entries);
+    memset (&alarm_index, 0, sizeof (alarm_index));
+    start = bench_now ();
+    replayed = wal_recover (path, OVERDUE_FIRE);
+    elapsed = bench_now () - start;
+    printf ("wal %8d: replay %12.0f records/s\n",
+        replayed, replayed / elapsed);
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (restored = a_list; restored != NULL; restored = next) {
+        next = restored->link;
+        alarm_free (restored);
+    }
+    a_list = NULL;
+    alarm_count = 0;
+    free (alarm_index.entries);
+    memset (&alarm_index, 0, sizeof (alarm_index));
+    order_clear (&number_order);
+    order_clear (&message_order);
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    unlink (path);
+}
+
+/*
+ * The cancel, bulk, snapshot and wal benchmarks build a_list
+ * themselves and free it when they are done, so they run before
+ * bench_load starts the alarm thread and display pool, which keep
+ * running on the alarms they find in the list.
+ */
+struct bench_tag {
+    const char  *name;
+    void        (*run) (int count);
+    int         sizes[5];       /* Default counts, 0 terminated */
+} benches[] = {
+    {"cancel", bench_cancel, {1000, 10000, 100000, 1000000, 0}},
+    {"bulk", bench_bulk, {10000, 100000, 1000000, 0}},
+    {"snapshot", bench_snapshot, {1000, 100000, 1000000, 0}},
+    {"wal", bench_wal, {100000, 1000000, 0}},
+    {"cpu", bench_cpu, {1000, 0}},
+    {"threads", bench_threads, {10, 1000, 10000, 0}},
+    {"tombstone", bench_tombstone, {10000, 100000, 0}},
+    {"reinsert", bench_reinsert, {10000, 0}},
+    {"rwlock", bench_rwlock, {1, 4, 16, 0}},
+    {NULL}
+};
+
+int main (int argc, char *argv[])
+{
+    struct bench_tag *bench;
+    int i;
+
+    rwlock_init (&list_lock, list_lock_kind);
+    for (bench = benches; bench->name != NULL; bench++) {
+        if (argc > 1 && strcmp (argv[1], bench->name) != 0)
+            continue;
+        if (argc > 2) {
+            for (i = 2; i < argc; i++)
+                bench->run (atoi (argv[i]));
+        } else {
+            for (i = 0; bench->sizes[i] != 0; i++)
+                bench->run (bench->sizes[i]);
+        }
+    }
+    return 0;
+}
+#else
+/*
+ * Return the list lock kind called "name", or -1.
+ */
+int rwlock_kind (const char *name) {
+    int kind;
+
+    for (kind = RWLOCK_READER_PREF; kind <= RWLOCK_PTHREAD; kind++)
+        if (strcmp (name, rwlock_names[kind]) == 0)
+            return kind;
+    return -1;
+}
+
+#define COMMAND_INSERT  1
+#define COMMAND_CANCEL  2
+#define COMMAND_CANCEL_RANGE    3
+#define COMMAND_CANCEL_PREFIX   4
+
+/*
+ * Parse one request line in a single pass, without sscanf. An
+ * insert request, "# Message(*) ActualMessage", is read straight
+ * into "alarm", with its message put in alarm_strings once the
+ * whole line has parsed; a cancel request, "Cancel: Message(*)", stores the
+ * message number in "cancel_id". "Cancel: Message(low-high)" stores
+ * the range in "cancel_id" and "cancel_high", and "Cancel:
+ * Prefix(text)" puts the prefix in alarm->message. Returns
+ * COMMAND_INSERT, COMMAND_CANCEL, COMMAND_CANCEL_RANGE,
+ * COMMAND_CANCEL_PREFIX, or 0 for anything else.
+ */
+int parse_command (const char *line, alarm_t *alarm,
+    int *cancel_id, int *cancel_high) {
+    const char *p = parse_space (line), *q;
+    char message[ALARM_MESSAGE];
+
+    alarm->message = NULL;
+    if (*p == 'C') {
+        p = parse_space (parse_literal (p, "Cancel:"));
+        q = parse_literal (p, "Prefix(");
+        if (q != NULL) {
+            p = parse_end (parse_until (q, ')', message, sizeof (message)));
+            if (p == NULL)
+                return 0;
+            alarm->message = arena_put (&alarm_strings, message);
+            return COMMAND_CANCEL_PREFIX;
+        }
+        p = parse_literal (p, "Message(");
+        p = parse_int (p, cancel_id);
+        q = parse_literal (p, "-");
+        if (q != NULL) {
+            p = parse_end (parse_literal (parse_int (q, cancel_high), ")"));
+            return p != NULL && *cancel_high >= *cancel_id
+                ? COMMAND_CANCEL_RANGE : 0;
+        }
+        p = parse_end (parse_literal (p, ")"));
+        return p != NULL ? COMMAND_CANCEL : 0;
+    }
+    p = parse_int (p, &alarm->seconds);
+    p = parse_literal (parse_space (p), "Message(");
+    p = parse_int (p, &alarm->mssg_num);
+    p = parse_space (parse_literal (p, ")"));
+    p = parse_text (p, message, sizeof (message));
+    if (p == NULL)
+        return 0;
+    alarm->message = arena_put (&alarm_strings, message);
+    return COMMAND_INSERT;
+}
+
+/*
+ * With "-S file", the snapshot thread saves the alarms to the file
+ * every SNAPSHOT_INTERVAL seconds, and once more at end of input.
+ */
+#define SNAPSHOT_INTERVAL       10
+
+const char *snapshot_path = NULL;
+
+void *snapshot_thread(void *arg) {
+    /*
+     * A snapshot that fails has been reported; try again at the
+     * next interval.
+     */
+    while (1) {
+        sleep (SNAPSHOT_INTERVAL);
+        snapshot_write (snapshot_path);
+    }
+    return NULL;
+}
+
+/*
+ * In charge of receiving each alarm request and taking appropriate
+ * actions with regard to how they should be handled.
+ */
+int main (int argc, char *argv[]) {
+    int status;
+    int cancel_message_id = 0, cancel_high = 0;
+    int command;
+    char line[256];
+    alarm_t *alarm, *at_alarm;
+    pthread_t thread;
+    unsigned long lsn;
+    int arg, restored, sync;
+    int overdue = OVERDUE_FIRE;
+    const char *wal_file = NULL;
+    int output = SINK_BLOCK;
+    struct timespec started, finished;
+
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp (argv[arg], "-l") == 0 && arg + 1 < argc
+            && (list_lock_kind = rwlock_kind (argv[arg + 1])) >= 0) {
+            arg++;
+        } else if (strcmp (argv[arg], "-S") == 0 && arg + 1 < argc) {
+            snapshot_path = argv[++arg];
+        } else if (strcmp (argv[arg], "-o") == 0 && arg + 1 < argc
+            && (strcmp (argv[arg + 1], "fire") == 0
+                || strcmp (argv[arg + 1], "skip") == 0)) {
+            overdue = strcmp (argv[++arg], "skip") == 0
+                ? OVERDUE_SKIP : OVERDUE_FIRE;
+        } else if (strcmp (argv[arg], "-W") == 0 && arg + 1 < argc) {
+            wal_file = argv[++arg];
+        } else if (strcmp (argv[arg], "-y") == 0 && arg + 1 < argc) {
+            arg++;
+            for (sync = WAL_SYNC_NONE; sync <= WAL_SYNC_ALWAYS; sync++)
+                if (strcmp (argv[arg], wal_sync_names[sync]) == 0)
+                    break;
+            if (sync > WAL_SYNC_ALWAYS) {
+                fprintf (stderr, "Unknown sync policy %s\n", argv[arg]);
+                exit (1);
+            }
+            wal_sync = sync;
+        } else if (strcmp (argv[arg], "-O") == 0 && arg + 1 < argc) {
+            arg++;
+            if (strcmp (argv[arg], "block") == 0)
+                output = SINK_BLOCK;
+            else if (strcmp (argv[arg], "drop") == 0)
+                output = SINK_DROP;
+            else if (strcmp (argv[arg], "count") == 0)
+                output = SINK_COUNT;
+            else {
+                fprintf (stderr, "Unknown output policy %s\n", argv[arg]);
+                exit (1);
+            }
+        } else {
+            fprintf (stderr, "Usage: %s [-l reader|writer|phase|pthread]"
+                " [-S snapshot] [-o fire|skip] [-W log]"
+                " [-y none|batch|always] [-O block|drop|count]\n", argv[0]);
+            exit (1);
+        }
+    }
+    rwlock_init(&list_lock, list_lock_kind);
+
+    /*
+     * Restore the alarms from the last snapshot, if there is one,
+     * before any thread can look at them.
+     */
+    if (snapshot_path != NULL) {
+        clock_gettime (CLOCK_MONOTONIC, &started);
+        restored = snapshot_restore (snapshot_path, overdue);
+        clock_gettime (CLOCK_MONOTONIC, &finished);
+        if (restored >= 0)
+            printf ("Restored %d alarms from %s in %.3f seconds\n",
+                restored, snapshot_path,
+                (finished.tv_sec - started.tv_sec)
+                + (finished.tv_nsec - started.tv_nsec) / 1e9);
+    }
+
+    /*
+     * Then replay the write-ahead log over them, and start
+     * logging.
+     */
+    if (wal_file != NULL) {
+        clock_gettime (CLOCK_MONOTONIC, &started);
+        restored = wal_recover (wal_file, overdue);
+        clock_gettime (CLOCK_MONOTONIC, &finished);
+        if (restored >= 0)
+            printf ("Replayed %d log records from %s in %.3f seconds\n",
+                restored, wal_file,
+                (finished.tv_sec - started.tv_sec)
+                + (finished.tv_nsec - started.tv_nsec) / 1e9);
+        wal_open (wal_file, wal_sync);
+    }
+    if (snapshot_path != NULL) {
+        status = pthread_create (&thread, NULL, snapshot_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create snapshot thread");
+    }
+
+    /*
+     * From here on, everything the alarm and display threads print,
+     * and the replies to commands (often printed with alarm_mutex
+     * or list_lock held), goes through the output sink (sink.h),
+     * so a slow stdout holds up none of them.
+     */
+    fflush (stdout);
+    sink_start (1, output);
+
+    display_start ();
+    status = pthread_create (&thread, NULL, alarm_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+    status = pthread_create (&thread, NULL, compact_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create compact thread");
+
+        // Clear the terminal window.
+        printf("\e[1;1H\e[2J");
+
+        // Input instructions for the user.
+        printf("Please enter an alarm request in the following format: # Message(*) ActualMessage\n");
+        printf("# - the number of seconds until the alarm iterates\n");
+        printf("* - the message number\n");
+        printf("ActualMessage - the message that will be displayed when the alarm iterates\n");
+        printf("Example: 2 Message(2) Hello!\n");
+        printf("You may add successive alarm requests in the same format at any time during execution\n");
+        printf("To cancel an alarm request, use the following format: Cancel: Message(*)\n");
+        printf("To cancel a range of them, Cancel: Message(*-*), or those whose messages start with some text, Cancel: Prefix(text)\n");
+        printf("Disclaimer: Some alternate inputs will be dealt with accordingly,\n\n");
+        fflush(stdout);
+
+    while (1) {
+        if (fgets (line, sizeof (line), stdin) == NULL) {
+            if (snapshot_path != NULL)
+                snapshot_write (snapshot_path);
+            wal_flush ();
+            sink_flush ();
+            exit (0);
+        }
+        if (strlen (line) <= 1) continue;
+        alarm = (alarm_t*)slab_alloc (&alarm_slab);
+
+        command = parse_command(line, alarm, &cancel_message_id, &cancel_high);
+
+        if(command == COMMAND_INSERT && alarm->seconds > 0 && alarm->mssg_num > 0) {
+            /*
+             * The alarm thread may cancel and free an alarm at
+             * any time, so look it up and act on it with the
+             * alarm_mutex locked.
+             */
+            status = pthread_mutex_lock (&alarm_mutex);
+            if (status != 0)
+                err_abort (status, "Lock mutex");
+
+            // Replace a live alarm with the same mssg_num, if any
+            at_alarm = find_and_replace(alarm);
+            if(at_alarm == NULL) {
+                /*
+                 * The first display is due at once, and then
+                 * every alarm->seconds after that.
+                 */
+                alarm->time = time (NULL);
+                alarm->cancel = 0;
+                alarm->replacable = 0;
+                alarm->processed = 0;
+
+                /*
+                 * Insert the new alarm into the list of alarms,
+                 * sorted by mssg_num.
+                 */
+                alarm_insert (alarm);
+                lsn = wal_append (WAL_INSERT, alarm);
+            } else {
+                lsn = wal_append (WAL_REPLACE, at_alarm);
+                // A3.2.2 Print Statement
+                sink_printf("Replacement Alarm Request With Message Number (%d) Received at <%ld>: <%d %s>\n",
+                    at_alarm->mssg_num, time(NULL), at_alarm->seconds, at_alarm->message);
+                alarm_free (alarm);
+            }
+
+            status = pthread_mutex_unlock (&alarm_mutex);
+            if (status != 0)
+                err_abort (status, "Unlock mutex");
+            wal_wait (lsn);
+        } else if(command == COMMAND_CANCEL)  {
+            alarm_free (alarm);
+
+            /*
+             * Mark the alarm with a tombstone (see cancel_alarm).
+             * The read lock keeps it from being retired until we
+             * are done with it.
+             */
+            lsn = 0;
+            rwlock_read_lock(&list_lock);
+            at_alarm = get_alarm_at(cancel_message_id);
+            if (at_alarm == NULL) {
+                sink_printf("Error: No Alarm Request With Message Number (%d) to Cancel!\n", cancel_message_id);
+            } else if (!cancel_alarm (at_alarm)) {
+                sink_printf("Error: More Than One Request to Cancel Alarm Request With Message Number (%d)!\n", cancel_message_id);
+            } else {
+                lsn = wal_append (WAL_CANCEL, at_alarm);
+                sink_printf("Cancel Alarm Request With Message Number (%d) Received at <%ld>: <%d %s>\n",
+                    at_alarm->mssg_num, time(NULL), at_alarm->seconds, at_alarm->message);
+            }
+            rwlock_read_unlock(&list_lock);
+            cancel_wake_up ();
+            wal_wait (lsn);
+        } else if(command == COMMAND_CANCEL_RANGE
+            || command == COMMAND_CANCEL_PREFIX) {
+            if (command == COMMAND_CANCEL_RANGE)
+                sink_printf("Cancel Alarm Requests With Message Numbers (%d-%d) Received at <%ld>: %d cancelled\n",
+                    cancel_message_id, cancel_high, time(NULL),
+                    cancel_matching (cancel_message_id, cancel_high, NULL));
+            else
+                sink_printf("Cancel Alarm Requests With Messages Starting (%s) Received at <%ld>: %d cancelled\n",
+                    alarm->message, time(NULL),
+                    cancel_matching (0, 0, alarm->message));
+            alarm_free (alarm);
         } else {
             fprintf (stderr, "Invalid command.\n");
-            free (alarm);
+            alarm_free (alarm);
         }
     }
 }
+#endif
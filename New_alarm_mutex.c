@@ -13,6 +13,20 @@
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
+#include "slab.h"
+#include "parse.h"
+#include "arena.h"
+#include "scan.h"
+#include "order.h"
+
+#define COMMAND_START   1
+#define COMMAND_CANCEL  2
+#define COMMAND_VIEW    3
+#define COMMAND_SCALE   4
+#define COMMAND_STATS   5
+#define COMMAND_CANCEL_CATEGORY 6
+#define COMMAND_CANCEL_RANGE    7
+#define COMMAND_CANCEL_PREFIX   8
 
 /*
  * The "alarm" structure now contains the time_t (time since the
@@ -20,31 +34,481 @@
  * sorted. Storing the requested number of seconds would not be
  * enough, since the "alarm thread" cannot tell how long it has
  * been on the list.
+ *
+ * The message and its category are not kept in the alarm, but in
+ * alarm_strings (see arena.h), where alarms with the same text
+ * share one copy; the alarm holds only a reference to each. That
+ * keeps the alarm to 64 bytes, instead of the 216 it took with the
+ * text inline.
  */
 typedef struct alarm_tag
 {
-    struct alarm_tag *link;
-    int seconds;
-    char type[20];
-    int Alarm_ID;
+    struct alarm_tag *link; /* Chains alarms that have fired */
     time_t time; /* seconds from EPOCH */
-    char message[128];
-    char Alarm_catagory[20];
-    char Message_catagory[20];
+    const char *message;          /* In alarm_strings */
+    const char *Message_catagory; /* In alarm_strings */
+    struct category_tag *category; /* Once it is pending */
+    int category_pos; /* In its category's alarms */
+    int pending_pos; /* In the pending set */
+    int Alarm_ID;
+    int seconds;
+    int type; /* COMMAND_START, COMMAND_CANCEL, ... */
 } alarm_t;
 
+/*
+ * Alarms are routed by their category. Each category has a queue
+ * of alarms that have fired, in the order they fired, and its own
+ * consumer threads that take them off the queue and display them,
+ * so a category with a burst of alarms, or a slow one, holds up
+ * none of the others. The number of consumers is set for each
+ * category, with -c at startup or Scale_Category as it runs, and a
+ * consumer that finds more running than were asked for exits.
+ *
+ * Each category also indexes its pending alarms, so finding the
+ * alarms of one category takes time in proportion to how many it
+ * has, not to how many alarms are pending. The index, and the list
+ * of categories, are protected by alarm_mutex; the queue and the
+ * counters by the category's own mutex, which is locked after
+ * alarm_mutex when both are. Categories are never freed, so a
+ * pointer to one stays good.
+ */
+typedef struct category_tag
+{
+    struct category_tag *next; /* In the list of categories */
+    const char *name;          /* In alarm_strings */
+    alarm_t **alarms;          /* Pending alarms in this category */
+    int count;
+    int size;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    alarm_t *head;             /* Fired alarms, linked through link */
+    alarm_t *tail;
+    int depth;                 /* Alarms on the queue */
+    int max_depth;
+    long displayed;
+    int consumers;             /* Consumer threads wanted */
+    int running;               /* Consumer threads running */
+    time_t started;
+} category_t;
+
+#define CATEGORY_OPTIONS 32
+
+category_t *categories = NULL;
+int category_consumers = 1; /* For categories not named by -c */
+struct
+{
+    const char *name;
+    int consumers;
+} category_options[CATEGORY_OPTIONS];
+int category_option_count = 0;
+
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-alarm_t *alarm_list = NULL;
+
+/*
+ * The pending alarms are kept as a structure of arrays rather than
+ * as a linked list: alarm_times and alarm_ids hold each alarm's
+ * deadline and id, contiguously and in the same order, and
+ * alarm_nodes the alarm itself. The alarm thread's search for
+ * expired alarms and the main thread's search for an id to cancel
+ * then read only the array they compare, without touching the
+ * alarms, and compare several entries at a time (see scan.h). The
+ * order means nothing: an alarm is added at the end, and removed
+ * by moving the last one into its place. All of this is protected
+ * by alarm_mutex.
+ */
+int64_t *alarm_times = NULL;
+int *alarm_ids = NULL;
+alarm_t **alarm_nodes = NULL;
+int *alarm_expired = NULL; /* Indexes found by scan_expired */
+int alarm_count = 0;
+int alarm_size = 0;
+
+/*
+ * Pending alarms are also indexed in order of id, and of message,
+ * so that the alarms in a range of ids, or with messages that start
+ * with a given prefix, are found without looking at the others
+ * (see order.h). Two alarms may have the same id or message, so
+ * each order is broken by the alarms' addresses. Like the pending
+ * set, the indexes are protected by alarm_mutex.
+ */
+int alarm_compare_address(const void *a, const void *b)
+{
+    return a < b ? -1 : a > b;
+}
+
+int alarm_compare_id(const void *a, const void *b)
+{
+    int x = ((const alarm_t *)a)->Alarm_ID, y = ((const alarm_t *)b)->Alarm_ID;
+
+    return x != y ? (x < y ? -1 : 1) : alarm_compare_address(a, b);
+}
+
+int alarm_compare_message(const void *a, const void *b)
+{
+    int order = strcmp(((const alarm_t *)a)->message,
+                       ((const alarm_t *)b)->message);
+
+    return order != 0 ? order : alarm_compare_address(a, b);
+}
+
+int alarm_before_id(const void *item, const void *key)
+{
+    return ((const alarm_t *)item)->Alarm_ID < *(const int *)key;
+}
+
+int alarm_before_message(const void *item, const void *key)
+{
+    return strcmp(((const alarm_t *)item)->message, (const char *)key) < 0;
+}
+
+order_t alarm_id_order = ORDER_INITIALIZER(alarm_compare_id);
+order_t alarm_message_order = ORDER_INITIALIZER(alarm_compare_message);
+
+/*
+ * Alarms are allocated by the main thread and freed by the alarm
+ * thread, so they come from a slab rather than from malloc.
+ */
+slab_t alarm_slab = SLAB_INITIALIZER(alarm_t);
+arena_t alarm_strings = ARENA_INITIALIZER;
+
+/*
+ * Free an alarm, and its references to its strings.
+ */
+void alarm_free(alarm_t *alarm)
+{
+    arena_release(&alarm_strings, alarm->message);
+    arena_release(&alarm_strings, alarm->Message_catagory);
+    slab_free(&alarm_slab, alarm);
+}
+
+/*
+ * Add an alarm to its category's index, or take it out. The caller
+ * must have locked alarm_mutex.
+ */
+void category_add(category_t *category, alarm_t *alarm)
+{
+    if (category->count == category->size)
+    {
+        category->size = category->size ? category->size * 2 : 16;
+        category->alarms = (alarm_t **)realloc(
+            category->alarms, category->size * sizeof(alarm_t *));
+        if (category->alarms == NULL)
+            errno_abort("Grow category");
+    }
+    alarm->category_pos = category->count;
+    category->alarms[category->count++] = alarm;
+}
+
+void category_remove(category_t *category, alarm_t *alarm)
+{
+    alarm_t *last = category->alarms[--category->count];
+
+    category->alarms[alarm->category_pos] = last;
+    last->category_pos = alarm->category_pos;
+}
+
+/*
+ * A category's consumer thread: display the alarms on its queue,
+ * until there are more consumers running than are wanted.
+ */
+void *category_thread(void *arg)
+{
+    category_t *category = (category_t *)arg;
+    alarm_t *alarm;
+    int status;
+
+    while (1)
+    {
+        status = pthread_mutex_lock(&category->mutex);
+        if (status != 0)
+            err_abort(status, "Lock category");
+        while (category->head == NULL
+               && category->running <= category->consumers)
+        {
+            status = pthread_cond_wait(&category->cond, &category->mutex);
+            if (status != 0)
+                err_abort(status, "Wait for alarm");
+        }
+        if (category->running > category->consumers)
+        {
+            category->running--;
+            status = pthread_mutex_unlock(&category->mutex);
+            if (status != 0)
+                err_abort(status, "Unlock category");
+            return NULL;
+        }
+        alarm = category->head;
+        category->head = alarm->link;
+        if (category->head == NULL)
+            category->tail = NULL;
+        category->depth--;
+        status = pthread_mutex_unlock(&category->mutex);
+        if (status != 0)
+            err_abort(status, "Unlock category");
+
+        printf("(%d) %s\n", alarm->seconds, alarm->message);
+        __atomic_add_fetch(&category->displayed, 1, __ATOMIC_RELAXED);
+        alarm_free(alarm);
+    }
+}
+
+/*
+ * Run "consumers" threads for a category, starting more or letting
+ * some exit.
+ */
+void category_scale(category_t *category, int consumers)
+{
+    pthread_t thread;
+    int status;
+
+    status = pthread_mutex_lock(&category->mutex);
+    if (status != 0)
+        err_abort(status, "Lock category");
+    category->consumers = consumers;
+    for (; category->running < consumers; category->running++)
+    {
+        status = pthread_create(&thread, NULL, category_thread, category);
+        if (status != 0)
+            err_abort(status, "Create category thread");
+        pthread_detach(thread);
+    }
+    status = pthread_cond_broadcast(&category->cond);
+    if (status != 0)
+        err_abort(status, "Wake category");
+    status = pthread_mutex_unlock(&category->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock category");
+}
+
+/*
+ * Return the category called "name", a reference from
+ * alarm_strings, or NULL if there is none. The caller must have
+ * locked alarm_mutex.
+ */
+category_t *category_find(const char *name)
+{
+    category_t *category;
+
+    for (category = categories; category != NULL; category = category->next)
+        if (category->name == name)
+            return category;
+    return NULL;
+}
+
+/*
+ * Return the category called "name", creating it, and starting its
+ * consumers, if it is new. The caller must have locked alarm_mutex.
+ */
+category_t *category_get(const char *name)
+{
+    category_t *category, **last;
+    int status, i;
+
+    for (last = &categories; *last != NULL; last = &(*last)->next)
+        if ((*last)->name == name)
+            return *last;
+    category = (category_t *)calloc(1, sizeof(category_t));
+    if (category == NULL)
+        errno_abort("Allocate category");
+    category->name = arena_ref(&alarm_strings, name);
+    status = pthread_mutex_init(&category->mutex, NULL);
+    if (status != 0)
+        err_abort(status, "Init category mutex");
+    status = pthread_cond_init(&category->cond, NULL);
+    if (status != 0)
+        err_abort(status, "Init category cond");
+    category->started = time(NULL);
+    *last = category;
+    for (i = 0; i < category_option_count; i++)
+        if (strcmp(category_options[i].name, name) == 0)
+            break;
+    category_scale(category, i < category_option_count
+                   ? category_options[i].consumers : category_consumers);
+    return category;
+}
+
+/*
+ * Queue an alarm that has fired for its category's consumers.
+ */
+void category_post(alarm_t *alarm)
+{
+    category_t *category = alarm->category;
+    int status;
+
+    status = pthread_mutex_lock(&category->mutex);
+    if (status != 0)
+        err_abort(status, "Lock category");
+    alarm->link = NULL;
+    if (category->tail == NULL)
+        category->head = alarm;
+    else
+        category->tail->link = alarm;
+    category->tail = alarm;
+    if (++category->depth > category->max_depth)
+        category->max_depth = category->depth;
+    status = pthread_cond_signal(&category->cond);
+    if (status != 0)
+        err_abort(status, "Signal category");
+    status = pthread_mutex_unlock(&category->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock category");
+}
+
+/*
+ * Print a category's counters: its pending alarms, the alarms on
+ * its queue now and at most, and how many it has displayed, in all
+ * and per second since it was created.
+ */
+void category_report(category_t *category)
+{
+    int status, depth, max_depth, consumers;
+    long displayed;
+    time_t elapsed;
+
+    status = pthread_mutex_lock(&category->mutex);
+    if (status != 0)
+        err_abort(status, "Lock category");
+    depth = category->depth;
+    max_depth = category->max_depth;
+    consumers = category->consumers;
+    status = pthread_mutex_unlock(&category->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock category");
+    displayed = __atomic_load_n(&category->displayed, __ATOMIC_RELAXED);
+    elapsed = time(NULL) - category->started;
+    printf("Category %s: %d consumers, %d pending, %d queued (max %d),"
+           " %ld displayed (%.2f/s)\n", category->name, consumers,
+           category->count, depth, max_depth, displayed,
+           (double)displayed / (elapsed > 0 ? elapsed : 1));
+}
+
+/*
+ * Add an alarm to the pending set, and, if it has a category, to
+ * the category and the id and message indexes. (The benchmarks
+ * build pending sets of alarms with no category, which need none
+ * of the indexes.) The caller must have locked alarm_mutex.
+ */
+void pending_add(alarm_t *alarm)
+{
+    if (alarm_count == alarm_size)
+    {
+        alarm_size = alarm_size ? alarm_size * 2 : 64;
+        alarm_times = (int64_t *)realloc(
+            alarm_times, alarm_size * sizeof(int64_t));
+        alarm_ids = (int *)realloc(alarm_ids, alarm_size * sizeof(int));
+        alarm_nodes = (alarm_t **)realloc(
+            alarm_nodes, alarm_size * sizeof(alarm_t *));
+        alarm_expired = (int *)realloc(
+            alarm_expired, alarm_size * sizeof(int));
+        if (alarm_times == NULL || alarm_ids == NULL
+            || alarm_nodes == NULL || alarm_expired == NULL)
+            errno_abort("Grow pending alarms");
+    }
+    alarm->pending_pos = alarm_count;
+    alarm_times[alarm_count] = alarm->time;
+    alarm_ids[alarm_count] = alarm->Alarm_ID;
+    alarm_nodes[alarm_count++] = alarm;
+    if (alarm->category != NULL)
+    {
+        category_add(alarm->category, alarm);
+        order_put(&alarm_id_order, alarm);
+        order_put(&alarm_message_order, alarm);
+    }
+}
+
+/*
+ * Take the alarm at index "i" out of the pending set, and its
+ * indexes, moving the last alarm into its place, and return it.
+ * The caller must have locked alarm_mutex.
+ */
+alarm_t *pending_remove(int i)
+{
+    alarm_t *alarm = alarm_nodes[i];
+
+    if (alarm->category != NULL)
+    {
+        category_remove(alarm->category, alarm);
+        order_remove(&alarm_id_order, alarm);
+        order_remove(&alarm_message_order, alarm);
+    }
+    alarm_count--;
+    alarm_times[i] = alarm_times[alarm_count];
+    alarm_ids[i] = alarm_ids[alarm_count];
+    alarm_nodes[i] = alarm_nodes[alarm_count];
+    alarm_nodes[i]->pending_pos = i;
+    return alarm;
+}
+
+/*
+ * Cancel every pending alarm of a category, with an id from "low"
+ * to "high", or with a message that starts with "prefix", according
+ * to "command", and return how many there were. The alarms are
+ * found through the indexes, so the cost is in proportion to the
+ * number cancelled. The caller must have locked alarm_mutex, and
+ * holds it for the whole operation.
+ */
+alarm_t **alarm_cancels = NULL;
+int alarm_cancels_size = 0;
+
+int pending_cancel(int command, category_t *category,
+                   int low, int high, const char *prefix)
+{
+    order_node_t *node;
+    alarm_t *alarm;
+    int count = 0, length, i;
+
+    if (command == COMMAND_CANCEL_CATEGORY)
+    {
+        while (category->count > 0)
+        {
+            alarm = category->alarms[category->count - 1];
+            alarm_free(pending_remove(alarm->pending_pos));
+            count++;
+        }
+        return count;
+    }
+
+    /*
+     * Collect the alarms from the index before removing any, since
+     * removing one frees its node.
+     */
+    if (command == COMMAND_CANCEL_RANGE)
+        node = order_first(&alarm_id_order, alarm_before_id, &low);
+    else
+        node = order_first(
+            &alarm_message_order, alarm_before_message, prefix);
+    length = prefix != NULL ? strlen(prefix) : 0;
+    for (; node != NULL; node = node->next[0])
+    {
+        alarm = (alarm_t *)node->item;
+        if (command == COMMAND_CANCEL_RANGE ? alarm->Alarm_ID > high
+            : strncmp(alarm->message, prefix, length) != 0)
+            break;
+        if (count == alarm_cancels_size)
+        {
+            alarm_cancels_size =
+                alarm_cancels_size ? alarm_cancels_size * 2 : 64;
+            alarm_cancels = (alarm_t **)realloc(
+                alarm_cancels, alarm_cancels_size * sizeof(alarm_t *));
+            if (alarm_cancels == NULL)
+                errno_abort("Grow cancels");
+        }
+        alarm_cancels[count++] = alarm;
+    }
+    for (i = 0; i < count; i++)
+        alarm_free(pending_remove(alarm_cancels[i]->pending_pos));
+    return count;
+}
 
 /*
  * The alarm thread's start routine.
  */
 void *alarm_thread(void *arg)
 {
-    alarm_t *alarm;
+    alarm_t *alarm, *fired;
     int sleep_time;
     time_t now;
-    int status;
+    int status, count, i;
 
     /*
      * Loop forever, processing commands. The alarm thread will
@@ -55,72 +519,704 @@ void *alarm_thread(void *arg)
         status = pthread_mutex_lock(&alarm_mutex);
         if (status != 0)
             err_abort(status, "Lock mutex");
-        alarm = alarm_list;
 
         /*
-         * If the alarm list is empty, wait for one second. This
-         * allows the main thread to run, and read another
-         * command. If the list is not empty, remove the first
-         * item. Compute the number of seconds to wait -- if the
-         * result is less than 0 (the time has passed), then set
-         * the sleep_time to 0.
+         * Take every alarm that has expired out of the pending
+         * set, chained through their links. They are removed
+         * from the highest index down, so that the alarm moved
+         * into each hole has already been looked at. If any
+         * alarms are left, compute the number of seconds until the
+         * earliest of them; if there are none, wait for one
+         * second. This allows the main thread to run, and read
+         * another command.
          */
-        if (alarm == NULL)
+        now = time(NULL);
+        fired = NULL;
+        count = scan_expired(alarm_times, alarm_count, now, alarm_expired);
+        for (i = count - 1; i >= 0; i--)
+        {
+            alarm = pending_remove(alarm_expired[i]);
+            alarm->link = fired;
+            fired = alarm;
+        }
+        if (alarm_count == 0)
             sleep_time = 1;
         else
-        {
-            alarm_list = alarm->link;
-            now = time(NULL);
-            if (alarm->time <= now)
-                sleep_time = 0;
-            else
-                sleep_time = alarm->time - now;
+            sleep_time = scan_earliest(alarm_times, alarm_count) - now;
 #ifdef DEBUG
-            printf("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                   sleep_time, alarm->message);
+        printf("[waiting: %d alarms, %d seconds]\n", alarm_count, sleep_time);
 #endif
-        }
 
         /*
          * Unlock the mutex before waiting, so that the main
          * thread can lock it to insert a new alarm request. If
-         * the sleep_time is 0, then call sched_yield, giving
+         * any alarms expired, call sched_yield instead, giving
          * the main thread a chance to run if it has been
-         * readied by user input, without delaying the message
+         * readied by user input, without delaying the messages
          * if there's no input.
          */
         status = pthread_mutex_unlock(&alarm_mutex);
         if (status != 0)
             err_abort(status, "Unlock mutex");
-        if (sleep_time > 0)
+        if (fired == NULL)
             sleep(sleep_time);
         else
             sched_yield();
 
         /*
-         * If a timer expired, print the message and free the
+         * Hand each alarm that expired to its category's
+         * consumers, which print its message and free the
          * structure.
          */
-        if (alarm != NULL)
+        while (fired != NULL)
         {
-            printf("(%d) %s\n", alarm->seconds, alarm->message);
-            free(alarm);
+            alarm = fired;
+            fired = alarm->link;
+            category_post(alarm);
         }
     }
 }
 
+/*
+ * Parse one command line in a single pass, without sscanf:
+ *
+ *      Start_Alarm(id): seconds category message
+ *      Cancel_Alarm(id)
+ *      View_Category(category)
+ *      Scale_Category(category): consumers
+ *      View_Categories
+ *      Cancel_Category(category)
+ *      Cancel_Alarms(low-high)
+ *      Cancel_Prefix(prefix)
+ *
+ * The numbers are read straight into "alarm" (the consumers, or
+ * the end of a range, into seconds), and the category and message
+ * (or prefix), once they have parsed, are put in alarm_strings.
+ * Returns the command, or 0 for a bad one.
+ */
+int parse_command(const char *line, alarm_t *alarm)
+{
+    const char *p = parse_space(line);
+    const char *start = parse_literal(p, "Start_Alarm(");
+    char category[20], message[128];
+
+    alarm->message = NULL;
+    alarm->Message_catagory = NULL;
+    alarm->category = NULL;
+    if (start == NULL && parse_literal(p, "View_Categories") != NULL)
+    {
+        if (parse_end(parse_literal(p, "View_Categories")) == NULL)
+            return 0;
+        alarm->type = COMMAND_STATS;
+        return COMMAND_STATS;
+    }
+    if (start == NULL && parse_literal(p, "Cancel_Category(") != NULL)
+    {
+        p = parse_literal(p, "Cancel_Category(");
+        p = parse_end(parse_until(p, ')', category, sizeof(category)));
+        if (p == NULL)
+            return 0;
+        alarm->Message_catagory = arena_put(&alarm_strings, category);
+        alarm->type = COMMAND_CANCEL_CATEGORY;
+        return COMMAND_CANCEL_CATEGORY;
+    }
+    if (start == NULL && parse_literal(p, "Cancel_Alarms(") != NULL)
+    {
+        p = parse_literal(p, "Cancel_Alarms(");
+        p = parse_int(p, &alarm->Alarm_ID);
+        p = parse_int(parse_literal(p, "-"), &alarm->seconds);
+        p = parse_end(parse_literal(p, ")"));
+        if (p == NULL || alarm->seconds < alarm->Alarm_ID)
+            return 0;
+        alarm->type = COMMAND_CANCEL_RANGE;
+        return COMMAND_CANCEL_RANGE;
+    }
+    if (start == NULL && parse_literal(p, "Cancel_Prefix(") != NULL)
+    {
+        p = parse_literal(p, "Cancel_Prefix(");
+        p = parse_end(parse_until(p, ')', message, sizeof(message)));
+        if (p == NULL)
+            return 0;
+        alarm->message = arena_put(&alarm_strings, message);
+        alarm->type = COMMAND_CANCEL_PREFIX;
+        return COMMAND_CANCEL_PREFIX;
+    }
+    if (start == NULL && parse_literal(p, "View_Category(") != NULL)
+    {
+        p = parse_literal(p, "View_Category(");
+        p = parse_end(parse_until(p, ')', category, sizeof(category)));
+        if (p == NULL)
+            return 0;
+        alarm->Message_catagory = arena_put(&alarm_strings, category);
+        alarm->type = COMMAND_VIEW;
+        return COMMAND_VIEW;
+    }
+    if (start == NULL && parse_literal(p, "Scale_Category(") != NULL)
+    {
+        p = parse_literal(p, "Scale_Category(");
+        p = parse_until(p, ')', category, sizeof(category));
+        p = parse_literal(p, ":");
+        p = parse_end(parse_int(parse_space(p), &alarm->seconds));
+        if (p == NULL || alarm->seconds < 1)
+            return 0;
+        alarm->Message_catagory = arena_put(&alarm_strings, category);
+        alarm->type = COMMAND_SCALE;
+        return COMMAND_SCALE;
+    }
+    if (start == NULL)
+    {
+        p = parse_literal(p, "Cancel_Alarm(");
+        p = parse_int(p, &alarm->Alarm_ID);
+        p = parse_end(parse_literal(p, ")"));
+        if (p == NULL)
+            return 0;
+        alarm->type = COMMAND_CANCEL;
+        return COMMAND_CANCEL;
+    }
+    p = parse_int(start, &alarm->Alarm_ID);
+    p = parse_literal(p, ")");
+    if (p != NULL && *p == ':')
+        p++;
+    p = parse_int(parse_space(p), &alarm->seconds);
+    p = parse_word(parse_space(p), category, sizeof(category));
+    p = parse_text(parse_space(p), message, sizeof(message));
+    if (p == NULL)
+        return 0;
+    alarm->Message_catagory = arena_put(&alarm_strings, category);
+    alarm->message = arena_put(&alarm_strings, message);
+    alarm->type = COMMAND_START;
+    return COMMAND_START;
+}
+
+#ifdef BENCH
+/*
+ * Benchmark driver. Compiling with -DBENCH replaces the
+ * interactive main with this one, which builds sets of alarms
+ * directly, without the alarm thread:
+ *
+ *      cc New_alarm_mutex.c -DBENCH -D_POSIX_PTHREAD_SEMANTICS -lpthread
+ *      a.out [name] [count ...]
+ *
+ * "name" selects one benchmark (all of them run if it is
+ * omitted), and the counts override its default sizes.
+ *
+ * "a.out arena": for each count (1M by default), that many alarms
+ * with 64 distinct messages in 8 categories are built twice: as alarm_t,
+ * with their text in alarm_strings, and as bench_inline_t, with
+ * their text inline as alarm_t used to have it. Each set is linked
+ * into a list in random order, as inserts arriving in no
+ * particular order would leave it. The memory each takes is
+ * reported, and two scans of each list: the walk insert and cancel
+ * make, which reads each alarm's link and id, and the one the
+ * alarm thread makes as alarms fire, which reads the time and the
+ * text as well. Each scan is timed, and its cache misses are
+ * counted with perf_event_open where the system allows it.
+ */
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+typedef struct bench_inline_tag
+{
+    struct bench_inline_tag *link;
+    int seconds;
+    char type[20];
+    int Alarm_ID;
+    time_t time;
+    char message[128];
+    char Alarm_catagory[20];
+    char Message_catagory[20];
+} bench_inline_t;
+
+long bench_sum = 0; /* Keeps the scans from being optimized out */
+
+double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Open a count of this thread's cache misses, or return -1 if the
+ * system doesn't allow it.
+ */
+int bench_counter(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long bench_misses(int counter)
+{
+    long long count;
+
+    if (counter < 0 || read(counter, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
+
+void bench_report(const char *name, int count, int counter,
+                  double start, long long misses)
+{
+    double elapsed = bench_now() - start;
+
+    if (counter >= 0)
+        printf("  %-14s %8.1f ns/alarm, %6.3f cache misses/alarm\n", name,
+               elapsed * 1e9 / count,
+               (double)(bench_misses(counter) - misses) / count);
+    else
+        printf("  %-14s %8.1f ns/alarm, cache misses n/a\n", name,
+               elapsed * 1e9 / count);
+}
+
+void bench_arena(int count)
+{
+    alarm_t **alarms, *alarm;
+    bench_inline_t *inline_alarms, *inline_alarm;
+    char message[128], category[20];
+    int *order, counter, i, j, t;
+    long long misses;
+    double start;
+
+    order = (int *)malloc(count * sizeof(int));
+    alarms = (alarm_t **)malloc(count * sizeof(alarm_t *));
+    inline_alarms = (bench_inline_t *)calloc(count, sizeof(bench_inline_t));
+    if (order == NULL || alarms == NULL || inline_alarms == NULL)
+        errno_abort("Allocate benchmark alarms");
+    srand(1);
+    for (i = 0; i < count; i++)
+        order[i] = i;
+    for (i = count - 1; i > 0; i--)
+    {
+        j = rand() % (i + 1);
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        sprintf(message, "Periodic alarm message %d", i % 64);
+        sprintf(category, "Category%d", i % 8);
+        alarm = (alarm_t *)slab_alloc(&alarm_slab);
+        alarm->Alarm_ID = i;
+        alarm->seconds = 10;
+        alarm->time = time(NULL) + 10;
+        alarm->type = COMMAND_START;
+        alarm->message = arena_put(&alarm_strings, message);
+        alarm->Message_catagory = arena_put(&alarm_strings, category);
+        alarm->category = NULL;
+        alarms[i] = alarm;
+        inline_alarm = &inline_alarms[i];
+        inline_alarm->Alarm_ID = i;
+        inline_alarm->seconds = 10;
+        inline_alarm->time = alarm->time;
+        strcpy(inline_alarm->type, "Start_Alarm");
+        strcpy(inline_alarm->message, message);
+        strcpy(inline_alarm->Message_catagory, category);
+    }
+    for (i = 0; i < count; i++)
+    {
+        alarms[order[i]]->link = i + 1 < count ? alarms[order[i + 1]] : NULL;
+        inline_alarms[order[i]].link =
+            i + 1 < count ? &inline_alarms[order[i + 1]] : NULL;
+    }
+
+    printf("arena %d alarms: inline %.1f MB, arena %.1f MB"
+           " (%d byte alarms, %d strings in %ld bytes)\n",
+           count, (double)count * sizeof(bench_inline_t) / 1e6,
+           ((double)count * alarm_slab.size + alarm_strings.bytes) / 1e6,
+           (int)alarm_slab.size, alarm_strings.count, alarm_strings.bytes);
+
+    counter = bench_counter();
+    misses = bench_misses(counter);
+    start = bench_now();
+    for (inline_alarm = &inline_alarms[order[0]]; inline_alarm != NULL;
+         inline_alarm = inline_alarm->link)
+        if (inline_alarm->Alarm_ID < 0)
+            bench_sum++;
+    bench_report("walk inline", count, counter, start, misses);
+    misses = bench_misses(counter);
+    start = bench_now();
+    for (alarm = alarms[order[0]]; alarm != NULL; alarm = alarm->link)
+        if (alarm->Alarm_ID < 0)
+            bench_sum++;
+    bench_report("walk arena", count, counter, start, misses);
+    misses = bench_misses(counter);
+    start = bench_now();
+    for (inline_alarm = &inline_alarms[order[0]]; inline_alarm != NULL;
+         inline_alarm = inline_alarm->link)
+        bench_sum += inline_alarm->time + inline_alarm->message[0]
+            + inline_alarm->Message_catagory[0];
+    bench_report("fire inline", count, counter, start, misses);
+    misses = bench_misses(counter);
+    start = bench_now();
+    for (alarm = alarms[order[0]]; alarm != NULL; alarm = alarm->link)
+        bench_sum += alarm->time + alarm->message[0]
+            + alarm->Message_catagory[0];
+    bench_report("fire arena", count, counter, start, misses);
+    if (counter >= 0)
+        close(counter);
+
+    for (i = 0; i < count; i++)
+        alarm_free(alarms[i]);
+    free(inline_alarms);
+    free(alarms);
+    free(order);
+}
+
+/*
+ * "a.out scan": build a pending set of "count" alarms (10M by
+ * default) due at random over the next day, and link the same
+ * alarms into a list in random order, as alarm_t used to be kept.
+ * Then report how many alarms a second each search covers: finding
+ * the alarms that have expired (about a thousandth of them),
+ * finding an id that isn't there, and finding the earliest
+ * deadline. Each is done by walking the list, and with each kind
+ * of scan the processor supports, repeated for at least
+ * BENCH_SCAN_SECONDS. The scans must all agree with the walk.
+ */
+#define BENCH_SCAN_SECONDS 0.5
+
+void bench_scan(int count)
+{
+    alarm_t *list, *alarm;
+    int64_t now, earliest, expired_earliest;
+    double start, rates[3];
+    long rounds;
+    int mode, found, expired_found, i, j;
+
+    srand(1);
+    now = time(NULL);
+    for (i = 0; i < count; i++)
+    {
+        alarm = (alarm_t *)slab_alloc(&alarm_slab);
+        alarm->Alarm_ID = i;
+        alarm->seconds = 1 + rand() % 86400;
+        alarm->time = now + alarm->seconds;
+        alarm->type = COMMAND_START;
+        alarm->message = arena_put(&alarm_strings, "bench");
+        alarm->Message_catagory = NULL;
+        alarm->category = NULL;
+        pending_add(alarm);
+    }
+    for (i = count - 1; i > 0; i--)
+    {
+        j = rand() % (i + 1);
+        alarm = alarm_nodes[i];
+        alarm_nodes[i] = alarm_nodes[j];
+        alarm_nodes[j] = alarm;
+    }
+    list = NULL;
+    for (i = 0; i < count; i++)
+    {
+        alarm_nodes[i]->link = list;
+        list = alarm_nodes[i];
+    }
+    for (i = 0; i < count; i++)
+    {
+        alarm_times[i] = alarm_nodes[i]->time;
+        alarm_ids[i] = alarm_nodes[i]->Alarm_ID;
+        alarm_nodes[i]->pending_pos = i;
+    }
+    now += 86;
+
+    start = bench_now();
+    for (rounds = 0; rounds == 0 || bench_now() - start < BENCH_SCAN_SECONDS;
+         rounds++)
+        for (expired_found = 0, alarm = list; alarm != NULL;
+             alarm = alarm->link)
+            if (alarm->time <= now)
+                expired_found++;
+    rates[0] = rounds * (double)count / (bench_now() - start);
+    start = bench_now();
+    for (rounds = 0; rounds == 0 || bench_now() - start < BENCH_SCAN_SECONDS;
+         rounds++)
+        for (alarm = list; alarm != NULL; alarm = alarm->link)
+            if (alarm->Alarm_ID == -1)
+                bench_sum++;
+    rates[1] = rounds * (double)count / (bench_now() - start);
+    start = bench_now();
+    for (rounds = 0; rounds == 0 || bench_now() - start < BENCH_SCAN_SECONDS;
+         rounds++)
+        for (expired_earliest = list->time, alarm = list; alarm != NULL;
+             alarm = alarm->link)
+            if (alarm->time < expired_earliest)
+                expired_earliest = alarm->time;
+    rates[2] = rounds * (double)count / (bench_now() - start);
+    printf("scan %d: %-6s expired %8.1f M/s, find %8.1f M/s,"
+           " earliest %8.1f M/s\n", count, "list",
+           rates[0] / 1e6, rates[1] / 1e6, rates[2] / 1e6);
+
+    for (mode = SCAN_SCALAR; mode <= SCAN_AVX2; mode++)
+    {
+        if (!scan_supported(mode))
+            continue;
+        scan_init(mode);
+        start = bench_now();
+        for (rounds = 0;
+             rounds == 0 || bench_now() - start < BENCH_SCAN_SECONDS; rounds++)
+            found = scan_expired(alarm_times, count, now, alarm_expired);
+        rates[0] = rounds * (double)count / (bench_now() - start);
+        if (found != expired_found)
+            fprintf(stderr, "%s scan found %d expired alarms, not %d\n",
+                    scan_name(mode), found, expired_found);
+        start = bench_now();
+        for (rounds = 0;
+             rounds == 0 || bench_now() - start < BENCH_SCAN_SECONDS; rounds++)
+            bench_sum += scan_find(alarm_ids, count, -1);
+        rates[1] = rounds * (double)count / (bench_now() - start);
+        if (scan_find(alarm_ids, count, alarm_ids[count - 1]) != count - 1)
+            fprintf(stderr, "%s scan can't find the last id\n",
+                    scan_name(mode));
+        start = bench_now();
+        for (rounds = 0;
+             rounds == 0 || bench_now() - start < BENCH_SCAN_SECONDS; rounds++)
+            earliest = scan_earliest(alarm_times, count);
+        rates[2] = rounds * (double)count / (bench_now() - start);
+        if (earliest != expired_earliest)
+            fprintf(stderr, "%s scan found the wrong earliest deadline\n",
+                    scan_name(mode));
+        printf("scan %d: %-6s expired %8.1f M/s, find %8.1f M/s,"
+               " earliest %8.1f M/s\n", count, scan_name(mode),
+               rates[0] / 1e6, rates[1] / 1e6, rates[2] / 1e6);
+    }
+
+    while (alarm_count > 0)
+        alarm_free(pending_remove(alarm_count - 1));
+}
+
+/*
+ * "a.out category": build a pending set of "count" alarms (1M by
+ * default) spread over BENCH_CATEGORIES categories, and time
+ * finding every alarm of each category, once through the
+ * category's index and once by scanning the whole pending set.
+ * Both must find the same alarms.
+ */
+#define BENCH_CATEGORIES 64
+
+void bench_category(int count)
+{
+    category_t *category;
+    alarm_t *alarm;
+    const char *names[BENCH_CATEGORIES];
+    char name[20];
+    double start, indexed, scanned;
+    long found_indexed = 0, found_scanned = 0;
+    int c, i;
+
+    for (c = 0; c < BENCH_CATEGORIES; c++)
+    {
+        sprintf(name, "Category%d", c);
+        names[c] = arena_put(&alarm_strings, name);
+    }
+    for (i = 0; i < count; i++)
+    {
+        alarm = (alarm_t *)slab_alloc(&alarm_slab);
+        alarm->Alarm_ID = i;
+        alarm->seconds = 10;
+        alarm->time = time(NULL) + 10;
+        alarm->type = COMMAND_START;
+        alarm->message = arena_put(&alarm_strings, "bench");
+        alarm->Message_catagory = arena_ref(
+            &alarm_strings, names[rand() % BENCH_CATEGORIES]);
+        alarm->category = category_get(alarm->Message_catagory);
+        pending_add(alarm);
+    }
+
+    start = bench_now();
+    for (c = 0; c < BENCH_CATEGORIES; c++)
+    {
+        category = category_find(names[c]);
+        for (i = 0; i < category->count; i++)
+            bench_sum += category->alarms[i]->Alarm_ID;
+        found_indexed += category->count;
+    }
+    indexed = (bench_now() - start) / BENCH_CATEGORIES;
+    start = bench_now();
+    for (c = 0; c < BENCH_CATEGORIES; c++)
+        for (i = 0; i < alarm_count; i++)
+            if (alarm_nodes[i]->Message_catagory == names[c])
+            {
+                bench_sum += alarm_nodes[i]->Alarm_ID;
+                found_scanned++;
+            }
+    scanned = (bench_now() - start) / BENCH_CATEGORIES;
+    if (found_indexed != found_scanned)
+        fprintf(stderr, "Index found %ld alarms, scan %ld\n",
+                found_indexed, found_scanned);
+    printf("category %d alarms in %d categories: index %.1f us,"
+           " scan %.1f us per category (%.0fx)\n", count, BENCH_CATEGORIES,
+           indexed * 1e6, scanned * 1e6, scanned / indexed);
+
+    while (alarm_count > 0)
+        alarm_free(pending_remove(alarm_count - 1));
+    for (c = 0; c < BENCH_CATEGORIES; c++)
+        arena_release(&alarm_strings, names[c]);
+}
+
+/*
+ * "a.out cancel": build a pending set of "count" alarms (10k, 100k
+ * and 1M by default), in BENCH_CATEGORIES categories, with messages
+ * that start with one of BENCH_CATEGORIES prefixes. Then cancel a
+ * BENCH_CATEGORIES'th of them at a time by category, by a range of
+ * ids and by prefix, and, for comparison, the same number one id at
+ * a time, as Cancel_Alarm does. The time per alarm cancelled should
+ * not grow with the size of the set, except for one at a time.
+ */
+void bench_cancel_fill(int count, const char **names)
+{
+    alarm_t *alarm;
+    char message[128];
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        alarm = (alarm_t *)slab_alloc(&alarm_slab);
+        alarm->Alarm_ID = i;
+        alarm->seconds = 10;
+        alarm->time = time(NULL) + 10;
+        alarm->type = COMMAND_START;
+        sprintf(message, "tenant%d: message %d",
+                rand() % BENCH_CATEGORIES, i % 16);
+        alarm->message = arena_put(&alarm_strings, message);
+        alarm->Message_catagory = arena_ref(
+            &alarm_strings, names[rand() % BENCH_CATEGORIES]);
+        alarm->category = category_get(alarm->Message_catagory);
+        pending_add(alarm);
+    }
+}
+
+void bench_cancel(int count)
+{
+    const char *names[BENCH_CATEGORIES];
+    char name[20];
+    double start;
+    int c, i, k, cancelled;
+
+    for (c = 0; c < BENCH_CATEGORIES; c++)
+    {
+        sprintf(name, "Category%d", c);
+        names[c] = arena_put(&alarm_strings, name);
+    }
+    bench_cancel_fill(count, names);
+    k = count / BENCH_CATEGORIES;
+
+    start = bench_now();
+    cancelled = pending_cancel(COMMAND_CANCEL_CATEGORY,
+                               category_find(names[0]), 0, 0, NULL);
+    printf("cancel %d: %-10s %7d alarms, %8.1f ns/alarm\n", count,
+           "category", cancelled, (bench_now() - start) * 1e9 / cancelled);
+    start = bench_now();
+    cancelled = pending_cancel(COMMAND_CANCEL_RANGE, NULL, k, 2 * k - 1, NULL);
+    printf("cancel %d: %-10s %7d alarms, %8.1f ns/alarm\n", count,
+           "range", cancelled, (bench_now() - start) * 1e9 / cancelled);
+    start = bench_now();
+    cancelled = pending_cancel(COMMAND_CANCEL_PREFIX, NULL, 0, 0, "tenant1:");
+    printf("cancel %d: %-10s %7d alarms, %8.1f ns/alarm\n", count,
+           "prefix", cancelled, (bench_now() - start) * 1e9 / cancelled);
+    start = bench_now();
+    for (cancelled = 0, i = 2 * k; i < 3 * k; i++)
+        if ((c = scan_find(alarm_ids, alarm_count, i)) >= 0)
+        {
+            alarm_free(pending_remove(c));
+            cancelled++;
+        }
+    printf("cancel %d: %-10s %7d alarms, %8.1f ns/alarm\n", count,
+           "one by one", cancelled, (bench_now() - start) * 1e9 / cancelled);
+
+    while (alarm_count > 0)
+        alarm_free(pending_remove(alarm_count - 1));
+    for (c = 0; c < BENCH_CATEGORIES; c++)
+        arena_release(&alarm_strings, names[c]);
+}
+
+struct bench_tag {
+    const char  *name;
+    void        (*run) (int count);
+    int         sizes[5];       /* Default counts, 0 terminated */
+} benches[] = {
+    {"arena", bench_arena, {1000000, 0}},
+    {"scan", bench_scan, {10000000, 0}},
+    {"category", bench_category, {10000, 1000000, 0}},
+    {"cancel", bench_cancel, {10000, 100000, 1000000, 0}},
+    {NULL}
+};
+
+int main(int argc, char *argv[])
+{
+    struct bench_tag *bench;
+    int i;
+
+    for (bench = benches; bench->name != NULL; bench++)
+    {
+        if (argc > 1 && strcmp(argv[1], bench->name) != 0)
+            continue;
+        if (argc > 2)
+        {
+            for (i = 2; i < argc; i++)
+                bench->run(atoi(argv[i]));
+        }
+        else
+        {
+            for (i = 0; bench->sizes[i] != 0; i++)
+                bench->run(bench->sizes[i]);
+        }
+    }
+    return 0;
+}
+#else
 int main(int argc, char *argv[])
 {
     int status;
-    int status2;
     char line[128];
-    alarm_t *alarm, **last, *next, *previous;
+    alarm_t *alarm;
+    category_t *category;
     pthread_t thread;
-    pthread_t displaythread;
-    char start[20] = "Start_Alarm";
-    char cancel[20] = "Cancel_Alarm";
-    char s[20], ss[20], sss[20];
+    char *equals;
+    int command, arg, i;
+
+    /*
+     * "-c consumers" sets the number of consumer threads each
+     * category starts with, and "-c category=consumers" sets it
+     * for one category.
+     */
+    for (arg = 1; arg < argc; arg++)
+    {
+        if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+        {
+            equals = strchr(argv[++arg], '=');
+            if (equals == NULL)
+                category_consumers = atoi(argv[arg]);
+            else if (category_option_count < CATEGORY_OPTIONS)
+            {
+                *equals = '\0';
+                category_options[category_option_count].name = argv[arg];
+                category_options[category_option_count++].consumers =
+                    atoi(equals + 1);
+            }
+            if ((equals == NULL ? category_consumers : atoi(equals + 1)) < 1)
+            {
+                fprintf(stderr, "A category needs at least one consumer\n");
+                exit(1);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-c [category=]consumers ...]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
 
+    scan_init(-1);
     status = pthread_create(
         &thread, NULL, alarm_thread, NULL);
     if (status != 0)
@@ -133,45 +1229,96 @@ int main(int argc, char *argv[])
             exit(0);
         if (strlen(line) <= 1)
             continue;
-        alarm = (alarm_t *)malloc(sizeof(alarm_t));
-        if (alarm == NULL)
-            errno_abort("Allocate alarm");
+        alarm = (alarm_t *)slab_alloc(&alarm_slab);
 
         /*
-         * Parse input line into seconds (%d) and a message
-         * (%128[^\n]), consisting of up to 128 characters
-         * separated from the seconds by whitespace.
+         * Parse input line into the alarm's id, seconds, message
+         * category and a message of up to 128 characters.
          */
-        int x = sscanf(line, "%s %d %s %128[^\n]", alarm->type, &alarm->seconds,
-                       alarm->Message_catagory, alarm->message);
-        int y = sscanf(alarm->type, "%[^'('](%[^')'],%s", s, ss, sss);
-        alarm->Alarm_ID = atoi(ss);
-       
+        command = parse_command(line, alarm);
 
-        if ((x != 1 && x != 4) || y < 2 || (strcmp(alarm->type, start) == 0 || strcmp(alarm->type, cancel) == 0))
+        if (command == 0)
         {
             fprintf(stderr, "Bad command\n");
-            free(alarm);
+            slab_free(&alarm_slab, alarm);
         }
-        else if (x == 1 && strcmp(alarm->type, cancel) == 0)
+        else if (command == COMMAND_CANCEL)
         {
-            //cancel code here
-            last = &alarm_list;
-            next = *last;
-            previous = *last;
-            while (next != NULL)
+            /*
+             * Remove the alarm with the same id, if it is still
+             * pending, and free it along with the request.
+             */
+            status = pthread_mutex_lock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Lock mutex");
+            i = scan_find(alarm_ids, alarm_count, alarm->Alarm_ID);
+            if (i >= 0)
+                alarm_free(pending_remove(i));
+            else
+                fprintf(stderr, "No alarm %d to cancel\n", alarm->Alarm_ID);
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+            slab_free(&alarm_slab, alarm);
+        }
+        else if (command == COMMAND_CANCEL_CATEGORY
+                 || command == COMMAND_CANCEL_RANGE
+                 || command == COMMAND_CANCEL_PREFIX)
+        {
+            /*
+             * Cancel every alarm that matches, through the
+             * indexes, under one lock of alarm_mutex.
+             */
+            status = pthread_mutex_lock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Lock mutex");
+            category = NULL;
+            if (command == COMMAND_CANCEL_CATEGORY
+                && (category = category_find(alarm->Message_catagory))
+                == NULL)
+                fprintf(stderr, "No category %s\n", alarm->Message_catagory);
+            else
+                printf("Cancelled %d alarms\n", pending_cancel(
+                           command, category, alarm->Alarm_ID,
+                           alarm->seconds, alarm->message));
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+            alarm_free(alarm);
+        }
+        else if (command != COMMAND_START)
+        {
+            /*
+             * View_Category lists a category's pending alarms from
+             * its index, and its counters; Scale_Category changes
+             * its number of consumers; View_Categories prints the
+             * counters of every category.
+             */
+            status = pthread_mutex_lock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Lock mutex");
+            if (command == COMMAND_STATS)
+                for (category = categories; category != NULL;
+                     category = category->next)
+                    category_report(category);
+            else if ((category = category_find(alarm->Message_catagory))
+                     == NULL)
+                fprintf(stderr, "No category %s\n", alarm->Message_catagory);
+            else if (command == COMMAND_SCALE)
+                category_scale(category, alarm->seconds);
+            else
             {
-                if (next->Alarm_ID == alarm->Alarm_ID)
-                {
-                    previous->link = previous->link->link;
-                    //*last = ;
-                    break;
-                }
-                last = &next->link;
-                next = next->link;
-                if (next->Alarm_ID != previous->link->Alarm_ID)
-                    previous = previous->link;
+                for (i = 0; i < category->count; i++)
+                    printf("Alarm(%d): %d %s\n",
+                           category->alarms[i]->Alarm_ID,
+                           (int)(category->alarms[i]->time - time(NULL)),
+                           category->alarms[i]->message);
+                category_report(category);
             }
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+            alarm_free(alarm);
         }
         else
         {
@@ -179,48 +1326,20 @@ int main(int argc, char *argv[])
             if (status != 0)
                 err_abort(status, "Lock mutex");
             alarm->time = time(NULL) + alarm->seconds;
-            // if()
-            //  status2 = pthread_create (
-            // &displaythread, NULL, Display_alarm_thread, alarm->Message_catagory);
-            // if (status2 != 0)
-            // err_abort (status, "Create Display thread");
 
             /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
+             * Add the new alarm to the pending set, and to its
+             * category, which starts its consumers if it is new.
              */
-            last = &alarm_list;
-            next = *last;
-
-            while (next != NULL)
-            {
-                if (next->Alarm_ID >= alarm->Alarm_ID)
-                {
-                    printf("alarm: %d\n", alarm->Alarm_ID);
-                    alarm->link = next;
-                    *last = alarm;
-                    break;
-                }
-                last = &next->link;
-                next = next->link;
-            }
-            /*
-             * If we reached the end of the list, insert the new
-             * alarm there. ("next" is NULL, and "last" points
-             * to the link field of the last item, or to the
-             * list header).
-             */
-            if (next == NULL)
-            {
-                *last = alarm;
-                alarm->link = NULL;
-            }
+            alarm->category = category_get(alarm->Message_catagory);
+            pending_add(alarm);
             printf("\nAlarm( <%d>) Inserted by Main Thread <%d> Into Alarm List at <%d>: <%d %s>", alarm->Alarm_ID, pthread_self(), (int)time(NULL),&alarm->time,alarm->message);
 #ifdef DEBUG
             printf ("[list: ");
-            for (next = alarm_list; next != NULL; next = next->link)
-                printf ("%d(%d)[\"%s\"] ", next->time,
-                    next->time - time (NULL), next->message);
+            for (i = 0; i < alarm_count; i++)
+                printf ("%d(%d)[\"%s\"] ", (int)alarm_times[i],
+                    (int)(alarm_times[i] - time (NULL)),
+                    alarm_nodes[i]->message);
             printf ("]\n");
 #endif
             status = pthread_mutex_unlock (&alarm_mutex);
@@ -229,3 +1348,4 @@ int main(int argc, char *argv[])
         }
     }
 }
+#endif
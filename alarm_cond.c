@@ -12,214 +12,2586 @@
  */
 #include <pthread.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include "errors.h"
+#include "slab.h"
+#include "alarm_index.h"
+#include "parse.h"
+#include "sink.h"
+#include "pool.h"
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Deadlines are read from CLOCK_MONOTONIC and kept as a count of
+ * nanoseconds, so that alarms can be given fractional seconds
+ * ("0.250") and are not disturbed when the wall clock is stepped.
+ */
+typedef long long nsec_t;
+
+#define NSEC_PER_SEC    1000000000LL
+
+nsec_t monotonic_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * The "alarm" structure now contains the monotonic deadline for
+ * each alarm, so that they can be sorted. Storing the requested
+ * number of seconds would not be enough, since the "alarm thread"
+ * cannot tell how long it has been on the list.
  */
 typedef struct alarm_tag {
     struct alarm_tag    *link;
+    struct alarm_tag    **wheel_ref;    /* Slot link pointing here */
     int                request; /*start or cancel alarm*/
-    int                 seconds;
+    int                 where;          /* ALARM_HEAP, ... */
+    int                 heap_pos;       /* Index in its shard's heap */
+    double              seconds;
     int                 message_number; 
     char                mess[8]; //"message"
-    time_t              time;    /* seconds from EPOCH */
+    nsec_t              time;    /* monotonic deadline, in ns */
     char                message[128];
 } alarm_t;
 
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-time_t current_alarm = 0;
+#define REQUEST_START   0
+#define REQUEST_CANCEL  1
+
+/*
+ * Where a pending alarm is, so that it can be found and taken out
+ * again when it is cancelled or replaced.
+ */
+#define ALARM_NEW       0       /* Not scheduled yet */
+#define ALARM_HEAP      1       /* In its shard's heap */
+#define ALARM_WHEEL     2       /* In the timing wheel */
+#define ALARM_CANCELLED 3       /* To be freed by shard_apply */
+
+/*
+ * The scheduler is split into shards, chosen at startup with
+ * "-n shards" (one by default). Each shard has its own heap of
+ * pending alarms and alarm thread, and an alarm belongs to the
+ * shard picked by a hash of its message number, so alarms in
+ * different shards never contend. Each shard also indexes its
+ * pending alarms by message number (see alarm_index.h), so that a
+ * later command for the same number can find the alarm to cancel
+ * or replace.
+ *
+ * Only the shard's alarm thread touches its heap and index. Other
+ * threads submit commands -- new alarms and cancels -- by pushing
+ * them onto the shard's submission queue, a lock-free stack linked
+ * through alarm_t's link, with a single compare-and-swap for a
+ * whole batch. The alarm thread takes the entire stack with one
+ * exchange, reverses it into submission order, and applies the
+ * commands. A producer that pushes onto an empty stack writes the
+ * shard's eventfd, which the alarm thread polls while it waits for
+ * its next deadline, along with a timerfd set to go off at that
+ * deadline (a poll timeout would do, but the kernel lets a poll
+ * timeout run late by 0.1% of its length, and a timerfd is exact);
+ * pushing onto a stack that is not empty needs
+ * no wakeup, since the alarm thread has not taken the earlier
+ * commands yet and will find these with them. The shard's mutex is
+ * held by the alarm thread whenever it isn't waiting, so producers
+ * never take it; main takes it to stop the thread at end of input.
+ *
+ * Pending alarms are kept in a binary min-heap ordered by
+ * expiration time, rather than in a sorted linked list. The heap
+ * lives in an array that is doubled whenever it fills, so both
+ * inserting an alarm and removing the earliest one cost O(log n)
+ * instead of a walk of the whole list. heap[0] is always the next
+ * alarm to expire, and it stays in the heap while the alarm thread
+ * waits for it: the thread only looks at it, and pops it when it
+ * fires, so an earlier alarm arriving costs one push and no more.
+ */
+typedef struct shard_tag {
+    pthread_mutex_t     mutex;
+    alarm_t             *submit;        /* Submission stack, newest first */
+    int                 event;          /* eventfd: submit was empty */
+    int                 timer;          /* timerfd: the next deadline */
+    nsec_t              armed;          /* When the timer goes off */
+    nsec_t              current_alarm;  /* Deadline the thread waits for */
+    alarm_t             **heap;
+    int                 count;
+    int                 size;
+    index_t             index;          /* Pending alarms by number */
+    alarm_t             **batch;        /* New alarms being applied */
+    int                 batch_size;
+    long                wakeups;        /* Returns from poll */
+    long                syscalls;       /* Made by shard_wait */
+    long                pushes;         /* Alarms pushed onto the heap */
+} shard_t;
+
+#define SHARD_MAX       64
+
+shard_t *shards = NULL;
+int shard_count = 1;
+
+/*
+ * Alarms are allocated by the main thread and freed by the alarm
+ * thread once they fire, so they come from a slab rather than
+ * from malloc.
+ */
+slab_t alarm_slab = SLAB_INITIALIZER (alarm_t);
 
 /*
- * Insert alarm entry on list, in order.
+ * How late each alarm fired compared to its deadline, counted in
+ * power-of-two buckets of microseconds: bucket 0 is under 1us,
+ * bucket i is under 2^i us. Updated atomically by the alarm
+ * threads of all the shards, and printed by main at end of input.
  */
-void alarm_insert (alarm_t *alarm)
+#define LATENESS_BUCKETS 32
+long lateness[LATENESS_BUCKETS];
+
+void record_lateness (nsec_t deadline, nsec_t now)
 {
-    int status;
-    alarm_t **last, *next;
+    nsec_t late = (now - deadline) / 1000;
+    int bucket = 0;
 
-    /*
-     * LOCKING PROTOCOL:
-     * 
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
-     */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL) {
-        if (next->time >= alarm->time) {
-            alarm->link = next;
-            *last = alarm;
+    while (late > 0 && bucket < LATENESS_BUCKETS - 1) {
+        late >>= 1;
+        bucket++;
+    }
+    __atomic_add_fetch (&lateness[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void print_lateness (void)
+{
+    int i;
+
+    printf ("Alarm lateness:\n");
+    for (i = 0; i < LATENESS_BUCKETS; i++)
+        if (lateness[i] != 0)
+            printf ("  < %10ld us: %ld\n", 1L << i, lateness[i]);
+}
+
+/*
+ * The pending alarms are held either by the heap or by the
+ * timing wheel, chosen once at startup ("-s heap" or "-s wheel")
+ * and never changed afterwards. The wheel is not sharded, so it
+ * runs with a single shard.
+ */
+#define SCHED_HEAP      0
+#define SCHED_WHEEL     1
+int scheduler = SCHED_HEAP;
+
+/*
+ * How late an alarm may fire ("-w usec"), so that alarms due close
+ * together are fired together. The alarm thread waits until "slack"
+ * after the earliest pending deadline, rather than until the
+ * deadline itself, and then fires every alarm that is due in one
+ * pass, with one wakeup and one new deadline for the lot. No alarm
+ * fires early; with a slack of 0 (the default) each alarm is waited
+ * for exactly.
+ */
+nsec_t slack = 0;
+
+/*
+ * Set up "count" empty shards.
+ */
+void shard_init (int count)
+{
+    int status, i;
+
+    shards = (shard_t*)calloc (count, sizeof (shard_t));
+    if (shards == NULL)
+        errno_abort ("Allocate shards");
+    shard_count = count;
+    for (i = 0; i < count; i++) {
+        status = pthread_mutex_init (&shards[i].mutex, NULL);
+        if (status != 0)
+            err_abort (status, "Init mutex");
+        shards[i].event = eventfd (0, EFD_NONBLOCK);
+        shards[i].timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (shards[i].event < 0 || shards[i].timer < 0)
+            errno_abort ("Create eventfd");
+    }
+}
+
+/*
+ * Return the shard that holds alarms numbered "number". The shard
+ * is picked by the top bits of the hash, since each shard's index
+ * probes by the low bits: taking it from bits the index uses would
+ * leave most of each index's slots unused, and its probe runs long.
+ */
+shard_t *shard_of (int number)
+{
+    unsigned long long h = index_hash (number);
+
+    return &shards[h * shard_count >> 32];
+}
+
+/*
+ * Put the alarm at "pos" in the heap, recording where it is.
+ */
+#define HEAP_SET(shard, pos, alarm) \
+    ((shard)->heap[pos] = (alarm), (alarm)->heap_pos = (pos))
+
+/*
+ * Add an alarm to the heap, sifting it up past any parent that
+ * expires later.
+ */
+void heap_push (shard_t *shard, alarm_t *alarm)
+{
+    alarm_t **new_heap;
+    int child, parent;
+
+    if (shard->count == shard->size) {
+        shard->size = shard->size ? shard->size * 2 : 64;
+        new_heap = (alarm_t**)realloc (
+            shard->heap, shard->size * sizeof (alarm_t*));
+        if (new_heap == NULL)
+            errno_abort ("Grow alarm heap");
+        shard->heap = new_heap;
+    }
+    child = shard->count++;
+    while (child > 0) {
+        parent = (child - 1) / 2;
+        if (shard->heap[parent]->time <= alarm->time)
+            break;
+        HEAP_SET (shard, child, shard->heap[parent]);
+        child = parent;
+    }
+    HEAP_SET (shard, child, alarm);
+    alarm->where = ALARM_HEAP;
+    shard->pushes++;
+}
+
+/*
+ * Move the alarm at "parent" down past any child that expires
+ * earlier.
+ */
+void heap_sift_down (shard_t *shard, int parent)
+{
+    alarm_t *alarm = shard->heap[parent];
+    int child;
+
+    while ((child = parent * 2 + 1) < shard->count) {
+        if (child + 1 < shard->count
+            && shard->heap[child + 1]->time < shard->heap[child]->time)
+            child++;
+        if (alarm->time <= shard->heap[child]->time)
             break;
+        HEAP_SET (shard, parent, shard->heap[child]);
+        parent = child;
+    }
+    HEAP_SET (shard, parent, alarm);
+}
+
+/*
+ * Remove and return the earliest alarm from the heap, or NULL if
+ * the heap is empty. The last element is moved to the root and
+ * sifted down to restore the heap order.
+ */
+alarm_t *heap_pop (shard_t *shard)
+{
+    alarm_t *first;
+
+    if (shard->count == 0)
+        return NULL;
+    first = shard->heap[0];
+    if (--shard->count > 0) {
+        HEAP_SET (shard, 0, shard->heap[shard->count]);
+        heap_sift_down (shard, 0);
+    }
+    first->where = ALARM_NEW;
+    return first;
+}
+
+/*
+ * Take an alarm out of the heap, wherever it is, by moving the
+ * last alarm into its place and sifting that up or down.
+ */
+void heap_remove (shard_t *shard, alarm_t *alarm)
+{
+    alarm_t *last;
+    int pos = alarm->heap_pos, parent;
+
+    last = shard->heap[--shard->count];
+    if (last != alarm) {
+        while (pos > 0) {
+            parent = (pos - 1) / 2;
+            if (shard->heap[parent]->time <= last->time)
+                break;
+            HEAP_SET (shard, pos, shard->heap[parent]);
+            pos = parent;
         }
-        last = &next->link;
-        next = next->link;
+        HEAP_SET (shard, pos, last);
+        heap_sift_down (shard, pos);
+    }
+    alarm->where = ALARM_NEW;
+}
+
+/*
+ * Add a batch of alarms to the heap. A batch that is large next
+ * to the heap is appended unordered, and the whole heap is then
+ * rebuilt bottom-up, which is O(n) rather than O(k log n).
+ */
+void heap_push_batch (shard_t *shard, alarm_t **alarms, int count)
+{
+    alarm_t **new_heap;
+    int i;
+
+    if (count < shard->count) {
+        for (i = 0; i < count; i++)
+            heap_push (shard, alarms[i]);
+        return;
+    }
+    if (shard->count + count > shard->size) {
+        shard->size = (shard->count + count) * 2;
+        new_heap = (alarm_t**)realloc (
+            shard->heap, shard->size * sizeof (alarm_t*));
+        if (new_heap == NULL)
+            errno_abort ("Grow alarm heap");
+        shard->heap = new_heap;
+    }
+    for (i = 0; i < count; i++) {
+        HEAP_SET (shard, shard->count + i, alarms[i]);
+        alarms[i]->where = ALARM_HEAP;
+    }
+    shard->count += count;
+    shard->pushes += count;
+    for (i = shard->count / 2 - 1; i >= 0; i--)
+        heap_sift_down (shard, i);
+}
+
+/*
+ * The timing wheel is the alternative to the heap for very large
+ * numbers of short alarms. It is three wheels of slots -- 60
+ * seconds, 60 minutes and 24 hours -- plus a list of alarms more
+ * than a day away. Each slot is an unsorted list, so inserting or
+ * cancelling an alarm is O(1): it is linked into the slot for its
+ * expiration second, minute or hour, whichever is the finest one
+ * that won't wrap around before the alarm expires.
+ *
+ * wheel_time is the next second the wheel will process; every
+ * alarm due before it has been handed out. When processing reaches the
+ * start of a new minute (hour, day), the matching minute (hour,
+ * day) slot is "cascaded": its alarms are relinked into the finer
+ * wheels. Each alarm is cascaded at most three times, so expiry
+ * is amortized O(1).
+ *
+ * The wheel works in whole seconds of the monotonic clock. A
+ * seconds slot holds the alarms due within that second; when it
+ * comes round, they are moved to the heap so the wheel thread can
+ * fire each at its exact deadline. An alarm inserted for a second
+ * that has already been processed goes straight to the heap.
+ */
+#define WHEEL_SECONDS   60
+#define WHEEL_MINUTES   60
+#define WHEEL_HOURS     24
+
+alarm_t *wheel_seconds[WHEEL_SECONDS];
+alarm_t *wheel_minutes[WHEEL_MINUTES];
+alarm_t *wheel_hours[WHEEL_HOURS];
+alarm_t *wheel_days = NULL;
+time_t wheel_time = 0;         /* Monotonic seconds */
+int wheel_count = 0;
+
+/*
+ * Link an alarm into the slot for its expiration time, which must
+ * not be before wheel_time (cascaded alarms never are; see
+ * wheel_insert for new ones).
+ */
+void wheel_link (alarm_t *alarm)
+{
+    alarm_t **slot;
+    time_t when = alarm->time / NSEC_PER_SEC;
+
+    if (when / 60 == wheel_time / 60)
+        slot = &wheel_seconds[when % WHEEL_SECONDS];
+    else if (when / 60 - wheel_time / 60 < WHEEL_MINUTES)
+        slot = &wheel_minutes[(when / 60) % WHEEL_MINUTES];
+    else if (when / 3600 - wheel_time / 3600 < WHEEL_HOURS)
+        slot = &wheel_hours[(when / 3600) % WHEEL_HOURS];
+    else
+        slot = &wheel_days;
+    alarm->link = *slot;
+    if (alarm->link != NULL)
+        alarm->link->wheel_ref = &alarm->link;
+    alarm->wheel_ref = slot;
+    *slot = alarm;
+}
+
+/*
+ * Add an alarm to the wheel. An empty wheel has nothing to
+ * process, so it is moved straight up to the current time rather
+ * than ticking through the seconds it spent idle. An alarm due in
+ * a second the wheel has already processed is pushed onto the
+ * shard's heap instead, so that it fires at its deadline rather
+ * than with the next second's slot.
+ */
+void wheel_insert (shard_t *shard, alarm_t *alarm)
+{
+    if (wheel_count == 0)
+        wheel_time = monotonic_now () / NSEC_PER_SEC;
+    if (alarm->time / NSEC_PER_SEC < wheel_time) {
+        heap_push (shard, alarm);
+        return;
+    }
+    wheel_link (alarm);
+    alarm->where = ALARM_WHEEL;
+    wheel_count++;
+}
+
+/*
+ * Remove an alarm from whichever slot holds it.
+ */
+void wheel_cancel (alarm_t *alarm)
+{
+    *alarm->wheel_ref = alarm->link;
+    if (alarm->link != NULL)
+        alarm->link->wheel_ref = alarm->wheel_ref;
+    alarm->where = ALARM_NEW;
+    wheel_count--;
+}
+
+/*
+ * Relink every alarm in a slot, moving it down to a finer wheel.
+ */
+void wheel_cascade (alarm_t **slot)
+{
+    alarm_t *alarm, *next;
+
+    alarm = *slot;
+    *slot = NULL;
+    while (alarm != NULL) {
+        next = alarm->link;
+        wheel_link (alarm);
+        alarm = next;
+    }
+}
+
+/*
+ * Process every second from wheel_time up to and including "now",
+ * and return the alarms due within those seconds, chained through
+ * their link fields.
+ */
+alarm_t *wheel_advance (time_t now)
+{
+    alarm_t *fired = NULL, **last = &fired;
+    alarm_t **slot;
+
+    while (wheel_time <= now && wheel_count > 0) {
+        if (wheel_time % 86400 == 0)
+            wheel_cascade (&wheel_days);
+        if (wheel_time % 3600 == 0)
+            wheel_cascade (&wheel_hours[(wheel_time / 3600) % WHEEL_HOURS]);
+        if (wheel_time % 60 == 0)
+            wheel_cascade (&wheel_minutes[(wheel_time / 60) % WHEEL_MINUTES]);
+        slot = &wheel_seconds[wheel_time % WHEEL_SECONDS];
+        if (*slot != NULL) {
+            *last = *slot;
+            while (*last != NULL) {
+                wheel_count--;
+                last = &(*last)->link;
+            }
+            *slot = NULL;
+        }
+        wheel_time++;
     }
+    if (wheel_time <= now)
+        wheel_time = now + 1;
+    return fired;
+}
+
+/*
+ * Return the next second at which the wheel has work to do:
+ * either the next occupied slot of the seconds wheel, or the
+ * start of the next minute, when a cascade may refill it.
+ */
+time_t wheel_next (void)
+{
+    time_t when;
+
+    for (when = wheel_time; when % 60 != 0; when++)
+        if (wheel_seconds[when % WHEEL_SECONDS] != NULL)
+            return when;
+    return when;
+}
+
+/*
+ * Insert alarm entry into the heap or the timing wheel.
+ */
+void alarm_insert (shard_t *shard, alarm_t *alarm)
+{
+#ifdef DEBUG
+    int i;
+#endif
+
     /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller be the shard's
+     * alarm thread, with the shard's mutex locked!
      */
-    if (next == NULL) {
-        *last = alarm;
-        alarm->link = NULL;
+    if (scheduler == SCHED_WHEEL) {
+        wheel_insert (shard, alarm);
+        return;
     }
+    heap_push (shard, alarm);
 #ifdef DEBUG
-    printf ("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf ("%d(%d)[\"%s\"] ", next->time,
-            next->time - time (NULL), next->message);
+    printf ("[heap: ");
+    for (i = 0; i < shard->count; i++)
+        printf ("%lld(%lld)[\"%s\"] ", shard->heap[i]->time,
+            shard->heap[i]->time - monotonic_now (), shard->heap[i]->message);
     printf ("]\n");
 #endif
+}
+
+/*
+ * Insert a batch of alarms at once. Neither this nor alarm_insert
+ * has to tell the alarm thread about an alarm that comes before
+ * the one it is waiting for: the thread looks at heap[0] again
+ * after every drain.
+ *
+ * The caller must be the shard's alarm thread.
+ */
+void alarm_insert_batch (shard_t *shard, alarm_t **alarms, int count)
+{
+    int i;
+
+    if (scheduler == SCHED_WHEEL) {
+        for (i = 0; i < count; i++)
+            wheel_insert (shard, alarms[i]);
+        return;
+    }
+    heap_push_batch (shard, alarms, count);
+}
+
+/*
+ * Take a pending alarm out of its shard, for a cancel or a
+ * replacement, and free it. The alarm the thread is waiting on is
+ * in the heap like any other, so it needs nothing special; an alarm
+ * that is still in a batch being applied is only marked, and freed
+ * by shard_apply.
+ *
+ * The caller must be the shard's alarm thread, and must have
+ * removed the alarm from the shard's index.
+ */
+void alarm_remove (shard_t *shard, alarm_t *alarm)
+{
+    switch (alarm->where) {
+    case ALARM_HEAP:
+        heap_remove (shard, alarm);
+        slab_free (&alarm_slab, alarm);
+        break;
+    case ALARM_WHEEL:
+        wheel_cancel (alarm);
+        slab_free (&alarm_slab, alarm);
+        break;
+    default:
+        alarm->where = ALARM_CANCELLED;
+        break;
+    }
+}
+
+/*
+ * Apply a list of submitted commands, linked through "link" in the
+ * order they were submitted. A start command for a message number
+ * that is already pending replaces that alarm; a cancel command
+ * removes it. The new alarms are then inserted together, so a
+ * number started and then cancelled in the same list is never
+ * scheduled.
+ *
+ * The caller must be the shard's alarm thread.
+ */
+void shard_apply (shard_t *shard, alarm_t *list)
+{
+    alarm_t *alarm, *old, *next;
+    int i, count = 0, added = 0;
+
+    for (alarm = list; alarm != NULL; alarm = next) {
+        next = alarm->link;
+        old = (alarm_t*)index_remove (&shard->index, alarm->message_number);
+        if (old != NULL)
+            alarm_remove (shard, old);
+        if (alarm->request == REQUEST_CANCEL) {
+            slab_free (&alarm_slab, alarm);
+            continue;
+        }
+        alarm->where = ALARM_NEW;
+        index_put (&shard->index, alarm->message_number, alarm);
+        if (count == shard->batch_size) {
+            shard->batch_size = shard->batch_size ? shard->batch_size * 2 : 64;
+            shard->batch = (alarm_t**)realloc (
+                shard->batch, shard->batch_size * sizeof (alarm_t*));
+            if (shard->batch == NULL)
+                errno_abort ("Grow shard batch");
+        }
+        shard->batch[count++] = alarm;
+    }
+    for (i = 0; i < count; i++) {
+        if (shard->batch[i]->where == ALARM_CANCELLED)
+            slab_free (&alarm_slab, shard->batch[i]);
+        else
+            shard->batch[added++] = shard->batch[i];
+    }
+    if (added == 1)
+        alarm_insert (shard, shard->batch[0]);
+    else if (added > 1)
+        alarm_insert_batch (shard, shard->batch, added);
+}
+
+/*
+ * Take everything on the shard's submission stack, and apply it in
+ * the order it was submitted.
+ *
+ * The caller must be the shard's alarm thread.
+ */
+void shard_drain (shard_t *shard)
+{
+    alarm_t *stack, *list = NULL, *next;
+
+    if (__atomic_load_n (&shard->submit, __ATOMIC_RELAXED) == NULL)
+        return;
+    stack = __atomic_exchange_n (&shard->submit, NULL, __ATOMIC_ACQUIRE);
+    for (; stack != NULL; stack = next) {
+        next = stack->link;
+        stack->link = list;
+        list = stack;
+    }
+    shard_apply (shard, list);
+}
+
+/*
+ * Wait, with the shard's mutex unlocked, until either "deadline"
+ * (0 for none) or a producer pushes onto an empty submission stack.
+ * Returns 1 if the deadline passed. The eventfd is read before the
+ * caller drains the stack, so a push made after the drain always
+ * leaves it readable for the next wait.
+ */
+int shard_wait (shard_t *shard, nsec_t deadline)
+{
+    struct pollfd poll_fds[2];
+    struct itimerspec timer;
+    uint64_t value;
+    int status;
+
+    if (deadline != 0 && deadline <= monotonic_now ())
+        return 1;
+    if (deadline != shard->armed) {
+        memset (&timer, 0, sizeof (timer));
+        timer.it_value.tv_sec = deadline / NSEC_PER_SEC;
+        timer.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+        if (timerfd_settime (shard->timer, TFD_TIMER_ABSTIME, &timer, NULL)
+            < 0)
+            errno_abort ("Set timerfd");
+        shard->armed = deadline;
+        shard->syscalls++;
+    }
+    poll_fds[0].fd = shard->event;
+    poll_fds[1].fd = shard->timer;
+    poll_fds[0].events = poll_fds[1].events = POLLIN;
+    status = pthread_mutex_unlock (&shard->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    status = poll (poll_fds, 2, -1);
+    if (status < 0 && errno != EINTR)
+        errno_abort ("Wait for submissions");
+    if (status > 0 && (poll_fds[0].revents & POLLIN)
+        && read (shard->event, &value, sizeof (value)) < 0 && errno != EAGAIN)
+        errno_abort ("Read eventfd");
+    if (status > 0 && (poll_fds[1].revents & POLLIN)) {
+        if (read (shard->timer, &value, sizeof (value)) < 0 && errno != EAGAIN)
+            errno_abort ("Read timerfd");
+        shard->armed = 0;
+    }
+    status = pthread_mutex_lock (&shard->mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    shard->wakeups++;
+    shard->syscalls += 1 + (poll_fds[0].revents & POLLIN ? 1 : 0)
+        + (poll_fds[1].revents & POLLIN ? 1 : 0);
+    return deadline != 0 && monotonic_now () >= deadline;
+}
+
+/*
+ * Submit a batch of parsed commands. They are sorted by shard,
+ * keeping their order within each shard, and each shard's commands
+ * are pushed onto its submission stack with one compare-and-swap,
+ * waking its alarm thread only if the stack was empty. Nothing is
+ * locked, so any number of threads can submit at once. The alarms
+ * array is left in no particular order.
+ */
+void alarm_submit (alarm_t **alarms, int count)
+{
+    alarm_t **sorted = alarms, *old;
+    shard_t *shard;
+    int first[SHARD_MAX + 1];
+    uint64_t one = 1;
+    int s, i;
+
     /*
-     * Wake the alarm thread if it is not busy (that is, if
-     * current_alarm is 0, signifying that it's waiting for
-     * work), or if the new alarm comes before the one on
-     * which the alarm thread is waiting.
+     * A counting sort by shard, which keeps the commands for each
+     * shard in their original order.
      */
-    if (current_alarm == 0 || alarm->time < current_alarm) {
-        current_alarm = alarm->time;
-        status = pthread_cond_signal (&alarm_cond);
-        if (status != 0)
-            err_abort (status, "Signal cond");
+    memset (first, 0, sizeof (first));
+    first[1] = count;
+    if (shard_count > 1) {
+        sorted = (alarm_t**)malloc (count * sizeof (alarm_t*));
+        if (sorted == NULL)
+            errno_abort ("Allocate submit");
+        first[1] = 0;
+        for (i = 0; i < count; i++)
+            first[shard_of (alarms[i]->message_number) - shards + 1]++;
+        for (s = 0; s < shard_count; s++)
+            first[s + 1] += first[s];
+        for (i = 0; i < count; i++)
+            sorted[first[shard_of (alarms[i]->message_number) - shards]++]
+                = alarms[i];
+        for (s = shard_count; s > 0; s--)
+            first[s] = first[s - 1];
+        first[0] = 0;
+    }
+
+    for (s = 0; s < shard_count; s++) {
+        if (first[s] == first[s + 1])
+            continue;
+        shard = &shards[s];
+
+        /*
+         * The stack is newest first, so link the batch from its
+         * last command back to its first.
+         */
+        for (i = first[s + 1] - 1; i > first[s]; i--)
+            sorted[i]->link = sorted[i - 1];
+        old = __atomic_load_n (&shard->submit, __ATOMIC_RELAXED);
+        do
+            sorted[first[s]]->link = old;
+        while (!__atomic_compare_exchange_n (&shard->submit, &old,
+            sorted[first[s + 1] - 1], 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        if (old == NULL && write (shard->event, &one, sizeof (one)) < 0)
+            errno_abort ("Write eventfd");
+    }
+    if (sorted != alarms)
+        free (sorted);
+}
+
+/*
+ * Print a fired alarm and free it. This is the work done for each
+ * alarm that fires, and it is run by the executor pool (pool.h):
+ * with "-e executors", by that many worker threads, so that a burst
+ * of alarms due together is spread across the cores and the alarm
+ * thread goes straight back to waiting for its next deadline; by
+ * default, by the alarm thread itself.
+ */
+void alarm_run (void *arg)
+{
+    alarm_t *alarm = (alarm_t*)arg;
+
+    record_lateness (alarm->time, monotonic_now ());
+    sink_printf ("(%g) %s\n", alarm->seconds, alarm->message);
+    slab_free (&alarm_slab, alarm);
+}
+
+/*
+ * Fire "alarm", and with it every alarm in the shard's heap that
+ * is due by "now": take each out of the shard's index, and hand
+ * them to the executor pool FIRE_BATCH at a time.
+ *
+ * The caller must have locked the shard's mutex.
+ */
+#define FIRE_BATCH      256
+
+void alarm_fire (shard_t *shard, alarm_t *alarm, nsec_t now)
+{
+    void *batch[FIRE_BATCH];
+    int count = 0;
+
+    while (1) {
+        if (index_get (&shard->index, alarm->message_number) == alarm)
+            index_remove (&shard->index, alarm->message_number);
+        batch[count++] = alarm;
+        if (count == FIRE_BATCH) {
+            pool_submit (batch, count);
+            count = 0;
+        }
+        if (shard->count == 0 || shard->heap[0]->time > now)
+            break;
+        alarm = heap_pop (shard);
     }
+    if (count > 0)
+        pool_submit (batch, count);
 }
 
 /*
- * The alarm thread's start routine.
+ * The alarm thread's start routine. There is one for each shard,
+ * passed as the argument.
  */
 void *alarm_thread (void *arg)
 {
+    shard_t *shard = (shard_t*)arg;
     alarm_t *alarm;
-    struct timespec cond_time;
-    time_t now;
-    int status, expired;
+    nsec_t now;
+    int status;
 
     /*
      * Loop forever, processing commands. The alarm thread will
      * be disintegrated when the process exits. Lock the mutex
-     * at the start -- it will be unlocked during condition
-     * waits, so the main thread can insert alarms.
+     * at the start -- it will be unlocked during waits, so the
+     * main thread can stop the thread at end of input.
      */
-    status = pthread_mutex_lock (&alarm_mutex);
+    status = pthread_mutex_lock (&shard->mutex);
     if (status != 0)
         err_abort (status, "Lock mutex");
     while (1) {
         /*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
+         * If the heap is empty, wait until an alarm is
+         * submitted.
          */
-        current_alarm = 0;
-        while (alarm_list == NULL) {
-            status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Wait on cond");
-            }
-        alarm = alarm_list;
-        alarm_list = alarm->link;
-        now = time (NULL);
-        expired = 0;
-        if (alarm->time > now) {
+        shard_drain (shard);
+        if (shard->count == 0) {
+            shard->current_alarm = 0;
+            shard_wait (shard, 0);
+            continue;
+        }
+
+        /*
+         * Look at the earliest alarm, leaving it in the heap, and
+         * wait for it. Whatever ends the wait -- its deadline, or
+         * a submission that may bring an earlier alarm or cancel
+         * this one -- go round again to drain and look at heap[0]
+         * afresh. Once the thread has started waiting for a
+         * deadline, it waits out the slack after it too, even if a
+         * submission wakes it in between.
+         */
+        alarm = shard->heap[0];
+        now = monotonic_now ();
+        if (alarm->time > now || (alarm->time == shard->current_alarm
+            && alarm->time + slack > now)) {
 #ifdef DEBUG
-            printf ("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                alarm->time - time (NULL), alarm->message);
+            printf ("[waiting: %lld(%lld)\"%s\"]\n", alarm->time,
+                alarm->time - now, alarm->message);
 #endif
-            cond_time.tv_sec = alarm->time;
-            cond_time.tv_nsec = 0;
-            current_alarm = alarm->time;
-            while (current_alarm == alarm->time) {
-                status = pthread_cond_timedwait (
-                    &alarm_cond, &alarm_mutex, &cond_time);
-                if (status == ETIMEDOUT) {
-                    expired = 1;
-                    break;
-                }
-                if (status != 0)
-                    err_abort (status, "Cond timedwait");
-            }
-            if (!expired)
-                alarm_insert (alarm);
-        } else
-            expired = 1;
-        if (expired) {
-            printf ("(%d) %s\n", alarm->seconds, alarm->message);
-            free (alarm);
+            shard->current_alarm = alarm->time;
+            shard_wait (shard, alarm->time + slack);
+            continue;
         }
+        shard->current_alarm = 0;
+        alarm_fire (shard, heap_pop (shard), now);
     }
 }
-void *periodic_display_threads(void *arg){
-
-}
-int main (int argc, char *argv[])
+/*
+ * The alarm thread's start routine when the timing wheel is the
+ * scheduler. Each time a second of the wheel comes due, its alarms
+ * are moved onto the heap, and the thread then sleeps until either
+ * the earliest of those or the next second the wheel has work for.
+ */
+void *wheel_thread (void *arg)
 {
-    int status, par, par2;
-    char line[160];
-    alarm_t *alarm;
-    pthread_t thread;
-    char d; //delimiter 
-    char cancel[8];
-    char c[] = "Cancel:";
+    shard_t *shard = (shard_t*)arg;
+    alarm_t *alarm, *next;
+    nsec_t now;
+    int status;
 
-    status = pthread_create (
-        &thread, NULL, alarm_thread, NULL);
+    status = pthread_mutex_lock (&shard->mutex);
     if (status != 0)
-        err_abort (status, "Create alarm thread");
+        err_abort (status, "Lock mutex");
     while (1) {
-        printf ("Alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
-        if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
+        shard->current_alarm = 0;
+        shard_drain (shard);
+        while (wheel_count == 0 && shard->count == 0) {
+            shard_wait (shard, 0);
+            shard_drain (shard);
+        }
+        now = monotonic_now ();
+        for (alarm = wheel_advance (now / NSEC_PER_SEC); alarm != NULL;
+                alarm = next) {
+            next = alarm->link;
+            heap_push (shard, alarm);
+        }
+        if (shard->count > 0 && shard->heap[0]->time <= now)
+            alarm_fire (shard, heap_pop (shard), now);
 
         /*
-         * Parse input line into seconds (%d) and a message
-         * (%128[^\n]), consisting of up to 128 characters
-         * separated from the seconds by whitespace.
+         * Whether the wait times out or an earlier alarm wakes
+         * it, go round again to look at the wheel.
          */
+        shard->current_alarm = 0;
+        if (wheel_count > 0)
+            shard->current_alarm = wheel_next () * NSEC_PER_SEC;
+        if (shard->count > 0 && (shard->current_alarm == 0
+            || shard->heap[0]->time < shard->current_alarm))
+            shard->current_alarm = shard->heap[0]->time;
+        if (shard->current_alarm == 0)
+            continue;
+        shard_wait (shard, shard->current_alarm + slack);
+    }
+}
 
-        par = sscanf (line, "%d %[^( ,] %c %[^)] %c %128[^\n]", &alarm->seconds, alarm->mess, 
-                         &d, &alarm->message_number, &d, alarm->message);
-        //check for 1st valid input type
-        if(par != 6){ 
-        //check for 2nd valid input type                
-            par2 = sscanf (line, "%s %[^( ,] %c %[^)] %c ", cancel, alarm->mess, 
-                         &d, &alarm->message_number, &d);
-        }
-        
-
-        if (!(par ==6 ||(par2 == 5 && strcmp(c,cancel) == 0))) {
-            fprintf (stderr, "Bad command\n");
-            //printf("%d %s(%d) %s\n",alarm->seconds,alarm->mess,alarm->message_number,alarm->message);
-            free (alarm);
-        }
-        //if (sscanf (line, "%d %128[^\n]", 
-        //    &alarm->seconds, alarm->message) < 2) {
-        //    fprintf (stderr, "Bad command\n");
-        //    free (alarm);
-        //} 
-        else {
-            //printf("par= %d par2= %d\n", par, par2);
+void *periodic_display_threads(void *arg){
+
+}
+
+/*
+ * Parse a command line straight into an alarm, in a single pass
+ * and without sscanf. The two commands are
+ *
+ *      <seconds> Message(<number>) <text>
+ *      Cancel: Message(<number>)
+ *
+ * where <seconds> may have a fraction, and must be more than 0 and
+ * less than INT32_MAX, so that it converts to nanoseconds without
+ * overflow. Returns 0 if the line is not a valid command.
+ */
+int parse_command (const char *line, alarm_t *alarm)
+{
+    const char *p;
+
+    p = parse_space (line);
+    if (*p == 'C') {
+        p = parse_literal (p, "Cancel:");
+        p = parse_literal (parse_space (p), "Message(");
+        p = parse_int (p, &alarm->message_number);
+        p = parse_end (parse_literal (p, ")"));
+        if (p == NULL)
+            return 0;
+        alarm->request = REQUEST_CANCEL;
+        alarm->seconds = 0;
+        alarm->message[0] = '\0';
+    } else {
+        p = parse_decimal (p, &alarm->seconds);
+        p = parse_literal (parse_space (p), "Message(");
+        p = parse_int (p, &alarm->message_number);
+        p = parse_space (parse_literal (p, ")"));
+        p = parse_text (p, alarm->message, sizeof (alarm->message));
+        if (p == NULL || alarm->seconds <= 0 || alarm->seconds >= INT32_MAX)
+            return 0;
+        alarm->request = REQUEST_START;
+    }
+    strcpy (alarm->mess, "Message");
+    return 1;
+}
+
+/*
+ * Command sockets. "-u path" listens on a Unix domain socket for
+ * local clients, which send the same commands as standard input,
+ * one per line. One thread per processor runs an epoll loop; the
+ * listening socket is in every thread's epoll set with
+ * EPOLLEXCLUSIVE, so each new connection wakes one thread, which
+ * accepts it and serves it from then on. Any number of connections
+ * can be open at once.
+ *
+ * A client may pipeline commands: each read takes as many complete
+ * lines as have arrived, parses them all, submits them to the
+ * shards with one alarm_submit (up to LISTEN_BATCH at a time), and
+ * sends every reply -- "OK" or "Bad command", one line per command,
+ * in order -- with a single write. If the client isn't reading its
+ * replies, the connection stops being read until they have gone.
+ */
+#define LISTEN_BUFFER   65536           /* Bytes read at a time */
+#define LISTEN_BATCH    1024            /* Commands per submission */
+#define LISTEN_EVENTS   64
+
+typedef struct conn_tag {
+    int                 fd;
+    char                in[LISTEN_BUFFER];
+    int                 in_used;        /* Bytes of a partial line */
+    int                 discard;        /* Skipping a line too long */
+    char                *out;           /* Replies not yet sent */
+    int                 out_used;
+    int                 out_size;
+} conn_t;
+
+int listen_fd = -1;
+
+void listen_reply (conn_t *conn, const char *reply)
+{
+    int length = strlen (reply);
+
+    if (conn->out_used + length > conn->out_size) {
+        conn->out_size = (conn->out_used + length) * 2;
+        conn->out = (char*)realloc (conn->out, conn->out_size);
+        if (conn->out == NULL)
+            errno_abort ("Grow replies");
+    }
+    memcpy (conn->out + conn->out_used, reply, length);
+    conn->out_used += length;
+}
+
+void listen_close (int epoll_fd, conn_t *conn)
+{
+    epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close (conn->fd);
+    free (conn->out);
+    free (conn);
+}
+
+/*
+ * Send as many pending replies as the socket will take, and wait
+ * for it to be writable, instead of readable, while any are left.
+ * Returns 0 if the connection has failed, or can no longer be
+ * watched, so that the caller closes it.
+ */
+int listen_flush (int epoll_fd, conn_t *conn)
+{
+    struct epoll_event event;
+    int count, was_pending = conn->out_used > 0;
+
+    count = conn->out_used > 0 ? send (conn->fd, conn->out,
+        conn->out_used, MSG_NOSIGNAL | MSG_DONTWAIT) : 0;
+    if (count < 0 && errno != EAGAIN && errno != EINTR)
+        return 0;
+    if (count > 0) {
+        memmove (conn->out, conn->out + count, conn->out_used - count);
+        conn->out_used -= count;
+    }
+    if (was_pending || conn->out_used > 0) {
+        event.events = conn->out_used > 0 ? EPOLLOUT : EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Read whatever has arrived on a connection, and run every complete
+ * line in it. Returns 0 if the connection has closed or failed.
+ */
+int listen_read (conn_t *conn)
+{
+    alarm_t *batch[LISTEN_BATCH], *alarm;
+    char *line, *newline, *end;
+    int count = 0, length;
+
+    length = read (conn->fd, conn->in + conn->in_used,
+        sizeof (conn->in) - conn->in_used - 1);
+    if (length < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
+    if (length <= 0)
+        return 0;
+    end = conn->in + conn->in_used + length;
+    *end = '\0';
+    for (line = conn->in; (newline = memchr (line, '\n', end - line)) != NULL;
+            line = newline + 1) {
+        if (conn->discard) {
+            conn->discard = 0;
+            continue;
+        }
+        if (newline == line)
+            continue;
+        alarm = (alarm_t*)slab_alloc (&alarm_slab);
+        if (!parse_command (line, alarm)) {
+            slab_free (&alarm_slab, alarm);
+            listen_reply (conn, "Bad command\n");
+            continue;
+        }
+        alarm->time = monotonic_now ()
+            + (nsec_t)(alarm->seconds * NSEC_PER_SEC);
+        batch[count++] = alarm;
+        listen_reply (conn, "OK\n");
+        if (count == LISTEN_BATCH) {
+            alarm_submit (batch, count);
+            count = 0;
+        }
+    }
+    if (count > 0)
+        alarm_submit (batch, count);
+
+    /*
+     * Keep a partial line for the next read, unless it fills the
+     * whole buffer; then it is too long to be a command.
+     */
+    conn->in_used = end - line;
+    if (conn->in_used == sizeof (conn->in) - 1) {
+        if (!conn->discard)
+            listen_reply (conn, "Bad command\n");
+        conn->discard = 1;
+        conn->in_used = 0;
+    } else
+        memmove (conn->in, line, conn->in_used);
+    return 1;
+}
+
+void *listen_thread (void *arg)
+{
+    struct epoll_event event, events[LISTEN_EVENTS];
+    conn_t *conn;
+    int epoll_fd, fd, count, i;
 
-            status = pthread_mutex_lock (&alarm_mutex);
+    epoll_fd = epoll_create1 (0);
+    if (epoll_fd < 0)
+        errno_abort ("Create epoll");
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0)
+        errno_abort ("Add listening socket");
+    while (1) {
+        count = epoll_wait (epoll_fd, events, LISTEN_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Wait for epoll");
+        }
+        for (i = 0; i < count; i++) {
+            conn = (conn_t*)events[i].data.ptr;
+            if (conn == NULL) {
+                /*
+                 * A connection that can't be set up is dropped;
+                 * the others are served as before.
+                 */
+                fd = accept (listen_fd, NULL, NULL);
+                if (fd < 0)
+                    continue;
+                if (fcntl (fd, F_SETFL, O_NONBLOCK) < 0) {
+                    close (fd);
+                    continue;
+                }
+                conn = (conn_t*)calloc (1, sizeof (conn_t));
+                if (conn == NULL)
+                    errno_abort ("Allocate connection");
+                conn->fd = fd;
+                event.events = EPOLLIN;
+                event.data.ptr = conn;
+                if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+                    close (fd);
+                    free (conn);
+                }
+                continue;
+            }
+            if ((events[i].events & EPOLLIN) && !listen_read (conn)) {
+                listen_close (epoll_fd, conn);
+                continue;
+            }
+            if (!listen_flush (epoll_fd, conn))
+                listen_close (epoll_fd, conn);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Listen on "path", replacing any socket already there, and start
+ * the listening threads.
+ */
+void listen_start (const char *path)
+{
+    struct sockaddr_un address;
+    pthread_t thread;
+    int status, i, threads;
+
+    if (strlen (path) >= sizeof (address.sun_path)) {
+        fprintf (stderr, "Socket path %s is too long\n", path);
+        exit (1);
+    }
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy (address.sun_path, path);
+    unlink (path);
+    listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0
+        || bind (listen_fd, (struct sockaddr*)&address, sizeof (address)) < 0
+        || listen (listen_fd, SOMAXCONN) < 0)
+        errno_abort ("Listen on socket");
+    threads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    for (i = 0; i < threads; i++) {
+        status = pthread_create (&thread, NULL, listen_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create listening thread");
+    }
+}
+
+#ifdef BENCH
+/*
+ * Benchmark driver. Compiling with -DBENCH replaces the
+ * interactive main with this one, which exercises the pending
+ * alarm structures directly, without the alarm thread:
+ *
+ *      cc alarm_cond.c -DBENCH -D_POSIX_PTHREAD_SEMANTICS -lpthread
+ *      a.out [name] [count ...]
+ *
+ * "name" selects one benchmark (all of them run if it is
+ * omitted), and the counts override its default sizes.
+ */
+
+/*
+ * A run of the sorted list baseline stops once it has used this
+ * many seconds, and reports the rate over the part it finished.
+ * A full 1M insert into the list would take hours.
+ */
+#define BENCH_BUDGET 10.0
+
+double bench_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Allocate "count" alarms with expiration times spread randomly
+ * over the next day.
+ */
+alarm_t *bench_alarms (int count)
+{
+    alarm_t *alarms;
+    nsec_t now = monotonic_now ();
+    int i;
+
+    alarms = (alarm_t*)calloc (count, sizeof (alarm_t));
+    if (alarms == NULL)
+        errno_abort ("Allocate benchmark alarms");
+    srand (1);
+    for (i = 0; i < count; i++) {
+        alarms[i].seconds = rand () % 86400;
+        alarms[i].message_number = i;
+        alarms[i].time = now + (nsec_t)alarms[i].seconds * NSEC_PER_SEC;
+    }
+    return alarms;
+}
+
+/*
+ * The sorted list insert that alarm_insert used before the heap,
+ * kept as the baseline.
+ */
+alarm_t *bench_list = NULL;
+
+void bench_list_insert (alarm_t *alarm)
+{
+    alarm_t **last, *next;
+
+    last = &bench_list;
+    next = *last;
+    while (next != NULL) {
+        if (next->time >= alarm->time) {
+            alarm->link = next;
+            *last = alarm;
+            return;
+        }
+        last = &next->link;
+        next = next->link;
+    }
+    *last = alarm;
+    alarm->link = NULL;
+}
+
+/*
+ * Insert "count" alarms into the sorted list and into the heap,
+ * then remove them all again in expiration order, and report the
+ * cost per operation of each.
+ */
+void bench_heap (int count)
+{
+    alarm_t *alarms;
+    double start, insert, pop;
+    int i, done;
+
+    alarms = bench_alarms (count);
+
+    bench_list = NULL;
+    start = bench_now ();
+    for (done = 0; done < count; done++) {
+        bench_list_insert (&alarms[done]);
+        if ((done & 1023) == 0 && bench_now () - start > BENCH_BUDGET)
+            break;
+    }
+    if (done < count)
+        done++;
+    insert = bench_now () - start;
+    start = bench_now ();
+    for (i = 0; i < done; i++)
+        bench_list = bench_list->link;
+    pop = bench_now () - start;
+    printf ("list %8d: insert %10.1f ns/op, pop %6.1f ns/op",
+        count, insert * 1e9 / done, pop * 1e9 / done);
+    if (done < count)
+        printf (" (stopped after %d inserts)", done);
+    printf ("\n");
+
+    shards[0].count = 0;
+    start = bench_now ();
+    for (i = 0; i < count; i++)
+        heap_push (&shards[0], &alarms[i]);
+    insert = bench_now () - start;
+    start = bench_now ();
+    for (i = 0; i < count; i++)
+        heap_pop (&shards[0]);
+    pop = bench_now () - start;
+    printf ("heap %8d: insert %10.1f ns/op, pop %6.1f ns/op\n",
+        count, insert * 1e9 / count, pop * 1e9 / count);
+
+    free (alarms);
+}
+
+/*
+ * Insert "count" alarms spread over a day into the sorted list,
+ * the heap and the timing wheel, then expire them all, and report
+ * the throughput of each. The wheel is driven a second at a time
+ * by a simulated clock, as the wheel thread would drive it. Any
+ * alarm whose second had passed by the time it was inserted went
+ * to the shard's heap instead, so that is emptied too; otherwise
+ * it would be left pointing into the freed array.
+ */
+void bench_wheel (int count)
+{
+    alarm_t *alarms, *fired;
+    double start, insert, expire;
+    time_t now;
+    int i, done;
+
+    alarms = bench_alarms (count);
+
+    bench_list = NULL;
+    start = bench_now ();
+    for (done = 0; done < count; done++) {
+        bench_list_insert (&alarms[done]);
+        if ((done & 1023) == 0 && bench_now () - start > BENCH_BUDGET)
+            break;
+    }
+    if (done < count)
+        done++;
+    insert = bench_now () - start;
+    start = bench_now ();
+    while (bench_list != NULL)
+        bench_list = bench_list->link;
+    expire = bench_now () - start;
+    printf ("list  %8d: insert %12.0f/s, expire %12.0f/s",
+        count, done / insert, done / expire);
+    if (done < count)
+        printf (" (stopped after %d inserts)", done);
+    printf ("\n");
+
+    shards[0].count = 0;
+    start = bench_now ();
+    for (i = 0; i < count; i++)
+        heap_push (&shards[0], &alarms[i]);
+    insert = bench_now () - start;
+    start = bench_now ();
+    for (i = 0; i < count; i++)
+        heap_pop (&shards[0]);
+    expire = bench_now () - start;
+    printf ("heap  %8d: insert %12.0f/s, expire %12.0f/s\n",
+        count, count / insert, count / expire);
+
+    start = bench_now ();
+    for (i = 0; i < count; i++)
+        wheel_insert (&shards[0], &alarms[i]);
+    insert = bench_now () - start;
+    start = bench_now ();
+    for (now = wheel_time, done = 0; wheel_count > 0; now++)
+        for (fired = wheel_advance (now); fired != NULL; fired = fired->link)
+            done++;
+    for (; shards[0].count > 0; done++)
+        heap_pop (&shards[0]);
+    expire = bench_now () - start;
+    if (done != count)
+        fprintf (stderr, "wheel expired %d of %d alarms\n", done, count);
+    printf ("wheel %8d: insert %12.0f/s, expire %12.0f/s\n",
+        count, count / insert, count / expire);
+
+    free (alarms);
+}
+
+/*
+ * Compare the slab with malloc for alarm-sized objects. A live
+ * set of count/10 alarms is churned "count" times, each time
+ * freeing a random one and allocating its replacement. Each
+ * allocator runs in its own child process so that the peak RSS
+ * reported for one is not inflated by the other.
+ */
+void bench_slab_run (int count, int use_slab)
+{
+    alarm_t **live;
+    struct rusage usage;
+    double start, elapsed;
+    int i, slot, size = count / 10 + 1;
+
+    live = (alarm_t**)calloc (size, sizeof (alarm_t*));
+    if (live == NULL)
+        errno_abort ("Allocate live set");
+    srand (1);
+    start = bench_now ();
+    for (i = 0; i < count; i++) {
+        slot = rand () % size;
+        if (live[slot] != NULL) {
+            if (use_slab)
+                slab_free (&alarm_slab, live[slot]);
+            else
+                free (live[slot]);
+        }
+        if (use_slab)
+            live[slot] = (alarm_t*)slab_alloc (&alarm_slab);
+        else
+            live[slot] = (alarm_t*)malloc (sizeof (alarm_t));
+        if (live[slot] == NULL)
+            errno_abort ("Allocate alarm");
+        live[slot]->message_number = i;
+        strcpy (live[slot]->message, "churn");
+    }
+    elapsed = bench_now () - start;
+    getrusage (RUSAGE_SELF, &usage);
+    printf ("%-6s %8d: %12.0f allocs/s, max RSS %7ld KB\n",
+        use_slab ? "slab" : "malloc", count, count / elapsed,
+        usage.ru_maxrss);
+}
+
+void bench_slab (int count)
+{
+    int use_slab, status;
+    pid_t pid;
+
+    for (use_slab = 0; use_slab < 2; use_slab++) {
+        fflush (stdout);
+        pid = fork ();
+        if (pid < 0)
+            errno_abort ("Fork");
+        if (pid == 0) {
+            bench_slab_run (count, use_slab);
+            exit (0);
+        }
+        waitpid (pid, &status, 0);
+    }
+}
+
+/*
+ * Run "count" alarms, due evenly over one second, through the
+ * alarm thread while stdout is a pipe drained by a slow reader,
+ * and report how late they fired. Each output mode runs in its
+ * own child, since the alarm thread never exits: printf directly
+ * from the alarm thread, or the sink with each overflow policy.
+ */
+#define BENCH_READ      64      /* Slow reader: bytes per millisecond */
+
+void *bench_reader (void *arg)
+{
+    struct timespec pause = {0, 1000000};
+    char buffer[BENCH_READ];
+    int fd = *(int*)arg;
+
+    while (read (fd, buffer, sizeof (buffer)) > 0)
+        nanosleep (&pause, NULL);
+    return NULL;
+}
+
+long bench_fired (void)
+{
+    long fired = 0;
+    int i;
+
+    for (i = 0; i < LATENESS_BUCKETS; i++)
+        fired += __atomic_load_n (&lateness[i], __ATOMIC_RELAXED);
+    return fired;
+}
+
+long bench_percentile (long total, double fraction)
+{
+    long seen = 0;
+    int i;
+
+    for (i = 0; i < LATENESS_BUCKETS; i++) {
+        seen += lateness[i];
+        if (seen >= total * fraction)
+            return 1L << i;
+    }
+    return 1L << (LATENESS_BUCKETS - 1);
+}
+
+void bench_sink_run (int count, int mode)
+{
+    static const char *modes[] = {"printf", "block", "drop", "count"};
+    pthread_t thread, reader;
+    alarm_t **alarms;
+    nsec_t now;
+    long fired;
+    int fds[2], out, status, i, waited;
+
+    out = dup (1);
+    if (out < 0 || pipe (fds) != 0 || dup2 (fds[1], 1) < 0)
+        errno_abort ("Redirect stdout");
+    status = pthread_create (&reader, NULL, bench_reader, &fds[0]);
+    if (status != 0)
+        err_abort (status, "Create reader");
+    if (mode > 0)
+        sink_start (1, mode - 1);
+    else if (setvbuf (stdout, NULL, _IOLBF, 0) != 0)
+        errno_abort ("Line-buffer stdout");
+
+    status = pthread_create (&thread, NULL, alarm_thread, &shards[0]);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+
+    alarms = (alarm_t**)malloc (count * sizeof (alarm_t*));
+    if (alarms == NULL)
+        errno_abort ("Allocate alarms");
+    now = monotonic_now () + NSEC_PER_SEC / 100;
+    for (i = 0; i < count; i++) {
+        alarms[i] = (alarm_t*)slab_alloc (&alarm_slab);
+        alarms[i]->request = REQUEST_START;
+        alarms[i]->message_number = i;
+        alarms[i]->seconds = (double)i / count;
+        alarms[i]->time = now + NSEC_PER_SEC / count * i;
+        sprintf (alarms[i]->message, "Alarm %d is due", i);
+    }
+    alarm_submit (alarms, count);
+
+    for (waited = 0; waited < 60000; waited += 10) {
+        usleep (10000);
+        if ((fired = bench_fired ()) == count)
+            break;
+    }
+    dprintf (out, "sink %8d: %-6s fired %8ld, lateness p50 < %8ld us,"
+        " p99 < %8ld us, max < %8ld us, dropped %lu\n",
+        count, modes[mode], fired, bench_percentile (fired, 0.5),
+        bench_percentile (fired, 0.99), bench_percentile (fired, 1.0),
+        sink_dropped);
+}
+
+void bench_sink (int count)
+{
+    int mode, status;
+    pid_t pid;
+
+    for (mode = 0; mode < 4; mode++) {
+        fflush (stdout);
+        pid = fork ();
+        if (pid < 0)
+            errno_abort ("Fork");
+        if (pid == 0) {
+            bench_sink_run (count, mode);
+            _exit (0);
+        }
+        waitpid (pid, &status, 0);
+    }
+}
+
+/*
+ * Submit "count" alarms from as many producer threads as there are
+ * shards, in batches of BENCH_BATCH, to that many shards with an
+ * alarm thread each, and report the insert rate. Every alarm is
+ * due at the same moment, a little after the last is expected to
+ * be in, and the expiry rate is taken from then until the last one
+ * has fired. Each shard count runs in its own child, since the
+ * alarm threads never exit; the alarms are printed through the
+ * sink to /dev/null.
+ */
+#define BENCH_BATCH     1024
+
+typedef struct bench_producer_tag {
+    alarm_t             **alarms;
+    int                 count;
+} bench_producer_t;
+
+void *bench_producer (void *arg)
+{
+    bench_producer_t *producer = (bench_producer_t*)arg;
+    int i, n;
+
+    for (i = 0; i < producer->count; i += n) {
+        n = producer->count - i < BENCH_BATCH ? producer->count - i
+            : BENCH_BATCH;
+        alarm_submit (&producer->alarms[i], n);
+    }
+    return NULL;
+}
+
+void bench_shard_run (int count, int nshards)
+{
+    bench_producer_t producers[SHARD_MAX];
+    pthread_t threads[SHARD_MAX], thread;
+    alarm_t **alarms;
+    double start, insert, expire;
+    nsec_t due;
+    int status, i, per, out;
+
+    out = dup (1);
+    if (out < 0 || dup2 (open ("/dev/null", O_WRONLY), 1) < 0)
+        errno_abort ("Redirect stdout");
+    shard_init (nshards);
+    sink_start (1, SINK_BLOCK);
+    for (i = 0; i < nshards; i++) {
+        status = pthread_create (&thread, NULL, alarm_thread, &shards[i]);
+        if (status != 0)
+            err_abort (status, "Create alarm thread");
+    }
+
+    alarms = (alarm_t**)malloc (count * sizeof (alarm_t*));
+    if (alarms == NULL)
+        errno_abort ("Allocate alarms");
+    for (i = 0; i < count; i++) {
+        alarms[i] = (alarm_t*)slab_alloc (&alarm_slab);
+        alarms[i]->request = REQUEST_START;
+        alarms[i]->message_number = i;
+        sprintf (alarms[i]->message, "Alarm %d is due", i);
+    }
+    due = monotonic_now () + NSEC_PER_SEC + (nsec_t)count * 2000;
+    for (i = 0; i < count; i++) {
+        alarms[i]->seconds = 1;
+        alarms[i]->time = due;
+    }
+
+    per = count / nshards;
+    start = bench_now ();
+    for (i = 0; i < nshards; i++) {
+        producers[i].alarms = &alarms[i * per];
+        producers[i].count = (i == nshards - 1) ? count - i * per : per;
+        status = pthread_create (
+            &threads[i], NULL, bench_producer, &producers[i]);
+        if (status != 0)
+            err_abort (status, "Create producer");
+    }
+    for (i = 0; i < nshards; i++) {
+        status = pthread_join (threads[i], NULL);
+        if (status != 0)
+            err_abort (status, "Join producer");
+    }
+    insert = bench_now () - start;
+    if (monotonic_now () >= due)
+        fprintf (stderr, "shard %d: alarms came due before all were in\n",
+            nshards);
+
+    while (monotonic_now () < due)
+        usleep (1000);
+    start = bench_now ();
+    while (bench_fired () < count)
+        usleep (1000);
+    expire = bench_now () - start;
+    dprintf (out, "shard %8d: %2d shards, insert %12.0f/s,"
+        " expire %12.0f/s\n", count, nshards, count / insert,
+        count / expire);
+}
+
+void bench_shard (int count)
+{
+    int nshards, status;
+    pid_t pid;
+
+    for (nshards = 1; nshards <= 32; nshards *= 2) {
+        fflush (stdout);
+        pid = fork ();
+        if (pid < 0)
+            errno_abort ("Fork");
+        if (pid == 0) {
+            bench_shard_run (count, nshards);
+            _exit (0);
+        }
+        waitpid (pid, &status, 0);
+    }
+}
+
+/*
+ * Submit "count" alarms, one command at a time, from 1 to 8
+ * producer threads to a single shard, and report submissions/sec
+ * and how soon they were all scheduled. Each producer count runs
+ * twice, each time in its own child: through the submission queue,
+ * and with the shard's mutex locked around applying each command
+ * directly, as submission worked before the queue. The alarms are
+ * due in an hour, so the alarm thread only schedules them.
+ */
+void *bench_locked_producer (void *arg)
+{
+    bench_producer_t *producer = (bench_producer_t*)arg;
+    shard_t *shard = &shards[0];
+    int status, i;
+
+    for (i = 0; i < producer->count; i++) {
+        status = pthread_mutex_lock (&shard->mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        producer->alarms[i]->link = NULL;
+        shard_apply (shard, producer->alarms[i]);
+        status = pthread_mutex_unlock (&shard->mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+    }
+    return NULL;
+}
+
+void *bench_queue_producer (void *arg)
+{
+    bench_producer_t *producer = (bench_producer_t*)arg;
+    int i;
+
+    for (i = 0; i < producer->count; i++)
+        alarm_submit (&producer->alarms[i], 1);
+    return NULL;
+}
+
+void bench_submit_run (int count, int nproducers, int locked)
+{
+    bench_producer_t producers[8];
+    pthread_t threads[8], thread;
+    alarm_t **alarms;
+    double start, submit, scheduled;
+    int status, i, per;
+
+    status = pthread_create (&thread, NULL, alarm_thread, &shards[0]);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+    alarms = (alarm_t**)malloc (count * sizeof (alarm_t*));
+    if (alarms == NULL)
+        errno_abort ("Allocate alarms");
+    for (i = 0; i < count; i++) {
+        alarms[i] = (alarm_t*)slab_alloc (&alarm_slab);
+        alarms[i]->request = REQUEST_START;
+        alarms[i]->message_number = i;
+        alarms[i]->seconds = 3600;
+        alarms[i]->time = monotonic_now () + 3600 * NSEC_PER_SEC;
+        sprintf (alarms[i]->message, "Alarm %d is due", i);
+    }
+
+    per = count / nproducers;
+    start = bench_now ();
+    for (i = 0; i < nproducers; i++) {
+        producers[i].alarms = &alarms[i * per];
+        producers[i].count = (i == nproducers - 1) ? count - i * per : per;
+        status = pthread_create (&threads[i], NULL,
+            locked ? bench_locked_producer : bench_queue_producer,
+            &producers[i]);
+        if (status != 0)
+            err_abort (status, "Create producer");
+    }
+    for (i = 0; i < nproducers; i++) {
+        status = pthread_join (threads[i], NULL);
+        if (status != 0)
+            err_abort (status, "Join producer");
+    }
+    submit = bench_now () - start;
+    while (__atomic_load_n (&shards[0].index.count, __ATOMIC_RELAXED) < count)
+        usleep (100);
+    scheduled = bench_now () - start;
+    printf ("submit %8d: %d producers, %-6s %12.0f submissions/s,"
+        " all scheduled in %7.3f s\n", count, nproducers,
+        locked ? "mutex" : "queue", count / submit, scheduled);
+}
+
+void bench_submit (int count)
+{
+    int nproducers, locked, status;
+    pid_t pid;
+
+    for (nproducers = 1; nproducers <= 8; nproducers *= 2)
+        for (locked = 1; locked >= 0; locked--) {
+            fflush (stdout);
+            pid = fork ();
+            if (pid < 0)
+                errno_abort ("Fork");
+            if (pid == 0) {
+                bench_submit_run (count, nproducers, locked);
+                exit (0);
+            }
+            waitpid (pid, &status, 0);
+        }
+}
+
+/*
+ * Run a dense schedule -- "count" alarms due evenly over one second
+ * -- through the alarm thread with a slack window of 0, 100us, 1ms
+ * and 10ms, each in its own child, and report for each fired alarm
+ * the alarm thread's wakeups and the system calls it made to wait,
+ * and the context switches of the whole process (the sink's writer
+ * thread included). The alarms are printed through the sink to
+ * /dev/null.
+ */
+void bench_slack_run (int count, nsec_t window)
+{
+    struct rusage before, after;
+    pthread_t thread;
+    alarm_t **alarms;
+    nsec_t now;
+    long switches;
+    int status, i, out;
+
+    out = dup (1);
+    if (out < 0 || dup2 (open ("/dev/null", O_WRONLY), 1) < 0)
+        errno_abort ("Redirect stdout");
+    sink_start (1, SINK_BLOCK);
+    slack = window;
+    status = pthread_create (&thread, NULL, alarm_thread, &shards[0]);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+
+    alarms = (alarm_t**)malloc (count * sizeof (alarm_t*));
+    if (alarms == NULL)
+        errno_abort ("Allocate alarms");
+    now = monotonic_now () + NSEC_PER_SEC / 10;
+    for (i = 0; i < count; i++) {
+        alarms[i] = (alarm_t*)slab_alloc (&alarm_slab);
+        alarms[i]->request = REQUEST_START;
+        alarms[i]->message_number = i;
+        alarms[i]->seconds = (double)i / count;
+        alarms[i]->time = now + NSEC_PER_SEC / count * i;
+        sprintf (alarms[i]->message, "Alarm %d is due", i);
+    }
+    getrusage (RUSAGE_SELF, &before);
+    alarm_submit (alarms, count);
+    while (bench_fired () < count)
+        usleep (100000);
+    getrusage (RUSAGE_SELF, &after);
+    switches = after.ru_nvcsw - before.ru_nvcsw
+        + after.ru_nivcsw - before.ru_nivcsw;
+    dprintf (out, "slack %8d: %6lld us, per alarm %6.3f wakeups,"
+        " %6.3f syscalls, %6.3f context switches; p99 late < %6ld us\n",
+        count, window / 1000, (double)shards[0].wakeups / count,
+        (double)shards[0].syscalls / count, (double)switches / count,
+        bench_percentile (count, 0.99));
+}
+
+void bench_slack (int count)
+{
+    static nsec_t windows[] = {0, 100000, 1000000, 10000000, -1};
+    int i, status;
+    pid_t pid;
+
+    for (i = 0; windows[i] >= 0; i++) {
+        fflush (stdout);
+        pid = fork ();
+        if (pid < 0)
+            errno_abort ("Fork");
+        if (pid == 0) {
+            bench_slack_run (count, windows[i]);
+            _exit (0);
+        }
+        waitpid (pid, &status, 0);
+    }
+}
+
+/*
+ * The early-wake path: "count" alarms are submitted one at a time,
+ * each due a microsecond before the one submitted ahead of it, so
+ * that every one of them ends the alarm thread's wait for the
+ * alarm it had been waiting on. Each is waited for until it is
+ * scheduled, and the cost per insert is reported along with the
+ * alarm thread's wakeups and heap pushes per alarm. Then the
+ * earliest half are cancelled, earliest first, so that every
+ * cancel takes out the alarm the thread is waiting on.
+ *
+ * This doubles as a check: every alarm must still be in the heap
+ * after the inserts (the thread never holds one outside it), each
+ * alarm must have been pushed exactly once, and after the cancels
+ * the thread must be waiting for the earliest alarm left. A run
+ * that fails any of these says so and exits with status 1. The
+ * alarms are due in an hour, so none fire.
+ */
+int bench_early_check (shard_t *shard, int pending, int pushed)
+{
+    int status, ok;
+
+    status = pthread_mutex_lock (&shard->mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    ok = shard->count == pending && shard->pushes == pushed
+        && shard->current_alarm == shard->heap[0]->time;
+    status = pthread_mutex_unlock (&shard->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    return ok;
+}
+
+void bench_early_run (int count)
+{
+    pthread_t thread;
+    alarm_t *alarm;
+    nsec_t due;
+    double start, insert, cancel;
+    long wakeups, pushes;
+    int status, i, ok;
+
+    /*
+     * The heap and wheel benches push onto shards[0] in the parent,
+     * so count from zero here.
+     */
+    shards[0].wakeups = shards[0].pushes = 0;
+    status = pthread_create (&thread, NULL, alarm_thread, &shards[0]);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+    due = monotonic_now () + 3600 * NSEC_PER_SEC;
+
+    start = bench_now ();
+    for (i = 0; i < count; i++) {
+        alarm = (alarm_t*)slab_alloc (&alarm_slab);
+        alarm->request = REQUEST_START;
+        alarm->message_number = i;
+        alarm->seconds = 3600;
+        alarm->time = due - (nsec_t)i * 1000;
+        sprintf (alarm->message, "Alarm %d is due", i);
+        alarm_submit (&alarm, 1);
+        while (__atomic_load_n (&shards[0].index.count, __ATOMIC_RELAXED)
+            < i + 1)
+            sched_yield ();
+    }
+    insert = bench_now () - start;
+    ok = bench_early_check (&shards[0], count, count);
+    wakeups = shards[0].wakeups;
+    pushes = shards[0].pushes;
+
+    start = bench_now ();
+    for (i = count - 1; i >= count / 2; i--) {
+        alarm = (alarm_t*)slab_alloc (&alarm_slab);
+        alarm->request = REQUEST_CANCEL;
+        alarm->message_number = i;
+        alarm_submit (&alarm, 1);
+        while (__atomic_load_n (&shards[0].index.count, __ATOMIC_RELAXED)
+            > i)
+            sched_yield ();
+    }
+    cancel = bench_now () - start;
+    ok = ok && bench_early_check (&shards[0], count / 2, count);
+
+    printf ("early %8d: %8.0f ns/insert, %5.3f wakeups, %5.3f pushes"
+        " per alarm; %8.0f ns/cancel: %s\n", count, insert * 1e9 / count,
+        (double)wakeups / count, (double)pushes / count,
+        cancel * 1e9 / (count - count / 2), ok ? "ok" : "FAILED");
+    exit (ok ? 0 : 1);
+}
+
+void bench_early (int count)
+{
+    int status;
+    pid_t pid;
+
+    fflush (stdout);
+    pid = fork ();
+    if (pid < 0)
+        errno_abort ("Fork");
+    if (pid == 0)
+        bench_early_run (count);
+    waitpid (pid, &status, 0);
+}
+
+/*
+ * A load generator for the command socket. A server child listens
+ * on BENCH_SOCKET, and "count" commands are sent to it over 1, 8
+ * and 32 connections, each with one client thread that writes
+ * BENCH_WINDOW commands at a time in a single write and then reads
+ * their replies. Every command of a window is counted as taking the
+ * time from its write to the last reply of the window. Reports
+ * commands/sec and the 50th and 99th percentile latency. The
+ * alarms are due in an hour, so none fire.
+ */
+#define BENCH_SOCKET    "/tmp/alarm_bench.sock"
+#define BENCH_WINDOW    64
+
+typedef struct bench_client_tag {
+    int                 first;          /* First message number */
+    int                 count;
+    nsec_t              *latency;       /* One per command */
+} bench_client_t;
+
+void *bench_client (void *arg)
+{
+    bench_client_t *client = (bench_client_t*)arg;
+    struct sockaddr_un address;
+    char buffer[BENCH_WINDOW * 48], *p;
+    nsec_t start, elapsed;
+    int fd, sent, n, i, length, replies;
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy (address.sun_path, BENCH_SOCKET);
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr*)&address,
+        sizeof (address)) < 0)
+        errno_abort ("Connect to socket");
+    for (sent = 0; sent < client->count; sent += n) {
+        n = client->count - sent < BENCH_WINDOW ? client->count - sent
+            : BENCH_WINDOW;
+        for (p = buffer, i = 0; i < n; i++)
+            p += sprintf (p, "3600 Message(%d) Load %d\n",
+                client->first + sent + i, i);
+        start = monotonic_now ();
+        if (write (fd, buffer, p - buffer) != p - buffer)
+            errno_abort ("Write commands");
+        for (replies = 0; replies < n; ) {
+            length = read (fd, buffer, sizeof (buffer));
+            if (length <= 0)
+                errno_abort ("Read replies");
+            for (i = 0; i < length; i++)
+                replies += (buffer[i] == '\n');
+        }
+        elapsed = monotonic_now () - start;
+        for (i = 0; i < n; i++)
+            client->latency[sent + i] = elapsed;
+    }
+    close (fd);
+    return NULL;
+}
+
+int bench_compare_nsec (const void *a, const void *b)
+{
+    nsec_t x = *(const nsec_t*)a, y = *(const nsec_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void bench_socket (int count)
+{
+    static int connections[] = {1, 8, 32, 0};
+    bench_client_t clients[32];
+    pthread_t threads[32], thread;
+    nsec_t *latency;
+    double start, elapsed;
+    int c, i, per, status, first = 0;
+    pid_t pid;
+
+    fflush (stdout);
+    pid = fork ();
+    if (pid < 0)
+        errno_abort ("Fork");
+    if (pid == 0) {
+        status = pthread_create (&thread, NULL, alarm_thread, &shards[0]);
+        if (status != 0)
+            err_abort (status, "Create alarm thread");
+        listen_start (BENCH_SOCKET);
+        while (1)
+            pause ();
+    }
+    while (access (BENCH_SOCKET, F_OK) != 0)
+        usleep (1000);
+    usleep (10000);
+
+    latency = (nsec_t*)malloc (count * sizeof (nsec_t));
+    if (latency == NULL)
+        errno_abort ("Allocate latencies");
+    for (c = 0; connections[c] != 0; c++) {
+        per = count / connections[c];
+        start = bench_now ();
+        for (i = 0; i < connections[c]; i++) {
+            clients[i].first = first + i * per;
+            clients[i].count = per;
+            clients[i].latency = &latency[i * per];
+            status = pthread_create (
+                &threads[i], NULL, bench_client, &clients[i]);
+            if (status != 0)
+                err_abort (status, "Create client");
+        }
+        for (i = 0; i < connections[c]; i++) {
+            status = pthread_join (threads[i], NULL);
             if (status != 0)
-                err_abort (status, "Lock mutex");
-            alarm->time = time (NULL) + alarm->seconds;
+                err_abort (status, "Join client");
+        }
+        elapsed = bench_now () - start;
+        first += per * connections[c];
+        qsort (latency, per * connections[c], sizeof (nsec_t),
+            bench_compare_nsec);
+        printf ("socket %8d: %2d connections, %10.0f commands/s,"
+            " latency p50 %8.1f us, p99 %8.1f us\n", count,
+            connections[c], per * connections[c] / elapsed,
+            latency[per * connections[c] / 2] / 1e3,
+            latency[per * connections[c] * 99 / 100] / 1e3);
+    }
+    kill (pid, SIGKILL);
+    waitpid (pid, &status, 0);
+    unlink (BENCH_SOCKET);
+    free (latency);
+}
+
+/*
+ * Fire a burst of "count" alarms, all due at the same moment, from
+ * a single shard, with the work inline in the alarm thread and
+ * with 1 to 8 executors. Report how long the alarm thread was busy
+ * with the burst, until its heap was empty and it could wait for
+ * its next deadline, and how long the burst took to drain. Each
+ * alarm's work is BENCH_WORK nanoseconds of spinning, standing in
+ * for a callback that does more than print, before it is printed
+ * through the sink to /dev/null.
+ */
+#define BENCH_WORK      5000
+
+void bench_burst_work (void *arg)
+{
+    nsec_t start = monotonic_now ();
+
+    while (monotonic_now () - start < BENCH_WORK)
+        ;
+    alarm_run (arg);
+}
+
+void bench_burst_run (int count, int executors)
+{
+    pthread_t thread;
+    alarm_t **alarms;
+    nsec_t due, busy;
+    double drain;
+    int status, i, out;
+
+    out = dup (1);
+    if (out < 0 || dup2 (open ("/dev/null", O_WRONLY), 1) < 0)
+        errno_abort ("Redirect stdout");
+    sink_start (1, SINK_BLOCK);
+    pool_start (executors, bench_burst_work);
+    status = pthread_create (&thread, NULL, alarm_thread, &shards[0]);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+
+    alarms = (alarm_t**)malloc (count * sizeof (alarm_t*));
+    if (alarms == NULL)
+        errno_abort ("Allocate alarms");
+    for (i = 0; i < count; i++) {
+        alarms[i] = (alarm_t*)slab_alloc (&alarm_slab);
+        alarms[i]->request = REQUEST_START;
+        alarms[i]->message_number = i;
+        alarms[i]->seconds = 1;
+        sprintf (alarms[i]->message, "Alarm %d is due", i);
+    }
+    due = monotonic_now () + NSEC_PER_SEC / 2;
+    for (i = 0; i < count; i++)
+        alarms[i]->time = due;
+    alarm_submit (alarms, count);
+
+    while (monotonic_now () < due)
+        usleep (1000);
+    while (__atomic_load_n (&shards[0].count, __ATOMIC_RELAXED) > 0)
+        usleep (100);
+    busy = monotonic_now () - due;
+    while (bench_fired () < count)
+        usleep (1000);
+    drain = (double)(monotonic_now () - due) / NSEC_PER_SEC;
+    dprintf (out, "burst %8d: %d executors, alarm thread busy %8.3f ms,"
+        " drain %7.3f s (%10.0f/s)\n", count, executors, busy / 1e6,
+        drain, count / drain);
+}
+
+void bench_burst (int count)
+{
+    int executors, status;
+    pid_t pid;
+
+    for (executors = 0; executors <= 8;
+        executors = executors ? executors * 2 : 1) {
+        fflush (stdout);
+        pid = fork ();
+        if (pid < 0)
+            errno_abort ("Fork");
+        if (pid == 0) {
+            bench_burst_run (count, executors);
+            _exit (0);
+        }
+        waitpid (pid, &status, 0);
+    }
+}
+
+/*
+ * The sscanf parser that parse_command replaced, kept as the
+ * baseline.
+ */
+int bench_sscanf_command (char *line, alarm_t *alarm)
+{
+    int par, par2;
+    char d;
+    char cancel[8];
+    char number[16];
+
+    par = sscanf (line, "%lf %7[^( ,] %c %15[^)] %c %128[^\n]",
+        &alarm->seconds, alarm->mess, &d, number, &d, alarm->message);
+    if (par == 6 && alarm->seconds >= 0) {
+        alarm->message_number = atoi (number);
+        return 1;
+    }
+    par2 = sscanf (line, "%7s %7[^( ,] %c %15[^)] %c ", cancel, alarm->mess,
+        &d, number, &d);
+    alarm->message_number = atoi (number);
+    return par2 == 5 && strcmp ("Cancel:", cancel) == 0;
+}
+
+/*
+ * Parse "count" command lines -- nine alarms to every cancel --
+ * with the old sscanf parser and with parse_command, and report
+ * lines/sec for each.
+ */
+void bench_parse (int count)
+{
+    char (*lines)[160];
+    alarm_t alarm;
+    double start, old, new;
+    int i, valid;
+
+    lines = (char (*)[160])malloc (count * sizeof (*lines));
+    if (lines == NULL)
+        errno_abort ("Allocate lines");
+    for (i = 0; i < count; i++) {
+        if (i % 10 == 9)
+            sprintf (lines[i], "Cancel: Message(%d)\n", i);
+        else
+            sprintf (lines[i], "%d Message(%d) Alarm number %d is due\n",
+                i % 3600 + 1, i, i);
+    }
+    valid = 0;
+    start = bench_now ();
+    for (i = 0; i < count; i++)
+        valid += bench_sscanf_command (lines[i], &alarm);
+    old = bench_now () - start;
+    if (valid != count)
+        fprintf (stderr, "sscanf parsed %d of %d lines\n", valid, count);
+    valid = 0;
+    start = bench_now ();
+    for (i = 0; i < count; i++)
+        valid += parse_command (lines[i], &alarm);
+    new = bench_now () - start;
+    if (valid != count)
+        fprintf (stderr, "parse_command parsed %d of %d lines\n", valid, count);
+    printf ("parse %8d: sscanf %12.0f lines/s, parse_command %12.0f lines/s\n",
+        count, count / old, count / new);
+    free (lines);
+}
+
+struct bench_tag {
+    const char  *name;
+    void        (*run) (int count);
+    int         sizes[4];       /* Default counts, 0 terminated */
+} benches[] = {
+    {"heap", bench_heap, {1000, 100000, 1000000, 0}},
+    {"wheel", bench_wheel, {1000, 100000, 1000000, 0}},
+    {"slab", bench_slab, {100000, 1000000, 10000000, 0}},
+    {"parse", bench_parse, {1000000, 0}},
+    {"sink", bench_sink, {5000, 20000, 0}},
+    {"shard", bench_shard, {100000, 1000000, 0}},
+    {"burst", bench_burst, {100000, 0}},
+    {"submit", bench_submit, {1000000, 0}},
+    {"socket", bench_socket, {200000, 0}},
+    {"slack", bench_slack, {1000, 10000, 100000, 0}},
+    {"early", bench_early, {1000, 100000, 0}},
+    {NULL}
+};
+
+int main (int argc, char *argv[])
+{
+    struct bench_tag *bench;
+    int i;
+
+    shard_init (1);
+    pool_start (0, alarm_run);
+    for (bench = benches; bench->name != NULL; bench++) {
+        if (argc > 1 && strcmp (argv[1], bench->name) != 0)
+            continue;
+        if (argc > 2) {
+            for (i = 2; i < argc; i++)
+                bench->run (atoi (argv[i]));
+        } else {
+            for (i = 0; bench->sizes[i] != 0; i++)
+                bench->run (bench->sizes[i]);
+        }
+    }
+    return 0;
+}
+#else
+/*
+ * Bulk loading. "--load FILE" maps a file of alarm commands into
+ * memory and splits it into one chunk per processor, each ending
+ * at a newline. A thread per chunk parses its lines straight out
+ * of the mapping into an array of its own, and the arrays are
+ * then submitted together with alarm_submit. No alarm thread has
+ * been started yet, so the loader drains each shard itself, which
+ * inserts the shard's alarms with one alarm_insert_batch, building
+ * its heap bottom-up in O(n). The time reported includes that.
+ */
+typedef struct load_chunk_tag {
+    const char          *start;         /* First byte of the chunk */
+    const char          *end;           /* Just past its last byte */
+    nsec_t              now;            /* Alarms are due from here */
+    alarm_t             **alarms;
+    int                 count;
+    int                 size;
+    long                lines;
+    long                bad;            /* Lines that didn't parse */
+} load_chunk_t;
+
+void *load_thread (void *arg)
+{
+    load_chunk_t *chunk = (load_chunk_t*)arg;
+    const char *p, *newline;
+    char last[160];
+    alarm_t *alarm;
+    size_t length;
+
+    chunk->size = (chunk->end - chunk->start) / 32 + 1;
+    chunk->alarms = (alarm_t**)malloc (chunk->size * sizeof (alarm_t*));
+    if (chunk->alarms == NULL)
+        errno_abort ("Allocate load chunk");
+    for (p = chunk->start; p < chunk->end; p = newline + 1) {
+        newline = memchr (p, '\n', chunk->end - p);
+        if (newline == NULL) {
             /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
+             * The file's last line has no newline, and may end
+             * right at the end of the mapping, so parse a copy.
              */
-            alarm_insert (alarm);
-            status = pthread_mutex_unlock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
+            newline = chunk->end;
+            length = newline - p;
+            if (length >= sizeof (last))
+                length = sizeof (last) - 1;
+            memcpy (last, p, length);
+            last[length] = '\0';
+        }
+        chunk->lines++;
+        if (newline == p)
+            continue;
+        alarm = (alarm_t*)slab_alloc (&alarm_slab);
+        if (!parse_command (newline == chunk->end ? last : p, alarm)) {
+            chunk->bad++;
+            slab_free (&alarm_slab, alarm);
+            continue;
+        }
+        alarm->time = chunk->now + (nsec_t)(alarm->seconds * NSEC_PER_SEC);
+        if (chunk->count == chunk->size) {
+            chunk->size *= 2;
+            chunk->alarms = (alarm_t**)realloc (
+                chunk->alarms, chunk->size * sizeof (alarm_t*));
+            if (chunk->alarms == NULL)
+                errno_abort ("Grow load chunk");
+        }
+        chunk->alarms[chunk->count++] = alarm;
+    }
+    return NULL;
+}
+
+/*
+ * Load every alarm command in "path" and insert the alarms.
+ */
+void alarm_load (const char *path)
+{
+    load_chunk_t *chunks;
+    pthread_t *threads;
+    alarm_t **alarms;
+    struct stat st;
+    const char *map, *p;
+    nsec_t start, elapsed;
+    long lines = 0, bad = 0;
+    int fd, status, i, nchunks, count = 0;
+
+    start = monotonic_now ();
+    fd = open (path, O_RDONLY);
+    if (fd < 0 || fstat (fd, &st) < 0)
+        errno_abort ("Open load file");
+    if (st.st_size == 0) {
+        close (fd);
+        return;
+    }
+    map = (const char*)mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        errno_abort ("Map load file");
+    close (fd);
+
+    nchunks = sysconf (_SC_NPROCESSORS_ONLN);
+    if (nchunks < 1)
+        nchunks = 1;
+    chunks = (load_chunk_t*)calloc (nchunks, sizeof (load_chunk_t));
+    threads = (pthread_t*)malloc (nchunks * sizeof (pthread_t));
+    if (chunks == NULL || threads == NULL)
+        errno_abort ("Allocate load chunks");
+    p = map;
+    for (i = 0; i < nchunks; i++) {
+        chunks[i].start = p;
+        if (i == nchunks - 1)
+            p = map + st.st_size;
+        else {
+            p = map + st.st_size / nchunks * (i + 1);
+            if (p < chunks[i].start)
+                p = chunks[i].start;
+            p = memchr (p, '\n', map + st.st_size - p);
+            p = (p == NULL) ? map + st.st_size : p + 1;
         }
+        chunks[i].end = p;
+        chunks[i].now = start;
+        status = pthread_create (&threads[i], NULL, load_thread, &chunks[i]);
+        if (status != 0)
+            err_abort (status, "Create load thread");
     }
+    for (i = 0; i < nchunks; i++) {
+        status = pthread_join (threads[i], NULL);
+        if (status != 0)
+            err_abort (status, "Join load thread");
+        count += chunks[i].count;
+        lines += chunks[i].lines;
+        bad += chunks[i].bad;
+    }
+
+    alarms = (alarm_t**)malloc ((count + 1) * sizeof (alarm_t*));
+    if (alarms == NULL)
+        errno_abort ("Allocate loaded alarms");
+    count = 0;
+    for (i = 0; i < nchunks; i++) {
+        memcpy (&alarms[count], chunks[i].alarms,
+            chunks[i].count * sizeof (alarm_t*));
+        count += chunks[i].count;
+        free (chunks[i].alarms);
+    }
+    if (count > 0) {
+        alarm_submit (alarms, count);
+        for (i = 0; i < shard_count; i++)
+            shard_drain (&shards[i]);
+    }
+    munmap ((void*)map, st.st_size);
+    free (alarms);
+    free (chunks);
+    free (threads);
+
+    elapsed = monotonic_now () - start;
+    printf ("Loaded %d alarms from %ld lines in %.3f seconds", count, lines,
+        (double)elapsed / NSEC_PER_SEC);
+    if (elapsed > 0)
+        printf (" (%.0f lines/sec)", lines * (double)NSEC_PER_SEC / elapsed);
+    printf ("\n");
+    if (bad > 0)
+        fprintf (stderr, "%ld bad commands in %s\n", bad, path);
 }
+
+int main (int argc, char *argv[])
+{
+    int status;
+    char line[160];
+    alarm_t *alarm, **batch;
+    pthread_t thread;
+    int arg, count, eof = 0, i;
+    int nshards = 1, executors = 0, window;
+    int batch_size = 1;
+    long lines = 0;
+    nsec_t start = 0, elapsed;
+    const char *load = NULL, *socket_path = NULL;
+    int output = SINK_BLOCK;
+
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp (argv[arg], "-s") == 0 && arg + 1 < argc) {
+            arg++;
+            if (strcmp (argv[arg], "heap") == 0)
+                scheduler = SCHED_HEAP;
+            else if (strcmp (argv[arg], "wheel") == 0)
+                scheduler = SCHED_WHEEL;
+            else {
+                fprintf (stderr, "Unknown scheduler %s\n", argv[arg]);
+                exit (1);
+            }
+        } else if (strcmp (argv[arg], "-b") == 0 && arg + 1 < argc
+            && (batch_size = atoi (argv[arg + 1])) > 0) {
+            arg++;
+        } else if (strcmp (argv[arg], "-n") == 0 && arg + 1 < argc
+            && (nshards = atoi (argv[arg + 1])) > 0 && nshards <= SHARD_MAX) {
+            arg++;
+        } else if (strcmp (argv[arg], "-e") == 0 && arg + 1 < argc
+            && (executors = atoi (argv[arg + 1])) >= 0
+            && executors <= POOL_MAX) {
+            arg++;
+        } else if (strcmp (argv[arg], "-w") == 0 && arg + 1 < argc
+            && (window = atoi (argv[arg + 1])) >= 0) {
+            slack = (nsec_t)window * 1000;
+            arg++;
+        } else if (strcmp (argv[arg], "--load") == 0 && arg + 1 < argc) {
+            load = argv[++arg];
+        } else if (strcmp (argv[arg], "-u") == 0 && arg + 1 < argc) {
+            socket_path = argv[++arg];
+        } else if (strcmp (argv[arg], "-O") == 0 && arg + 1 < argc) {
+            arg++;
+            if (strcmp (argv[arg], "block") == 0)
+                output = SINK_BLOCK;
+            else if (strcmp (argv[arg], "drop") == 0)
+                output = SINK_DROP;
+            else if (strcmp (argv[arg], "count") == 0)
+                output = SINK_COUNT;
+            else {
+                fprintf (stderr, "Unknown output policy %s\n", argv[arg]);
+                exit (1);
+            }
+        } else {
+            fprintf (stderr, "Usage: %s [-s heap|wheel] [-n shards]"
+                " [-e executors] [-w usec] [-b lines] [--load file]"
+                " [-u socket] [-O block|drop|count]\n", argv[0]);
+            exit (1);
+        }
+    }
+    if (scheduler == SCHED_WHEEL && nshards > 1) {
+        fprintf (stderr, "The timing wheel runs with one shard\n");
+        exit (1);
+    }
+    batch = (alarm_t**)malloc (batch_size * sizeof (alarm_t*));
+    if (batch == NULL)
+        errno_abort ("Allocate batch");
+
+    shard_init (nshards);
+    if (load != NULL)
+        alarm_load (load);
+
+    /*
+     * Alarms are printed through the output sink (sink.h), so
+     * that a slow stdout never holds up the alarm thread.
+     */
+    fflush (stdout);
+    sink_start (1, output);
+    pool_start (executors, alarm_run);
+
+    for (i = 0; i < shard_count; i++) {
+        status = pthread_create (&thread, NULL,
+            scheduler == SCHED_WHEEL ? wheel_thread : alarm_thread,
+            &shards[i]);
+        if (status != 0)
+            err_abort (status, "Create alarm thread");
+    }
+    if (socket_path != NULL)
+        listen_start (socket_path);
+
+    /*
+     * With "-b lines", commands are read and parsed a block of
+     * up to that many lines at a time, and then submitted
+     * together, with at most one wakeup for each shard's alarm
+     * thread. Without it, each line is a block of one, and is
+     * prompted for.
+     */
+    while (!eof) {
+        count = 0;
+        while (count < batch_size) {
+            if (batch_size == 1)
+                printf ("Alarm> ");
+            if (fgets (line, sizeof (line), stdin) == NULL) {
+                eof = 1;
+                break;
+            }
+            if (lines++ == 0)
+                start = monotonic_now ();
+            if (strlen (line) <= 1) continue;
+            alarm = (alarm_t*)slab_alloc (&alarm_slab);
+            if (!parse_command (line, alarm)) {
+                fprintf (stderr, "Bad command\n");
+                slab_free (&alarm_slab, alarm);
+                continue;
+            }
+            alarm->time = monotonic_now ()
+                + (nsec_t)(alarm->seconds * NSEC_PER_SEC);
+            batch[count++] = alarm;
+        }
+        if (count == 0)
+            continue;
+        /*
+         * Insert the new alarms into their shards' heaps of
+         * pending alarms, ordered by expiration time.
+         */
+        alarm_submit (batch, count);
+    }
+
+    /*
+     * While clients may still connect, the end of standard input
+     * doesn't end the program, so it can run with </dev/null.
+     */
+    if (socket_path != NULL)
+        while (1)
+            pause ();
+
+    for (i = 0; i < shard_count; i++) {
+        status = pthread_mutex_lock (&shards[i].mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+    }
+    elapsed = monotonic_now () - start;
+    pool_wait ();
+    sink_flush ();
+    if (lines > 0 && elapsed > 0)
+        printf ("Read %ld lines in %.3f seconds (%.0f lines/sec)\n", lines,
+            (double)elapsed / NSEC_PER_SEC,
+            lines * (double)NSEC_PER_SEC / elapsed);
+    print_lateness ();
+    exit (0);
+}
+#endif
@@ -0,0 +1,139 @@
+#ifndef __alarm_index_h
+#define __alarm_index_h
+
+#include "errors.h"
+
+/*
+ * An open-addressing hash table from an alarm's message number to
+ * the alarm itself, so that finding, replacing or cancelling an
+ * alarm by number does not walk the alarm list. The table uses
+ * linear probing and is doubled whenever it becomes half full.
+ * Removal shifts later entries of the probe run back into the
+ * hole, so no "deleted" markers are left behind to lengthen
+ * future probes.
+ *
+ * The index holds no lock of its own; the caller protects it with
+ * the same lock that protects the alarm list it mirrors.
+ */
+typedef struct index_entry_tag {
+    int                 key;
+    void                *value;         /* NULL if the slot is free */
+} index_entry_t;
+
+typedef struct index_tag {
+    index_entry_t       *entries;
+    int                 size;           /* Always a power of 2 */
+    int                 count;
+} index_t;
+
+#define INDEX_INITIAL   64
+
+/*
+ * Scramble the key so that runs of consecutive message numbers
+ * spread over the table instead of filling one probe run.
+ */
+static unsigned int index_hash (int key)
+{
+    unsigned int h = (unsigned int)key;
+
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * Return the slot holding "key", or the free slot where it would
+ * go.
+ */
+static index_entry_t *index_slot (index_t *index, int key)
+{
+    unsigned int mask = index->size - 1;
+    unsigned int i = index_hash (key) & mask;
+
+    while (index->entries[i].value != NULL
+        && index->entries[i].key != key)
+        i = (i + 1) & mask;
+    return &index->entries[i];
+}
+
+static void index_put (index_t *index, int key, void *value);
+
+static void index_grow (index_t *index)
+{
+    index_entry_t *old = index->entries;
+    int old_size = index->size, i;
+
+    index->size = old_size ? old_size * 2 : INDEX_INITIAL;
+    index->entries = (index_entry_t*)calloc (
+        index->size, sizeof (index_entry_t));
+    if (index->entries == NULL)
+        errno_abort ("Allocate index");
+    index->count = 0;
+    for (i = 0; i < old_size; i++)
+        if (old[i].value != NULL)
+            index_put (index, old[i].key, old[i].value);
+    free (old);
+}
+
+/*
+ * Add or replace the entry for "key".
+ */
+static void index_put (index_t *index, int key, void *value)
+{
+    index_entry_t *entry;
+
+    if ((index->count + 1) * 2 > index->size)
+        index_grow (index);
+    entry = index_slot (index, key);
+    if (entry->value == NULL)
+        index->count++;
+    entry->key = key;
+    entry->value = value;
+}
+
+/*
+ * Return the value stored for "key", or NULL.
+ */
+static void *index_get (index_t *index, int key)
+{
+    if (index->count == 0)
+        return NULL;
+    return index_slot (index, key)->value;
+}
+
+/*
+ * Remove the entry for "key", returning its value (or NULL if
+ * there was none). Each later entry in the probe run is moved back
+ * into the hole unless its own home slot lies cyclically between
+ * the hole and its current position.
+ */
+static void *index_remove (index_t *index, int key)
+{
+    unsigned int mask = index->size - 1;
+    unsigned int hole, i, home;
+    void *value;
+
+    if (index->count == 0)
+        return NULL;
+    hole = index_slot (index, key) - index->entries;
+    value = index->entries[hole].value;
+    if (value == NULL)
+        return NULL;
+    index->count--;
+    i = hole;
+    while (1) {
+        i = (i + 1) & mask;
+        if (index->entries[i].value == NULL)
+            break;
+        home = index_hash (index->entries[i].key) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            index->entries[hole] = index->entries[i];
+            hole = i;
+        }
+    }
+    index->entries[hole].value = NULL;
+    return value;
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef __arena_h
+#define __arena_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include "errors.h"
+
+/*
+ * A reference-counted arena of interned strings, for text that
+ * many alarms share. Each distinct string is stored once, and an
+ * alarm holds a reference to it rather than a copy of it. The
+ * reference is simply the string's address, which does not change
+ * while any reference is held, so it can be printed or compared
+ * without a lock; two references are to the same text exactly
+ * when they are the same pointer.
+ *
+ *      arena_t strings = ARENA_INITIALIZER;
+ *
+ *      alarm->message = arena_put (&strings, text);
+ *      job->message = arena_ref (&strings, alarm->message);
+ *      printf ("%s\n", job->message);
+ *      arena_release (&strings, job->message);
+ *
+ * Strings are carved out of ARENA_CHUNK byte chunks, each behind a
+ * small header holding its reference count and its link in a hash
+ * table of the live strings. When the last reference to a string
+ * is released, its space goes onto a free list for its size,
+ * rounded up to ARENA_ALIGN bytes, and is reused by the next string
+ * of that size; chunks are never handed back to malloc. A string
+ * too long for any size class is allocated on its own.
+ *
+ * Unlike intern.h, whose strings move as its pool grows, the arena
+ * has a mutex of its own, and any thread may use it.
+ */
+#define ARENA_CHUNK     65536           /* Bytes allocated at a time */
+#define ARENA_ALIGN     16
+#define ARENA_CLASSES   32              /* Sizes up to 512 bytes */
+
+typedef struct arena_string_tag {
+    struct arena_string_tag *next;      /* Hash chain, or free list */
+    unsigned int        hash;
+    int                 refs;
+    int                 size;           /* Of the whole record */
+    char                text[];
+} arena_string_t;
+
+typedef struct arena_tag {
+    pthread_mutex_t     mutex;
+    arena_string_t      **buckets;
+    int                 size;           /* Buckets; always a power of 2 */
+    int                 count;          /* Live strings */
+    char                *chunk;         /* Being carved */
+    int                 chunk_used;
+    long                bytes;          /* Taken from malloc */
+    arena_string_t      *free[ARENA_CLASSES];
+} arena_t;
+
+#define ARENA_INITIALIZER       {PTHREAD_MUTEX_INITIALIZER}
+
+static inline void arena_lock (arena_t *arena, int locking)
+{
+    int status;
+
+    if (locking)
+        status = pthread_mutex_lock (&arena->mutex);
+    else
+        status = pthread_mutex_unlock (&arena->mutex);
+    if (status != 0)
+        err_abort (status, locking ? "Lock arena" : "Unlock arena");
+}
+
+static inline arena_string_t *arena_string (const char *text)
+{
+    return (arena_string_t*)(text - offsetof (arena_string_t, text));
+}
+
+/*
+ * Double the hash table, moving every live string into it. The
+ * caller must have locked the arena.
+ */
+static inline void arena_grow (arena_t *arena)
+{
+    arena_string_t **buckets, *string, *next;
+    int size, i;
+
+    size = arena->size ? arena->size * 2 : 256;
+    buckets = (arena_string_t**)calloc (size, sizeof (arena_string_t*));
+    if (buckets == NULL)
+        errno_abort ("Grow arena table");
+    for (i = 0; i < arena->size; i++)
+        for (string = arena->buckets[i]; string != NULL; string = next) {
+            next = string->next;
+            string->next = buckets[string->hash & (size - 1)];
+            buckets[string->hash & (size - 1)] = string;
+        }
+    free (arena->buckets);
+    arena->buckets = buckets;
+    arena->size = size;
+}
+
+/*
+ * Return a reference to "text", adding it to the arena if it is
+ * not there already.
+ */
+static inline const char *arena_put (arena_t *arena, const char *text)
+{
+    arena_string_t *string, **bucket;
+    unsigned int hash = 2166136261u;
+    int length, size, class;
+
+    for (length = 0; text[length] != '\0'; length++)
+        hash = (hash ^ (unsigned char)text[length]) * 16777619u;
+    arena_lock (arena, 1);
+    if (arena->count >= arena->size)
+        arena_grow (arena);
+    bucket = &arena->buckets[hash & (arena->size - 1)];
+    for (string = *bucket; string != NULL; string = string->next)
+        if (string->hash == hash && strcmp (string->text, text) == 0) {
+            string->refs++;
+            arena_lock (arena, 0);
+            return string->text;
+        }
+
+    size = (offsetof (arena_string_t, text) + length + ARENA_ALIGN)
+        / ARENA_ALIGN * ARENA_ALIGN;
+    class = size / ARENA_ALIGN;
+    if (class >= ARENA_CLASSES) {
+        string = (arena_string_t*)malloc (size);
+        if (string == NULL)
+            errno_abort ("Allocate arena string");
+        arena->bytes += size;
+    } else if (arena->free[class] != NULL) {
+        string = arena->free[class];
+        arena->free[class] = string->next;
+    } else {
+        if (arena->chunk == NULL || arena->chunk_used + size > ARENA_CHUNK) {
+            arena->chunk = (char*)malloc (ARENA_CHUNK);
+            if (arena->chunk == NULL)
+                errno_abort ("Allocate arena chunk");
+            arena->chunk_used = 0;
+            arena->bytes += ARENA_CHUNK;
+        }
+        string = (arena_string_t*)(arena->chunk + arena->chunk_used);
+        arena->chunk_used += size;
+    }
+    string->hash = hash;
+    string->refs = 1;
+    string->size = size;
+    memcpy (string->text, text, length + 1);
+    string->next = *bucket;
+    *bucket = string;
+    arena->count++;
+    arena_lock (arena, 0);
+    return string->text;
+}
+
+/*
+ * Take another reference to a string from the arena.
+ */
+static inline const char *arena_ref (arena_t *arena, const char *text)
+{
+    arena_lock (arena, 1);
+    arena_string (text)->refs++;
+    arena_lock (arena, 0);
+    return text;
+}
+
+/*
+ * Drop a reference (NULL is ignored). The string is freed with its
+ * last reference.
+ */
+static inline void arena_release (arena_t *arena, const char *text)
+{
+    arena_string_t *string, **last;
+    int class;
+
+    if (text == NULL)
+        return;
+    string = arena_string (text);
+    arena_lock (arena, 1);
+    if (--string->refs == 0) {
+        for (last = &arena->buckets[string->hash & (arena->size - 1)];
+            *last != string; last = &(*last)->next)
+            ;
+        *last = string->next;
+        arena->count--;
+        class = string->size / ARENA_ALIGN;
+        if (class >= ARENA_CLASSES) {
+            arena->bytes -= string->size;
+            free (string);
+        } else {
+            string->next = arena->free[class];
+            arena->free[class] = string;
+        }
+    }
+    arena_lock (arena, 0);
+}
+
+#endif
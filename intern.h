@@ -0,0 +1,117 @@
+#ifndef __intern_h
+#define __intern_h
+
+#include "errors.h"
+
+/*
+ * A table of interned strings. Each distinct string is stored once,
+ * in one growing pool of characters, and is known by its number:
+ * the order in which it was first interned, starting at 0. A hash
+ * table of string numbers, with linear probing, finds a string
+ * that is already in the pool.
+ *
+ *      intern_t messages = INTERN_INITIALIZER;
+ *
+ *      n = intern_put (&messages, alarm->message);
+ *      printf ("%s\n", intern_get (&messages, n));
+ *
+ * The pool moves as it grows, so a pointer from intern_get is good
+ * only until the next intern_put. The table holds no lock of its
+ * own.
+ */
+typedef struct intern_tag {
+    char                *pool;          /* The strings, each NUL ended */
+    int                 pool_used;
+    int                 pool_size;
+    int                 *offsets;       /* Pool offset of each string */
+    int                 count;
+    int                 *slots;         /* String number + 1, or 0 */
+    int                 size;           /* Slots; always a power of 2 */
+} intern_t;
+
+#define INTERN_INITIALIZER      {NULL, 0, 0, NULL, 0, NULL, 0}
+
+static unsigned int intern_hash (const char *string)
+{
+    unsigned int h = 2166136261u;
+
+    while (*string != '\0')
+        h = (h ^ (unsigned char)*string++) * 16777619u;
+    return h;
+}
+
+static const char *intern_get (intern_t *table, int n)
+{
+    return table->pool + table->offsets[n];
+}
+
+/*
+ * Double the hash table, rehashing every string into it. The
+ * offsets array grows with it, since the table is never allowed to
+ * be more than half full.
+ */
+static void intern_grow (intern_t *table)
+{
+    unsigned int mask;
+    int i, j;
+
+    table->size = table->size ? table->size * 2 : 64;
+    free (table->slots);
+    table->slots = (int*)calloc (table->size, sizeof (int));
+    table->offsets = (int*)realloc (
+        table->offsets, table->size / 2 * sizeof (int));
+    if (table->slots == NULL || table->offsets == NULL)
+        errno_abort ("Grow intern table");
+    mask = table->size - 1;
+    for (i = 0; i < table->count; i++) {
+        j = intern_hash (intern_get (table, i)) & mask;
+        while (table->slots[j] != 0)
+            j = (j + 1) & mask;
+        table->slots[j] = i + 1;
+    }
+}
+
+/*
+ * Return the number of "string", adding it to the table if it is
+ * not there already.
+ */
+static int intern_put (intern_t *table, const char *string)
+{
+    unsigned int mask, i;
+    int length, n;
+
+    if ((table->count + 1) * 2 > table->size)
+        intern_grow (table);
+    mask = table->size - 1;
+    for (i = intern_hash (string) & mask; table->slots[i] != 0;
+        i = (i + 1) & mask)
+        if (strcmp (intern_get (table, table->slots[i] - 1), string) == 0)
+            return table->slots[i] - 1;
+
+    length = strlen (string) + 1;
+    if (table->pool_used + length > table->pool_size) {
+        table->pool_size = (table->pool_used + length) * 2;
+        table->pool = (char*)realloc (table->pool, table->pool_size);
+        if (table->pool == NULL)
+            errno_abort ("Grow intern pool");
+    }
+    memcpy (table->pool + table->pool_used, string, length);
+    n = table->count++;
+    table->offsets[n] = table->pool_used;
+    table->pool_used += length;
+    table->slots[i] = n + 1;
+    return n;
+}
+
+/*
+ * Forget every string, keeping the memory for reuse.
+ */
+static void intern_clear (intern_t *table)
+{
+    if (table->slots != NULL)
+        memset (table->slots, 0, table->size * sizeof (int));
+    table->count = 0;
+    table->pool_used = 0;
+}
+
+#endif
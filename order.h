@@ -0,0 +1,175 @@
+#ifndef __order_h
+#define __order_h
+
+#include <stdlib.h>
+#include "errors.h"
+
+/*
+ * An ordered index of items, kept as a skip list, so that the items
+ * in a range -- alarms with numbers from 100 to 199, or with
+ * messages starting "tenant7:" -- are found in time proportional to
+ * how many there are, plus the log of the size of the index, rather
+ * than by looking at every item.
+ *
+ * The index is given a function that orders its items, and must
+ * order any two distinct items (tie-break on something unique).
+ * A range is found with a second function, which says whether an
+ * item comes before the key that starts the range:
+ *
+ *      order_t by_number = ORDER_INITIALIZER (compare_number);
+ *
+ *      order_put (&by_number, alarm);
+ *      for (node = order_first (&by_number, number_before, &low);
+ *          node != NULL && ((alarm_t*)node->item)->number <= high;
+ *          node = node->next[0])
+ *          ...
+ *      order_remove (&by_number, alarm);
+ *
+ * Each item has a node of its own, linked into the lowest list and,
+ * with probability 1/4 at each step, into the lists above it; a
+ * search starts in the highest list and drops a level each time the
+ * next item is too far. The index holds no lock of its own; the
+ * caller protects it with the lock that protects its items.
+ */
+#define ORDER_LEVELS    24
+
+typedef int (*order_compare_t) (const void *a, const void *b);
+typedef int (*order_before_t) (const void *item, const void *key);
+
+typedef struct order_node_tag {
+    void                *item;
+    int                 levels;
+    struct order_node_tag *next[];
+} order_node_t;
+
+typedef struct order_tag {
+    order_compare_t     compare;
+    int                 levels;         /* Highest in use */
+    int                 count;
+    unsigned int        seed;
+    order_node_t        *head[ORDER_LEVELS];
+} order_t;
+
+#define ORDER_INITIALIZER(compare)      {compare, 0, 0, 1}
+
+/*
+ * Fill "update" with the link, at each level in use, to the first
+ * node whose item is not before "key".
+ */
+static inline void order_search (order_t *order, order_before_t before,
+    const void *key, order_node_t ***update)
+{
+    order_node_t **next = order->head;
+    int level;
+
+    for (level = order->levels - 1; level >= 0; level--) {
+        while (next[level] != NULL && before (next[level]->item, key))
+            next = next[level]->next;
+        update[level] = &next[level];
+    }
+}
+
+/*
+ * As order_search, but find the place of "item" itself, using the
+ * index's compare function. Returns whether "item" is there.
+ */
+static inline int order_search_item (
+    order_t *order, const void *item, order_node_t ***update)
+{
+    order_node_t **next = order->head;
+    int level;
+
+    for (level = order->levels - 1; level >= 0; level--) {
+        while (next[level] != NULL
+            && order->compare (next[level]->item, item) < 0)
+            next = next[level]->next;
+        update[level] = &next[level];
+    }
+    return order->levels > 0 && *update[0] != NULL
+        && (*update[0])->item == item;
+}
+
+static inline unsigned int order_random (order_t *order)
+{
+    order->seed = order->seed * 1103515245u + 12345u;
+    return order->seed >> 16;
+}
+
+static inline void order_put (order_t *order, void *item)
+{
+    order_node_t **update[ORDER_LEVELS], *node;
+    int levels = 1, level;
+
+    while (levels < ORDER_LEVELS && (order_random (order) & 3) == 0)
+        levels++;
+    order_search_item (order, item, update);
+    for (; order->levels < levels; order->levels++)
+        update[order->levels] = &order->head[order->levels];
+    node = (order_node_t*)malloc (
+        sizeof (order_node_t) + levels * sizeof (order_node_t*));
+    if (node == NULL)
+        errno_abort ("Allocate order node");
+    node->item = item;
+    node->levels = levels;
+    for (level = 0; level < levels; level++) {
+        node->next[level] = *update[level];
+        *update[level] = node;
+    }
+    order->count++;
+}
+
+/*
+ * Take "item" out of the index. Returns 0 if it was not there.
+ */
+static inline int order_remove (order_t *order, void *item)
+{
+    order_node_t **update[ORDER_LEVELS], *node;
+    int level;
+
+    if (!order_search_item (order, item, update))
+        return 0;
+    node = *update[0];
+    for (level = 0; level < node->levels; level++)
+        *update[level] = node->next[level];
+    free (node);
+    while (order->levels > 0 && order->head[order->levels - 1] == NULL)
+        order->levels--;
+    order->count--;
+    return 1;
+}
+
+/*
+ * Return the node of the first item that is not before "key", or
+ * NULL if there is none. The items from there on follow through
+ * next[0].
+ */
+static inline order_node_t *order_first (
+    order_t *order, order_before_t before, const void *key)
+{
+    order_node_t **update[ORDER_LEVELS];
+
+    if (order->levels == 0)
+        return NULL;
+    order_search (order, before, key, update);
+    return *update[0];
+}
+
+/*
+ * Empty the index, without looking at its items.
+ */
+static inline void order_clear (order_t *order)
+{
+    order_node_t *node, *next;
+    int level;
+
+    for (node = order->head[0]; node != NULL; node = next) {
+        next = node->next[0];
+        free (node);
+    }
+    for (level = 0; level < ORDER_LEVELS; level++)
+        order->head[level] = NULL;
+    order->levels = 0;
+    order->count = 0;
+}
+
+#endif
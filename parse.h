@@ -0,0 +1,160 @@
+#ifndef __parse_h
+#define __parse_h
+
+#include <stddef.h>
+#include <limits.h>
+
+/*
+ * Building blocks for a single-pass command parser. Each takes a
+ * pointer into the command line and returns a pointer just past
+ * what it matched, or NULL if the text there doesn't match, so a
+ * command grammar is written as a chain of calls:
+ *
+ *      p = parse_int (p, &alarm->seconds);
+ *      p = parse_literal (p, "Message(");
+ *      ...
+ *
+ * Every function passes NULL straight through, so the chain can
+ * be checked once at the end. Nothing is allocated; text is copied
+ * straight into the caller's buffers.
+ */
+
+/*
+ * Skip spaces and tabs.
+ */
+static inline const char *parse_space (const char *p)
+{
+    if (p == NULL)
+        return NULL;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+/*
+ * Match "word" exactly.
+ */
+static inline const char *parse_literal (const char *p, const char *word)
+{
+    if (p == NULL)
+        return NULL;
+    while (*word != '\0')
+        if (*p++ != *word++)
+            return NULL;
+    return p;
+}
+
+/*
+ * Match a decimal integer, with an optional sign, no larger in
+ * magnitude than INT_MAX; a longer one doesn't match.
+ */
+static inline const char *parse_int (const char *p, int *value)
+{
+    int negative = 0, result = 0, digit;
+
+    if (p == NULL)
+        return NULL;
+    if (*p == '-' || *p == '+')
+        negative = (*p++ == '-');
+    if (*p < '0' || *p > '9')
+        return NULL;
+    while (*p >= '0' && *p <= '9') {
+        digit = *p++ - '0';
+        if (result > (INT_MAX - digit) / 10)
+            return NULL;
+        result = result * 10 + digit;
+    }
+    *value = negative ? -result : result;
+    return p;
+}
+
+/*
+ * Match a non-negative decimal number with an optional fraction,
+ * such as "2" or "0.250".
+ */
+static inline const char *parse_decimal (const char *p, double *value)
+{
+    double result = 0, scale = 1;
+    int digits = 0;
+
+    if (p == NULL)
+        return NULL;
+    for (; *p >= '0' && *p <= '9'; p++, digits++)
+        result = result * 10 + (*p - '0');
+    if (*p == '.')
+        for (p++; *p >= '0' && *p <= '9'; p++, digits++)
+            result += (*p - '0') * (scale /= 10);
+    if (digits == 0)
+        return NULL;
+    *value = result;
+    return p;
+}
+
+/*
+ * Copy a word -- everything up to the next space or end of line --
+ * into "buffer", truncating it to fit. The word may not be empty.
+ */
+static inline const char *parse_word (const char *p, char *buffer, int size)
+{
+    int length = 0;
+
+    if (p == NULL)
+        return NULL;
+    for (; *p != '\0' && *p != '\n' && *p != ' ' && *p != '\t'; p++)
+        if (length < size - 1)
+            buffer[length++] = *p;
+    buffer[length] = '\0';
+    return length > 0 ? p : NULL;
+}
+
+/*
+ * Copy everything up to the character "stop" into "buffer",
+ * truncating it to fit, and match the "stop". The text may not be
+ * empty, and may not run past the end of the line.
+ */
+static inline const char *parse_until (
+    const char *p, int stop, char *buffer, int size)
+{
+    int length = 0;
+
+    if (p == NULL)
+        return NULL;
+    for (; *p != stop; p++) {
+        if (*p == '\0' || *p == '\n')
+            return NULL;
+        if (length < size - 1)
+            buffer[length++] = *p;
+    }
+    buffer[length] = '\0';
+    return length > 0 ? p + 1 : NULL;
+}
+
+/*
+ * Copy the rest of the line, without its newline, into "buffer",
+ * truncating it to fit. The text may not be empty.
+ */
+static inline const char *parse_text (const char *p, char *buffer, int size)
+{
+    int length = 0;
+
+    if (p == NULL)
+        return NULL;
+    for (; *p != '\0' && *p != '\n'; p++)
+        if (length < size - 1)
+            buffer[length++] = *p;
+    buffer[length] = '\0';
+    return length > 0 ? p : NULL;
+}
+
+/*
+ * Match the end of the line, allowing trailing blanks.
+ */
+static inline const char *parse_end (const char *p)
+{
+    p = parse_space (p);
+    if (p == NULL || (*p != '\0' && *p != '\n'))
+        return NULL;
+    return p;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef __pool_h
+#define __pool_h
+
+#include <pthread.h>
+#include <sched.h>
+#include "errors.h"
+
+/*
+ * A work-stealing pool of executor threads, so that a burst of work
+ * handed off by one thread is spread across every core instead of
+ * being done serially by the thread that found it.
+ *
+ * Each worker has a deque of its own. pool_submit pushes a batch of
+ * items onto the back of one worker's deque, picking the workers in
+ * turn. A worker takes items from the front of its own deque, up to
+ * POOL_TAKE at a time, so that its items run in the order they were
+ * submitted; when its deque is empty it steals half of the items at
+ * the back of another worker's deque, and only when every deque is
+ * empty does it sleep. Each deque has its own mutex, held just long
+ * enough to move items in or out, so workers contend only when one
+ * is stealing from another.
+ *
+ *      pool_start (4, run);
+ *      pool_submit (items, count);     (run (items[i]) for each i)
+ *      pool_wait ();
+ *
+ * With no workers (pool_start called with a count of 0),
+ * pool_submit runs each item itself before it returns.
+ */
+#define POOL_MAX        64              /* Most workers */
+#define POOL_TAKE       32              /* Items taken from own deque */
+#define POOL_STEAL      1024            /* Most items stolen at once */
+
+typedef void (*pool_func_t) (void *item);
+
+typedef struct pool_deque_tag {
+    pthread_mutex_t     mutex;
+    void                **items;        /* Ring of "size" items */
+    unsigned long       head;           /* Next item to take */
+    unsigned long       tail;           /* Next free place */
+    unsigned long       size;           /* Always a power of 2 */
+} pool_deque_t;
+
+static pool_deque_t pool_deques[POOL_MAX];
+static int pool_workers = 0;
+static pool_func_t pool_func = NULL;
+static unsigned int pool_next = 0;      /* Deque for the next batch */
+static unsigned long pool_submitted = 0;
+static unsigned long pool_done = 0;
+static long pool_pending = 0;           /* Items in any deque */
+static int pool_idle = 0;               /* Workers asleep */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static inline void pool_lock (pthread_mutex_t *mutex, int locking)
+{
+    int status;
+
+    if (locking)
+        status = pthread_mutex_lock (mutex);
+    else
+        status = pthread_mutex_unlock (mutex);
+    if (status != 0)
+        err_abort (status, locking ? "Lock pool" : "Unlock pool");
+}
+
+/*
+ * Append "count" items to the back of a deque, doubling its ring if
+ * they don't fit. The caller must have locked the deque.
+ */
+static inline void pool_push (pool_deque_t *deque, void **items, int count)
+{
+    void **ring;
+    unsigned long i, size;
+
+    if (deque->tail - deque->head + count > deque->size) {
+        for (size = deque->size ? deque->size : 256;
+            size < deque->tail - deque->head + count; size *= 2)
+            ;
+        ring = (void**)malloc (size * sizeof (void*));
+        if (ring == NULL)
+            errno_abort ("Grow pool deque");
+        for (i = deque->head; i != deque->tail; i++)
+            ring[i & (size - 1)] = deque->items[i & (deque->size - 1)];
+        free (deque->items);
+        deque->items = ring;
+        deque->size = size;
+    }
+    for (i = 0; i < count; i++)
+        deque->items[(deque->tail + i) & (deque->size - 1)] = items[i];
+    deque->tail += count;
+}
+
+/*
+ * Move up to POOL_TAKE items from the front of worker "self"'s own
+ * deque into "items", or, if it is empty, steal half of the items at
+ * the back of the first other deque that has any, up to POOL_STEAL.
+ * Stolen items beyond the first POOL_TAKE go onto the thief's own
+ * deque. Returns the number of items in "items".
+ */
+static inline int pool_take (int self, void **items)
+{
+    pool_deque_t *deque = &pool_deques[self], *victim;
+    void *stolen[POOL_STEAL];
+    unsigned long steal, i;
+    int count = 0, v;
+
+    pool_lock (&deque->mutex, 1);
+    while (count < POOL_TAKE && deque->head != deque->tail)
+        items[count++] = deque->items[deque->head++ & (deque->size - 1)];
+    pool_lock (&deque->mutex, 0);
+    if (count > 0) {
+        __atomic_sub_fetch (&pool_pending, count, __ATOMIC_SEQ_CST);
+        return count;
+    }
+
+    for (v = 1; v < pool_workers; v++) {
+        victim = &pool_deques[(self + v) % pool_workers];
+        if (__atomic_load_n (&victim->tail, __ATOMIC_RELAXED)
+            == __atomic_load_n (&victim->head, __ATOMIC_RELAXED))
+            continue;
+        pool_lock (&victim->mutex, 1);
+        steal = (victim->tail - victim->head + 1) / 2;
+        if (steal > POOL_STEAL)
+            steal = POOL_STEAL;
+        victim->tail -= steal;
+        for (i = 0; i < steal; i++)
+            stolen[i] =
+                victim->items[(victim->tail + i) & (victim->size - 1)];
+        pool_lock (&victim->mutex, 0);
+        if (steal == 0)
+            continue;
+        count = steal < POOL_TAKE ? steal : POOL_TAKE;
+        memcpy (items, stolen, count * sizeof (void*));
+        if (steal > count) {
+            pool_lock (&deque->mutex, 1);
+            pool_push (deque, stolen + count, steal - count);
+            pool_lock (&deque->mutex, 0);
+        }
+        __atomic_sub_fetch (&pool_pending, count, __ATOMIC_SEQ_CST);
+        return count;
+    }
+    return 0;
+}
+
+static inline void *pool_thread (void *arg)
+{
+    void *items[POOL_TAKE];
+    int self = (int)(long)arg;
+    int count, status, i;
+
+    while (1) {
+        count = pool_take (self, items);
+        if (count > 0) {
+            for (i = 0; i < count; i++)
+                pool_func (items[i]);
+            __atomic_add_fetch (&pool_done, count, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        /*
+         * Every deque looked empty. Say so before looking at
+         * pool_pending, so that a submitter either sees pool_idle
+         * and wakes us, or counted its items before we looked.
+         */
+        pool_lock (&pool_mutex, 1);
+        __atomic_add_fetch (&pool_idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n (&pool_pending, __ATOMIC_SEQ_CST) == 0) {
+            status = pthread_cond_wait (&pool_cond, &pool_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on pool");
+        }
+        __atomic_sub_fetch (&pool_idle, 1, __ATOMIC_SEQ_CST);
+        pool_lock (&pool_mutex, 0);
+    }
+    return NULL;
+}
+
+/*
+ * Start "count" workers, each of which runs "func" on the items
+ * it takes.
+ */
+static inline void pool_start (int count, pool_func_t func)
+{
+    pthread_t thread;
+    long i;
+    int status;
+
+    pool_func = func;
+    for (i = 0; i < count; i++) {
+        status = pthread_mutex_init (&pool_deques[i].mutex, NULL);
+        if (status != 0)
+            err_abort (status, "Init pool deque");
+    }
+    pool_workers = count;
+    for (i = 0; i < count; i++) {
+        status = pthread_create (&thread, NULL, pool_thread, (void*)i);
+        if (status != 0)
+            err_abort (status, "Create pool worker");
+    }
+}
+
+/*
+ * Hand "count" items to the pool, and wake any sleeping workers to
+ * come and steal them.
+ */
+static inline void pool_submit (void **items, int count)
+{
+    pool_deque_t *deque;
+    int status, i;
+
+    __atomic_add_fetch (&pool_submitted, count, __ATOMIC_RELAXED);
+    if (pool_workers == 0) {
+        for (i = 0; i < count; i++)
+            pool_func (items[i]);
+        __atomic_add_fetch (&pool_done, count, __ATOMIC_RELEASE);
+        return;
+    }
+    deque = &pool_deques[__atomic_fetch_add (
+        &pool_next, 1, __ATOMIC_RELAXED) % pool_workers];
+
+    /*
+     * Count the items before they can be taken: a worker may take
+     * them, and subtract them from pool_pending, as soon as the
+     * deque is unlocked. Counted afterwards, pool_pending could
+     * read negative, and a worker that saw it would not sleep.
+     */
+    __atomic_add_fetch (&pool_pending, count, __ATOMIC_SEQ_CST);
+    pool_lock (&deque->mutex, 1);
+    pool_push (deque, items, count);
+    pool_lock (&deque->mutex, 0);
+    if (__atomic_load_n (&pool_idle, __ATOMIC_SEQ_CST) > 0) {
+        pool_lock (&pool_mutex, 1);
+        status = pthread_cond_broadcast (&pool_cond);
+        if (status != 0)
+            err_abort (status, "Wake pool");
+        pool_lock (&pool_mutex, 0);
+    }
+}
+
+/*
+ * Wait until every item submitted so far has been run.
+ */
+static inline void pool_wait (void)
+{
+    unsigned long submitted;
+
+    submitted = __atomic_load_n (&pool_submitted, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n (&pool_done, __ATOMIC_ACQUIRE) < submitted)
+        sched_yield ();
+}
+
+#endif
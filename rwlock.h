@@ -0,0 +1,240 @@
+#ifndef __rwlock_h
+#define __rwlock_h
+
+#include <pthread.h>
+#include <semaphore.h>
+#include "errors.h"
+
+/*
+ * A reader-writer lock with a choice of policies, picked when the
+ * lock is initialized:
+ *
+ * RWLOCK_READER_PREF   The original pair of semaphores. Readers
+ *                      get in whenever another reader holds the
+ *                      lock, so a steady stream of readers can
+ *                      starve writers forever.
+ * RWLOCK_WRITER_PREF   A waiting writer stops new readers from
+ *                      getting in, so writers are never starved
+ *                      (but readers can be).
+ * RWLOCK_PHASE_FAIR    Read and write phases alternate: a waiting
+ *                      writer stops new readers, and when a writer
+ *                      unlocks, every reader that was waiting is
+ *                      let in before the next writer. Neither side
+ *                      can be starved.
+ * RWLOCK_PTHREAD       pthread_rwlock_t, with whatever policy the
+ *                      system gives it.
+ */
+#define RWLOCK_READER_PREF      0
+#define RWLOCK_WRITER_PREF      1
+#define RWLOCK_PHASE_FAIR       2
+#define RWLOCK_PTHREAD          3
+
+typedef struct rwlock_tag {
+    int                 kind;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      read_cond;      /* Readers wait for a phase */
+    pthread_cond_t      write_cond;     /* Writers wait for readers */
+    int                 readers;        /* Readers holding the lock */
+    int                 writer;         /* A writer holds the lock */
+    int                 read_waiters;
+    int                 write_waiters;
+    unsigned long       phase;          /* Read phases started */
+    sem_t               rw_sem;         /* RWLOCK_READER_PREF */
+    sem_t               count_sem;
+    pthread_rwlock_t    rwlock;         /* RWLOCK_PTHREAD */
+} rwlock_t;
+
+static const char *rwlock_names[] = {"reader", "writer", "phase", "pthread"};
+
+static void rwlock_init (rwlock_t *lock, int kind)
+{
+    int status;
+
+    memset (lock, 0, sizeof (rwlock_t));
+    lock->kind = kind;
+    switch (kind) {
+    case RWLOCK_READER_PREF:
+        if (sem_init (&lock->rw_sem, 0, 1) != 0
+            || sem_init (&lock->count_sem, 0, 1) != 0)
+            errno_abort ("Init rwlock semaphores");
+        break;
+    case RWLOCK_PTHREAD:
+        status = pthread_rwlock_init (&lock->rwlock, NULL);
+        if (status != 0)
+            err_abort (status, "Init rwlock");
+        break;
+    default:
+        status = pthread_mutex_init (&lock->mutex, NULL);
+        if (status != 0)
+            err_abort (status, "Init rwlock mutex");
+        status = pthread_cond_init (&lock->read_cond, NULL);
+        if (status != 0)
+            err_abort (status, "Init rwlock cond");
+        status = pthread_cond_init (&lock->write_cond, NULL);
+        if (status != 0)
+            err_abort (status, "Init rwlock cond");
+        break;
+    }
+}
+
+static void rwlock_mutex (rwlock_t *lock, int locking)
+{
+    int status;
+
+    if (locking)
+        status = pthread_mutex_lock (&lock->mutex);
+    else
+        status = pthread_mutex_unlock (&lock->mutex);
+    if (status != 0)
+        err_abort (status, locking ? "Lock rwlock" : "Unlock rwlock");
+}
+
+static void rwlock_wait (pthread_cond_t *cond, rwlock_t *lock)
+{
+    int status;
+
+    status = pthread_cond_wait (cond, &lock->mutex);
+    if (status != 0)
+        err_abort (status, "Wait on rwlock");
+}
+
+static void rwlock_signal (pthread_cond_t *cond, int all)
+{
+    int status;
+
+    status = all ? pthread_cond_broadcast (cond) : pthread_cond_signal (cond);
+    if (status != 0)
+        err_abort (status, "Signal rwlock");
+}
+
+static void rwlock_read_lock (rwlock_t *lock)
+{
+    unsigned long phase;
+    int status;
+
+    switch (lock->kind) {
+    case RWLOCK_READER_PREF:
+        sem_wait (&lock->count_sem);
+        if (++lock->readers == 1)
+            sem_wait (&lock->rw_sem);
+        sem_post (&lock->count_sem);
+        break;
+    case RWLOCK_PTHREAD:
+        status = pthread_rwlock_rdlock (&lock->rwlock);
+        if (status != 0)
+            err_abort (status, "Read lock");
+        break;
+    case RWLOCK_WRITER_PREF:
+        rwlock_mutex (lock, 1);
+        while (lock->writer || lock->write_waiters > 0)
+            rwlock_wait (&lock->read_cond, lock);
+        lock->readers++;
+        rwlock_mutex (lock, 0);
+        break;
+    case RWLOCK_PHASE_FAIR:
+        /*
+         * A reader that has to wait is counted in "readers" by
+         * the writer that ends the write phase, so it is already
+         * in when it wakes.
+         */
+        rwlock_mutex (lock, 1);
+        if (lock->writer || lock->write_waiters > 0) {
+            lock->read_waiters++;
+            phase = lock->phase;
+            while (lock->phase == phase)
+                rwlock_wait (&lock->read_cond, lock);
+        } else
+            lock->readers++;
+        rwlock_mutex (lock, 0);
+        break;
+    }
+}
+
+static void rwlock_read_unlock (rwlock_t *lock)
+{
+    int status;
+
+    switch (lock->kind) {
+    case RWLOCK_READER_PREF:
+        sem_wait (&lock->count_sem);
+        if (--lock->readers == 0)
+            sem_post (&lock->rw_sem);
+        sem_post (&lock->count_sem);
+        break;
+    case RWLOCK_PTHREAD:
+        status = pthread_rwlock_unlock (&lock->rwlock);
+        if (status != 0)
+            err_abort (status, "Read unlock");
+        break;
+    default:
+        rwlock_mutex (lock, 1);
+        if (--lock->readers == 0 && lock->write_waiters > 0)
+            rwlock_signal (&lock->write_cond, 0);
+        rwlock_mutex (lock, 0);
+        break;
+    }
+}
+
+static void rwlock_write_lock (rwlock_t *lock)
+{
+    int status;
+
+    switch (lock->kind) {
+    case RWLOCK_READER_PREF:
+        sem_wait (&lock->rw_sem);
+        break;
+    case RWLOCK_PTHREAD:
+        status = pthread_rwlock_wrlock (&lock->rwlock);
+        if (status != 0)
+            err_abort (status, "Write lock");
+        break;
+    default:
+        rwlock_mutex (lock, 1);
+        lock->write_waiters++;
+        while (lock->writer || lock->readers > 0)
+            rwlock_wait (&lock->write_cond, lock);
+        lock->write_waiters--;
+        lock->writer = 1;
+        rwlock_mutex (lock, 0);
+        break;
+    }
+}
+
+static void rwlock_write_unlock (rwlock_t *lock)
+{
+    int status;
+
+    switch (lock->kind) {
+    case RWLOCK_READER_PREF:
+        sem_post (&lock->rw_sem);
+        break;
+    case RWLOCK_PTHREAD:
+        status = pthread_rwlock_unlock (&lock->rwlock);
+        if (status != 0)
+            err_abort (status, "Write unlock");
+        break;
+    case RWLOCK_WRITER_PREF:
+        rwlock_mutex (lock, 1);
+        lock->writer = 0;
+        if (lock->write_waiters > 0)
+            rwlock_signal (&lock->write_cond, 0);
+        else
+            rwlock_signal (&lock->read_cond, 1);
+        rwlock_mutex (lock, 0);
+        break;
+    case RWLOCK_PHASE_FAIR:
+        rwlock_mutex (lock, 1);
+        lock->writer = 0;
+        if (lock->read_waiters > 0) {
+            lock->readers += lock->read_waiters;
+            lock->read_waiters = 0;
+            lock->phase++;
+            rwlock_signal (&lock->read_cond, 1);
+        } else if (lock->write_waiters > 0)
+            rwlock_signal (&lock->write_cond, 0);
+        rwlock_mutex (lock, 0);
+        break;
+    }
+}
+
+#endif
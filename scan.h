@@ -0,0 +1,273 @@
+#ifndef __scan_h
+#define __scan_h
+
+#include <stdint.h>
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/*
+ * Scans over a set of pending alarms kept as a structure of
+ * arrays: the deadlines in one contiguous array of int64_t, the
+ * ids in another of int, in the same order, with the rest of each
+ * alarm somewhere else. A scan then reads only the field it
+ * compares, eight or sixteen to a cache line, and can compare
+ * several at once:
+ *
+ *      count = scan_expired (times, n, now, out);   (out[] = indexes)
+ *      i = scan_find (ids, n, id);                  (or -1)
+ *      earliest = scan_earliest (times, n);         (n > 0)
+ *
+ * Each scan has a scalar version and, on x86, SSE and AVX2
+ * versions. These are compiled with target attributes, so no
+ * special compiler flags are needed, and scan_init picks the
+ * widest that the processor supports (or the one asked for) at
+ * run time. The SSE scans of deadlines need SSE4.2, for its 64-bit
+ * compare.
+ */
+#define SCAN_SCALAR     0
+#define SCAN_SSE        1
+#define SCAN_AVX2       2
+
+static int scan_mode = SCAN_SCALAR;
+
+static inline const char *scan_name (int mode)
+{
+    return mode == SCAN_AVX2 ? "avx2" : mode == SCAN_SSE ? "sse" : "scalar";
+}
+
+/*
+ * Return whether the processor can run the scans of "mode".
+ */
+static inline int scan_supported (int mode)
+{
+#ifdef SCAN_X86
+    if (mode == SCAN_AVX2)
+        return __builtin_cpu_supports ("avx2");
+    if (mode == SCAN_SSE)
+        return __builtin_cpu_supports ("sse4.2");
+#endif
+    return mode == SCAN_SCALAR;
+}
+
+/*
+ * Use the scans of "mode", or, if "mode" is -1, the widest the
+ * processor supports.
+ */
+static inline void scan_init (int mode)
+{
+    if (mode < 0)
+        for (mode = SCAN_AVX2; !scan_supported (mode); mode--)
+            ;
+    scan_mode = mode;
+}
+
+static inline int scan_expired_scalar (
+    const int64_t *times, int count, int64_t now, int *out)
+{
+    int i, found = 0;
+
+    for (i = 0; i < count; i++)
+        if (times[i] <= now)
+            out[found++] = i;
+    return found;
+}
+
+static inline int scan_find_scalar (const int *ids, int count, int id)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (ids[i] == id)
+            return i;
+    return -1;
+}
+
+static inline int64_t scan_earliest_scalar (const int64_t *times, int count)
+{
+    int64_t earliest = times[0];
+    int i;
+
+    for (i = 1; i < count; i++)
+        if (times[i] < earliest)
+            earliest = times[i];
+    return earliest;
+}
+
+#ifdef SCAN_X86
+/*
+ * The vector scans compare a block of deadlines or ids at once,
+ * and turn the result into a bit mask with movemask, so a block
+ * with nothing to report costs a single test. The few elements
+ * left over after the last whole block are done one at a time.
+ */
+__attribute__ ((target ("sse4.2")))
+static inline int scan_expired_sse (
+    const int64_t *times, int count, int64_t now, int *out)
+{
+    __m128i limit = _mm_set1_epi64x (now);
+    int i, mask, found = 0;
+
+    for (i = 0; i + 2 <= count; i += 2) {
+        mask = ~_mm_movemask_pd (_mm_castsi128_pd (_mm_cmpgt_epi64 (
+            _mm_loadu_si128 ((const __m128i*)(times + i)), limit))) & 0x3;
+        for (; mask != 0; mask &= mask - 1)
+            out[found++] = i + __builtin_ctz (mask);
+    }
+    for (; i < count; i++)
+        if (times[i] <= now)
+            out[found++] = i;
+    return found;
+}
+
+__attribute__ ((target ("avx2")))
+static inline int scan_expired_avx2 (
+    const int64_t *times, int count, int64_t now, int *out)
+{
+    __m256i limit = _mm256_set1_epi64x (now);
+    int i, mask, found = 0;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        mask = ~_mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpgt_epi64 (
+            _mm256_loadu_si256 ((const __m256i*)(times + i)), limit))) & 0xf;
+        for (; mask != 0; mask &= mask - 1)
+            out[found++] = i + __builtin_ctz (mask);
+    }
+    for (; i < count; i++)
+        if (times[i] <= now)
+            out[found++] = i;
+    return found;
+}
+
+__attribute__ ((target ("sse4.2")))
+static inline int scan_find_sse (const int *ids, int count, int id)
+{
+    __m128i key = _mm_set1_epi32 (id);
+    int i, mask;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        mask = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (
+            _mm_loadu_si128 ((const __m128i*)(ids + i)), key)));
+        if (mask != 0)
+            return i + __builtin_ctz (mask);
+    }
+    for (; i < count; i++)
+        if (ids[i] == id)
+            return i;
+    return -1;
+}
+
+__attribute__ ((target ("avx2")))
+static inline int scan_find_avx2 (const int *ids, int count, int id)
+{
+    __m256i key = _mm256_set1_epi32 (id);
+    int i, mask;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        mask = _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpeq_epi32 (
+            _mm256_loadu_si256 ((const __m256i*)(ids + i)), key)));
+        if (mask != 0)
+            return i + __builtin_ctz (mask);
+    }
+    for (; i < count; i++)
+        if (ids[i] == id)
+            return i;
+    return -1;
+}
+
+__attribute__ ((target ("sse4.2")))
+static inline int64_t scan_earliest_sse (const int64_t *times, int count)
+{
+    __m128i earliest, next;
+    int64_t lanes[2], result;
+    int i;
+
+    if (count < 2)
+        return times[0];
+    earliest = _mm_loadu_si128 ((const __m128i*)times);
+    for (i = 2; i + 2 <= count; i += 2) {
+        next = _mm_loadu_si128 ((const __m128i*)(times + i));
+        earliest = _mm_blendv_epi8 (
+            earliest, next, _mm_cmpgt_epi64 (earliest, next));
+    }
+    _mm_storeu_si128 ((__m128i*)lanes, earliest);
+    result = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    for (; i < count; i++)
+        if (times[i] < result)
+            result = times[i];
+    return result;
+}
+
+__attribute__ ((target ("avx2")))
+static inline int64_t scan_earliest_avx2 (const int64_t *times, int count)
+{
+    __m256i earliest, next;
+    int64_t lanes[4], result;
+    int i, j;
+
+    if (count < 4)
+        return scan_earliest_scalar (times, count);
+    earliest = _mm256_loadu_si256 ((const __m256i*)times);
+    for (i = 4; i + 4 <= count; i += 4) {
+        next = _mm256_loadu_si256 ((const __m256i*)(times + i));
+        earliest = _mm256_blendv_epi8 (
+            earliest, next, _mm256_cmpgt_epi64 (earliest, next));
+    }
+    _mm256_storeu_si256 ((__m256i*)lanes, earliest);
+    result = lanes[0];
+    for (j = 1; j < 4; j++)
+        if (lanes[j] < result)
+            result = lanes[j];
+    for (; i < count; i++)
+        if (times[i] < result)
+            result = times[i];
+    return result;
+}
+#endif
+
+/*
+ * Store in "out" the index of every deadline that is no later than
+ * "now", in increasing order, and return how many there are.
+ */
+static inline int scan_expired (
+    const int64_t *times, int count, int64_t now, int *out)
+{
+#ifdef SCAN_X86
+    if (scan_mode == SCAN_AVX2)
+        return scan_expired_avx2 (times, count, now, out);
+    if (scan_mode == SCAN_SSE)
+        return scan_expired_sse (times, count, now, out);
+#endif
+    return scan_expired_scalar (times, count, now, out);
+}
+
+/*
+ * Return the index of the first "id", or -1 if there is none.
+ */
+static inline int scan_find (const int *ids, int count, int id)
+{
+#ifdef SCAN_X86
+    if (scan_mode == SCAN_AVX2)
+        return scan_find_avx2 (ids, count, id);
+    if (scan_mode == SCAN_SSE)
+        return scan_find_sse (ids, count, id);
+#endif
+    return scan_find_scalar (ids, count, id);
+}
+
+/*
+ * Return the earliest of "count" deadlines; "count" must not be 0.
+ */
+static inline int64_t scan_earliest (const int64_t *times, int count)
+{
+#ifdef SCAN_X86
+    if (scan_mode == SCAN_AVX2)
+        return scan_earliest_avx2 (times, count);
+    if (scan_mode == SCAN_SSE)
+        return scan_earliest_sse (times, count);
+#endif
+    return scan_earliest_scalar (times, count);
+}
+
+#endif
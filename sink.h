@@ -0,0 +1,250 @@
+#ifndef __sink_h
+#define __sink_h
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <sched.h>
+#include "errors.h"
+
+/*
+ * An asynchronous output sink, so that a slow terminal or pipe
+ * holds up only the thread that writes to it, and never a thread
+ * that prints with a mutex locked.
+ *
+ * sink_printf formats its message straight into a slot of a ring
+ * of SINK_SLOTS messages, and a writer thread copies the messages
+ * out and writes them to the file descriptor up to SINK_BUFFER
+ * bytes at a time. The ring is lock-free for any number of
+ * producers and the one consumer: each slot carries a sequence
+ * number that says whether it is free for the producer that claims
+ * position "pos" (sequence == pos), or holds that producer's
+ * message (sequence == pos + 1). Producers claim positions with a
+ * compare-and-swap on sink_tail. When the ring is empty the writer
+ * sleeps on a semaphore, which a producer posts only if it sees
+ * sink_idle set. In the same way, a producer that finds the ring
+ * full under SINK_BLOCK counts itself in sink_waiting and sleeps on
+ * a second semaphore, which the writer posts once for each waiter
+ * after it frees slots.
+ *
+ * When the ring is full, sink_policy decides:
+ *
+ * SINK_BLOCK   The producer sleeps until there is room, so nothing
+ *              is lost.
+ * SINK_DROP    The message is thrown away.
+ * SINK_COUNT   The message is thrown away, and the writer reports
+ *              how many were lost, "[N messages dropped]", once
+ *              it has caught up.
+ *
+ * Until sink_start is called, sink_printf is just printf.
+ */
+#define SINK_SLOTS      4096            /* Always a power of 2 */
+#define SINK_TEXT       244             /* Longest message, with NUL */
+#define SINK_BUFFER     65536           /* Bytes per write */
+
+#define SINK_BLOCK      0
+#define SINK_DROP       1
+#define SINK_COUNT      2
+
+typedef struct sink_slot_tag {
+    unsigned long       sequence;
+    int                 length;
+    char                text[SINK_TEXT];
+} sink_slot_t;
+
+static sink_slot_t sink_ring[SINK_SLOTS];
+static unsigned long sink_tail = 0;     /* Next position to claim */
+static unsigned long sink_head = 0;     /* Next position to write */
+static unsigned long sink_written = 0;  /* Positions written out */
+static unsigned long sink_dropped = 0;
+static int sink_fd = -1;                /* -1 until sink_start */
+static int sink_policy = SINK_BLOCK;
+static int sink_idle = 0;               /* The writer is asleep */
+static int sink_waiting = 0;            /* Producers wanting room */
+static sem_t sink_wake;
+static sem_t sink_room;
+
+static inline void sink_poke (void)
+{
+    if (sem_post (&sink_wake) != 0)
+        errno_abort ("Wake sink writer");
+}
+
+/*
+ * Sleep until the slot for position "pos" has been written out,
+ * under SINK_BLOCK. Counting ourselves in sink_waiting before
+ * looking once more means the writer either sees the count and
+ * posts, or freed the slot before that last look.
+ */
+static inline void sink_wait_room (sink_slot_t *slot, unsigned long pos)
+{
+    __atomic_add_fetch (&sink_waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&sink_idle, __ATOMIC_SEQ_CST))
+        sink_poke ();
+    if ((long)(__atomic_load_n (&slot->sequence, __ATOMIC_SEQ_CST) - pos) < 0)
+        while (sem_wait (&sink_room) != 0)
+            if (errno != EINTR)
+                errno_abort ("Wait for sink room");
+    __atomic_sub_fetch (&sink_waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void sink_write (const char *buffer, int length)
+{
+    int done, count;
+
+    for (done = 0; done < length; done += count) {
+        count = write (sink_fd, buffer + done, length - done);
+        if (count < 0) {
+            if (errno == EINTR) {
+                count = 0;
+                continue;
+            }
+            errno_abort ("Write sink");
+        }
+    }
+}
+
+static inline void *sink_thread (void *arg)
+{
+    static char buffer[SINK_BUFFER];
+    sink_slot_t *slot;
+    unsigned long dropped, reported = 0, first;
+    int used, waiting;
+
+    while (1) {
+        used = 0;
+        first = sink_head;
+        while (used + SINK_TEXT <= SINK_BUFFER - 64) {
+            slot = &sink_ring[sink_head & (SINK_SLOTS - 1)];
+            if (__atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE)
+                != sink_head + 1)
+                break;
+            memcpy (buffer + used, slot->text, slot->length);
+            used += slot->length;
+            __atomic_store_n (
+                &slot->sequence, sink_head + SINK_SLOTS, __ATOMIC_RELEASE);
+            sink_head++;
+        }
+        if (sink_head != first) {
+            __atomic_thread_fence (__ATOMIC_SEQ_CST);
+            for (waiting = __atomic_load_n (&sink_waiting, __ATOMIC_SEQ_CST);
+                    waiting > 0; waiting--)
+                if (sem_post (&sink_room) != 0)
+                    errno_abort ("Make sink room");
+        }
+        dropped = __atomic_load_n (&sink_dropped, __ATOMIC_RELAXED);
+        if (sink_policy == SINK_COUNT && dropped != reported) {
+            used += sprintf (buffer + used, "[%lu messages dropped]\n",
+                dropped - reported);
+            reported = dropped;
+        }
+        if (used > 0) {
+            sink_write (buffer, used);
+            __atomic_store_n (&sink_written, sink_head, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        /*
+         * The ring is empty. Say so before looking once more, so
+         * that a producer either sees sink_idle and posts, or
+         * published its message before that last look.
+         */
+        __atomic_store_n (&sink_idle, 1, __ATOMIC_SEQ_CST);
+        slot = &sink_ring[sink_head & (SINK_SLOTS - 1)];
+        if (__atomic_load_n (&slot->sequence, __ATOMIC_SEQ_CST)
+            != sink_head + 1)
+            while (sem_wait (&sink_wake) != 0)
+                if (errno != EINTR)
+                    errno_abort ("Wait for sink");
+        __atomic_store_n (&sink_idle, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/*
+ * Send everything printed with sink_printf to "fd" through the
+ * writer thread, with the given overflow policy.
+ */
+static inline void sink_start (int fd, int policy)
+{
+    pthread_t thread;
+    unsigned long i;
+    int status;
+
+    for (i = 0; i < SINK_SLOTS; i++)
+        sink_ring[i].sequence = i;
+    if (sem_init (&sink_wake, 0, 0) != 0
+        || sem_init (&sink_room, 0, 0) != 0)
+        errno_abort ("Init sink semaphore");
+    sink_policy = policy;
+    sink_fd = fd;
+    status = pthread_create (&thread, NULL, sink_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create sink writer");
+}
+
+static inline void sink_printf (const char *format, ...)
+{
+    sink_slot_t *slot;
+    unsigned long pos, sequence;
+    va_list ap;
+    long diff;
+    int length;
+
+    va_start (ap, format);
+    if (sink_fd < 0) {
+        vprintf (format, ap);
+        va_end (ap);
+        return;
+    }
+    pos = __atomic_load_n (&sink_tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &sink_ring[pos & (SINK_SLOTS - 1)];
+        sequence = __atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (long)(sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n (&sink_tail, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /*
+             * The slot still holds a message from a lap ago: the
+             * ring is full.
+             */
+            if (sink_policy != SINK_BLOCK) {
+                __atomic_add_fetch (&sink_dropped, 1, __ATOMIC_RELAXED);
+                va_end (ap);
+                return;
+            }
+            sink_wait_room (slot, pos);
+            pos = __atomic_load_n (&sink_tail, __ATOMIC_RELAXED);
+        } else
+            pos = __atomic_load_n (&sink_tail, __ATOMIC_RELAXED);
+    }
+    length = vsnprintf (slot->text, SINK_TEXT, format, ap);
+    va_end (ap);
+    if (length < 0)
+        length = 0;
+    slot->length = length < SINK_TEXT ? length : SINK_TEXT - 1;
+    __atomic_store_n (&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&sink_idle, __ATOMIC_SEQ_CST))
+        sink_poke ();
+}
+
+/*
+ * Wait until everything printed so far has been written, as
+ * before the program exits.
+ */
+static inline void sink_flush (void)
+{
+    unsigned long tail;
+
+    if (sink_fd < 0)
+        return;
+    tail = __atomic_load_n (&sink_tail, __ATOMIC_ACQUIRE);
+    sink_poke ();
+    while (__atomic_load_n (&sink_written, __ATOMIC_ACQUIRE) < tail)
+        sched_yield ();
+}
+
+#endif
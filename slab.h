@@ -0,0 +1,192 @@
+#ifndef __slab_h
+#define __slab_h
+
+#include <pthread.h>
+#include "errors.h"
+
+/*
+ * A fixed-size object allocator for alarm structures. Objects are
+ * carved out of large chunks and never handed back to malloc;
+ * freed objects go onto a free list and are reused. Each thread
+ * keeps a small free list of its own, so that most allocations and
+ * frees take no lock at all. Only when a thread's list runs dry,
+ * or grows past SLAB_CACHE_MAX, does it lock the slab and move a
+ * batch of SLAB_BATCH objects to or from the shared free list.
+ * That is what happens when, for example, the main thread
+ * allocates every alarm and the alarm thread frees them. When a
+ * thread exits, a thread-specific data destructor returns its
+ * whole list to the shared one, so that threads that come and go
+ * do not strand objects.
+ *
+ * The per-thread lists are static to the including program, so
+ * a program should allocate from only one slab.
+ *
+ *      slab_t alarm_slab = SLAB_INITIALIZER (alarm_t);
+ *
+ *      alarm = (alarm_t*)slab_alloc (&alarm_slab);
+ *      slab_free (&alarm_slab, alarm);
+ */
+#define SLAB_CHUNK      256     /* Objects allocated at a time */
+#define SLAB_BATCH      64      /* Objects moved to or from a thread */
+#define SLAB_CACHE_MAX  (SLAB_BATCH * 2)
+
+typedef struct slab_object_tag {
+    struct slab_object_tag *next;
+} slab_object_t;
+
+typedef struct slab_tag {
+    pthread_mutex_t     mutex;
+    size_t              size;           /* Size of one object */
+    slab_object_t       *free_list;     /* Shared free objects */
+} slab_t;
+
+#define SLAB_INITIALIZER(type) \
+    {PTHREAD_MUTEX_INITIALIZER, \
+     (sizeof (type) + sizeof (void*) - 1) / sizeof (void*) * sizeof (void*), \
+     NULL}
+
+static __thread slab_object_t *slab_cache = NULL;
+static __thread int slab_cache_count = 0;
+static __thread int slab_cache_keyed = 0;       /* Destructor set */
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The thread-specific data destructor: give the exiting thread's
+ * free list back to the slab.
+ */
+static void slab_thread_exit (void *arg)
+{
+    slab_t *slab = (slab_t*)arg;
+    slab_object_t *last;
+    int status;
+
+    if (slab_cache == NULL)
+        return;
+    for (last = slab_cache; last->next != NULL; last = last->next)
+        ;
+    status = pthread_mutex_lock (&slab->mutex);
+    if (status != 0)
+        err_abort (status, "Lock slab");
+    last->next = slab->free_list;
+    slab->free_list = slab_cache;
+    status = pthread_mutex_unlock (&slab->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock slab");
+    slab_cache = NULL;
+    slab_cache_count = 0;
+}
+
+static void slab_key_create (void)
+{
+    int status;
+
+    status = pthread_key_create (&slab_key, slab_thread_exit);
+    if (status != 0)
+        err_abort (status, "Create slab key");
+}
+
+/*
+ * Arrange for the calling thread's free list to be returned when
+ * it exits, the first time the thread keeps any objects.
+ */
+static void slab_key_set (slab_t *slab)
+{
+    int status;
+
+    status = pthread_once (&slab_key_once, slab_key_create);
+    if (status != 0)
+        err_abort (status, "Once slab key");
+    status = pthread_setspecific (slab_key, slab);
+    if (status != 0)
+        err_abort (status, "Set slab key");
+    slab_cache_keyed = 1;
+}
+
+/*
+ * Refill the calling thread's free list with a batch of objects
+ * from the shared list, carving a new chunk if that is empty.
+ */
+static void slab_refill (slab_t *slab)
+{
+    slab_object_t *object;
+    char *chunk;
+    int status, i;
+
+    if (!slab_cache_keyed)
+        slab_key_set (slab);
+    status = pthread_mutex_lock (&slab->mutex);
+    if (status != 0)
+        err_abort (status, "Lock slab");
+    if (slab->free_list == NULL) {
+        chunk = (char*)malloc (slab->size * SLAB_CHUNK);
+        if (chunk == NULL)
+            errno_abort ("Allocate slab chunk");
+        for (i = SLAB_CHUNK - 1; i >= 0; i--) {
+            object = (slab_object_t*)(chunk + i * slab->size);
+            object->next = slab->free_list;
+            slab->free_list = object;
+        }
+    }
+    while (slab->free_list != NULL && slab_cache_count < SLAB_BATCH) {
+        object = slab->free_list;
+        slab->free_list = object->next;
+        object->next = slab_cache;
+        slab_cache = object;
+        slab_cache_count++;
+    }
+    status = pthread_mutex_unlock (&slab->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock slab");
+}
+
+/*
+ * Return one batch of the calling thread's free objects to the
+ * shared list.
+ */
+static void slab_drain (slab_t *slab)
+{
+    slab_object_t *first, *last;
+    int status, i;
+
+    first = last = slab_cache;
+    for (i = 1; i < SLAB_BATCH; i++)
+        last = last->next;
+    slab_cache = last->next;
+    slab_cache_count -= SLAB_BATCH;
+
+    status = pthread_mutex_lock (&slab->mutex);
+    if (status != 0)
+        err_abort (status, "Lock slab");
+    last->next = slab->free_list;
+    slab->free_list = first;
+    status = pthread_mutex_unlock (&slab->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock slab");
+}
+
+static void *slab_alloc (slab_t *slab)
+{
+    slab_object_t *object;
+
+    if (slab_cache == NULL)
+        slab_refill (slab);
+    object = slab_cache;
+    slab_cache = object->next;
+    slab_cache_count--;
+    return object;
+}
+
+static void slab_free (slab_t *slab, void *pointer)
+{
+    slab_object_t *object = (slab_object_t*)pointer;
+
+    if (!slab_cache_keyed)
+        slab_key_set (slab);
+    object->next = slab_cache;
+    slab_cache = object;
+    if (++slab_cache_count > SLAB_CACHE_MAX)
+        slab_drain (slab);
+}
+
+#endif